@@ -26,6 +26,7 @@ SOURCES += MapGraphicsScene.cpp \
     guts/PrivateQGraphicsView.cpp \
     tileSources/OSMTileSource.cpp \
     guts/MapGraphicsNetwork.cpp \
+    guts/NetworkResponse.cpp \
     tileSources/CompositeTileSource.cpp \
     guts/MapTileLayerListModel.cpp \
     guts/MapTileSourceDelegate.cpp \
@@ -37,7 +38,18 @@ SOURCES += MapGraphicsScene.cpp \
     LineObject.cpp \
     tileSources/FileSystemTileSource.cpp \
     tileSources/GoogleTileSource.cpp \
-    tileSources/LabelTileSource.cpp
+    tileSources/LabelTileSource.cpp \
+    TileKey.cpp \
+    guts/DiskTileCache.cpp \
+    guts/TileFileCache.cpp \
+    guts/PackFileTileCache.cpp \
+    guts/DiskCacheIO.cpp \
+    guts/TilePrefetcher.cpp \
+    guts/TileUrlTemplate.cpp \
+    tileSources/UrlTemplateTileSource.cpp \
+    guts/WebMercator.cpp \
+    guts/EnuFrame.cpp \
+    guts/TileExecutor.cpp
 
 HEADERS += MapGraphicsScene.h\
         MapGraphics_global.h \
@@ -52,6 +64,7 @@ HEADERS += MapGraphicsScene.h\
     guts/PrivateQGraphicsView.h \
     tileSources/OSMTileSource.h \
     guts/MapGraphicsNetwork.h \
+    guts/NetworkResponse.h \
     tileSources/CompositeTileSource.h \
     guts/MapTileLayerListModel.h \
     guts/MapTileSourceDelegate.h \
@@ -63,7 +76,19 @@ HEADERS += MapGraphicsScene.h\
     LineObject.h \
     tileSources/FileSystemTileSource.h \
     tileSources/GoogleTileSource.h \
-    tileSources/LabelTileSource.h
+    tileSources/LabelTileSource.h \
+    TileKey.h \
+    guts/DiskTileCache.h \
+    guts/TileFileCache.h \
+    guts/PackFileTileCache.h \
+    guts/DiskCacheIO.h \
+    guts/TilePrefetcher.h \
+    guts/TileUrlTemplate.h \
+    tileSources/UrlTemplateTileSource.h \
+    guts/WebMercator.h \
+    guts/EnuFrame.h \
+    guts/Wgs84.h \
+    guts/TileExecutor.h
 
 symbian {
     MMP_RULES += EXPORTUNFROZEN
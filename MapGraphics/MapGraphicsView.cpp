@@ -7,17 +7,22 @@
 #include <QQueue>
 #include <QSet>
 #include <QWheelEvent>
-#include <QCoreApplication>
-#include <QThread>
 #include <QMenu>
 
 #include "guts/PrivateQGraphicsScene.h"
 #include "guts/PrivateQGraphicsView.h"
 #include "guts/Conversions.h"
+#include "guts/TileExecutor.h"
+
+//GUI memory for tiles that can stand in for others while they load
+const int TILE_PIXMAP_CACHE_BYTES = 48 * 1024 * 1024;
 
 MapGraphicsView::MapGraphicsView(MapGraphicsScene *scene, QWidget *parent) :
     QWidget(parent)
 {
+    _prefetcher = new TilePrefetcher(this);
+    _tilePixmaps.setMaxCost(TILE_PIXMAP_CACHE_BYTES);
+
     //Setup the given scene and set the default zoomLevel to 3
     this->setScene(scene);
     _zoomLevel = 2;
@@ -46,29 +51,12 @@ MapGraphicsView::~MapGraphicsView()
     }
     _tileObjects.clear();
 
-    if (!_tileSource.isNull())
-    {
-        //Find the tileSource's thread
-        QPointer<QThread> tileSourceThread = _tileSource->thread();
-
-        /*
-         Clear the QSharedPointer to the tilesource. Unless there's a serious problem, we should be the
-         last thing holding that reference and we expect it to be deleted
-        */
-        _tileSource.clear();
-
-        //After the tilesource is deleted, we wait for the thread it was running in to shut down
-        int count = 0;
-        const int maxCount = 100;
-        while (!tileSourceThread.isNull() && !tileSourceThread->wait(100))
-        {
-            //We have to process events while it's shutting down in case it uses signals/slots to shut down
-            //Hint: it does
-            QCoreApplication::processEvents(QEventLoop::ExcludeSocketNotifiers | QEventLoop::ExcludeUserInputEvents);
-            if (++count == maxCount)
-                break;
-        }
-    }
+    /*
+     Clear the QSharedPointer to the tilesource. Unless there's a serious problem, we should be the
+     last thing holding that reference and we expect it to be deleted. Its thread is shared, so
+     there's nothing to wait for.
+    */
+    _tileSource.clear();
 }
 
 QPointF MapGraphicsView::center() const
@@ -228,30 +216,25 @@ QSharedPointer<MapTileSource> MapGraphicsView::tileSource() const
 void MapGraphicsView::setTileSource(QSharedPointer<MapTileSource> tSource)
 {
     _tileSource = tSource;
+    _prefetcher->setTileSource(tSource);
 
+    //Tiles of another source make poor stand-ins
+    _tilePixmaps.clear();
+
+    //The tile source runs on one of the threads all tile sources share
     if (!_tileSource.isNull())
-    {
-        //Create a thread just for the tile source
-        QThread * tileSourceThread = new QThread();
-        tileSourceThread->start();
-        _tileSource->moveToThread(tileSourceThread);
-
-        //Set it up so that the thread is destroyed when the tile source is!
-        connect(_tileSource.data(),
-                SIGNAL(destroyed()),
-                tileSourceThread,
-                SLOT(quit()));
-        connect(tileSourceThread,
-                SIGNAL(finished()),
-                tileSourceThread,
-                SLOT(deleteLater()));
-    }
+        TileExecutor::getInstance()->adopt(_tileSource.data());
 
     //Update our tile displays (if any) about the new tile source
     foreach(MapTileGraphicsObject * tileObject, _tileObjects)
         tileObject->setTileSource(tSource);
 }
 
+TilePrefetcher *MapGraphicsView::prefetcher() const
+{
+    return _prefetcher;
+}
+
 quint8 MapGraphicsView::zoomLevel() const
 {
     return _zoomLevel;
@@ -274,14 +257,21 @@ void MapGraphicsView::setZoomLevel(quint8 nZoom, ZoomMode zMode)
     //Change the zoom level
     nZoom = qMin(_tileSource->maxZoomLevel(),qMax(_tileSource->minZoomLevel(),nZoom));
 
+    //Tiles deeper than this have no keys, whatever the source says
+    nZoom = qMin(TileKey::MAX_ZOOM, nZoom);
+
     if (nZoom == _zoomLevel)
         return;
 
     _zoomLevel = nZoom;
 
     //Disable all tile display temporarily. They'll redisplay properly when the timer ticks
+    //Tiles of the old zoom level that haven't arrived yet aren't worth waiting for
     foreach(MapTileGraphicsObject * tileObject, _tileObjects)
+    {
         tileObject->setVisible(false);
+        tileObject->cancelRequest();
+    }
 
     //Make sure the QGraphicsScene is the right size
     this->resetQGSSceneSize();
@@ -297,6 +287,12 @@ void MapGraphicsView::setZoomLevel(quint8 nZoom, ZoomMode zMode)
     else
         this->centerOn(centerGeoPos);
 
+    /*
+      Lay the tiles out for the new zoom level right away instead of waiting for the timer. Until their own
+      tiles arrive, they show scaled versions of the previous level's tiles, so the screen never goes blank.
+    */
+    this->renderTiles();
+
     //Make MapGraphicsObjects update
     this->zoomLevelChanged(nZoom);
 }
@@ -400,6 +396,9 @@ void MapGraphicsView::doTileLayout()
     const QPolygonF viewportPolygonQGS = _childView->mapToScene(viewportPolygonQGV);
     const QRectF boundingRect = viewportPolygonQGS.boundingRect();
 
+    //The tile source loads tiles from where we're looking outwards
+    _tileSource->setPriorityCenter(centerPointQGS, this->zoomLevel());
+
     //We exaggerate the bounding rect for some purposes!
     QRectF exaggeratedBoundingRect = boundingRect;
     exaggeratedBoundingRect.setSize(boundingRect.size()*2.0);
@@ -415,6 +414,9 @@ void MapGraphicsView::doTileLayout()
         {
             freeTiles.enqueue(tileObject);
             tileObject->setVisible(false);
+
+            //It has left the viewport, so don't keep the tile source busy with it
+            tileObject->cancelRequest();
         }
         else
             placesWhereTilesAre.insert(tileObject->pos());
@@ -454,6 +456,7 @@ void MapGraphicsView::doTileLayout()
             if (freeTiles.isEmpty())
             {
                 MapTileGraphicsObject * tileObject = new MapTileGraphicsObject(tileSize);
+                tileObject->setPixmapCache(&_tilePixmaps);
                 tileObject->setTileSource(_tileSource);
                 _tileObjects.insert(tileObject);
                 _childScene->addItem(tileObject);
@@ -466,9 +469,15 @@ void MapGraphicsView::doTileLayout()
             if (tileObject->isVisible() != true)
                 tileObject->setVisible(true);
             tileObject->setTile(x,y,this->zoomLevel());
+            _prefetcher->tileNeeded(x,y,this->zoomLevel());
         }
     }
 
+    //Now that the view has asked for what it shows, use what's left of the source's time for what's next
+    _prefetcher->viewChanged(centerPointQGS,
+                             QRect(xc, yc, xMax - xc, yMax - yc),
+                             this->zoomLevel());
+
     //If we've got a lot of free tiles left over, delete some of them
     while (freeTiles.size() > 2)
     {
@@ -19,6 +19,7 @@
 
 #include "guts/MapTileGraphicsObject.h"
 #include "guts/PrivateQGraphicsInfoSource.h"
+#include "guts/TilePrefetcher.h"
 
 class MAPGRAPHICSSHARED_EXPORT MapGraphicsView : public QWidget, public PrivateQGraphicsInfoSource
 {
@@ -75,6 +76,9 @@ public:
     void zoomOut(ZoomMode zMode = CenterZoom);
 
     void rotate(qreal angle);
+
+    //Loads tiles that are likely to be needed soon. Use it to tune or disable prefetching.
+    TilePrefetcher * prefetcher() const;
     
 signals:
     void zoomLevelChanged(quint8 nZoom);
@@ -105,6 +109,11 @@ private:
 
     QSet<MapTileGraphicsObject *> _tileObjects;
 
+    TilePrefetcher * _prefetcher;
+
+    //What the tile objects have displayed, so they can stand in for each other while loading
+    TilePixmapCache _tilePixmaps;
+
     quint8 _zoomLevel;
 
     DragMode _dragMode;
@@ -3,381 +3,1556 @@
 #include <QStringBuilder>
 #include <QMutexLocker>
 #include <QtDebug>
-#include <QStringList>
-#include <QDataStream>
+#include <QDir>
+#include <QVector>
+#include <QtAlgorithms>
+#include <QTimer>
+#include <climits>
+#include <cmath>
+
+#include "guts/DiskTileCache.h"
+#include "guts/DiskCacheIO.h"
+#include "guts/TileFileCache.h"
+#include "guts/PackFileTileCache.h"
+#include "guts/TileExecutor.h"
 
 const QString MAPGRAPHICS_CACHE_FOLDER_NAME = ".MapGraphicsCache";
 const quint32 DEFAULT_CACHE_DAYS = 7;
-const quint64 MAX_DISK_CACHE_READ_ATTEMPTS = 100000;
 
-MapTileSource::MapTileSource() :
-    QObject(), _cacheExpirationsLoaded(false)
+//A request that hasn't completed or failed after this long no longer holds back new requests for its tile
+const qint64 IN_FLIGHT_TIMEOUT_MS = 60 * 1000;
+
+//How many tiles a source reads or fetches at once unless told otherwise
+const int DEFAULT_MAX_CONCURRENT_REQUESTS = 6;
+
+//Default budget for decoded tiles kept in memory, per source
+const int DEFAULT_MEMORY_CACHE_BYTES = 32 * 1024 * 1024;
+
+//Tiles that are used within this long of their expiration are refreshed ahead of time
+const qint64 REFRESH_AHEAD_MSECS = 60 * 60 * 1000;
+
+//How many tiles per minute may be refreshed ahead of time unless told otherwise
+const int DEFAULT_REFRESH_TILES_PER_MINUTE = 30;
+
+//Refreshes beyond this are dropped. The tiles are refreshed when they're used again.
+const int MAX_QUEUED_REFRESHES = 256;
+
+//How long we believe a tile doesn't exist unless told otherwise, and how many such tiles we remember
+const int DEFAULT_MISSING_TILE_TTL_SECS = 60 * 60;
+const int MAX_MISSING_TILES = 100000;
+
+//The validators of a tile are kept as one opaque blob. Header values can't contain newlines.
+static QByteArray joinValidators(const QByteArray& etag, const QByteArray& lastModified)
+{
+    if (etag.isEmpty() && lastModified.isEmpty())
+        return QByteArray();
+    return etag + '\n' + lastModified;
+}
+
+static void splitValidators(const QByteArray& validators, QByteArray * etag, QByteArray * lastModified)
+{
+    const int split = validators.indexOf('\n');
+    *etag = validators.left(split);
+    *lastModified = (split < 0) ? QByteArray() : validators.mid(split + 1);
+}
+
+//static
+QAtomicInt MapTileSource::_defaultMemoryCacheCapacity(DEFAULT_MEMORY_CACHE_BYTES);
+
+static MapTileSource::DiskCacheStats toDiskCacheStats(const DiskTileCache::Stats& stats)
+{
+    MapTileSource::DiskCacheStats toRet;
+    toRet.bytesUsed = stats.bytesUsed;
+    toRet.capacityBytes = stats.capacityBytes;
+    toRet.expiredEvictions = stats.expiredEvictions;
+    toRet.lruEvictions = stats.lruEvictions;
+    toRet.droppedWrites = stats.droppedWrites;
+    toRet.lastScanMsecs = stats.lastScanMsecs;
+    toRet.lastScan = stats.lastScan;
+    return toRet;
+}
+
+//A queued request as seen by the scheduler
+struct QueuedTile
+{
+    int zoomDistance;
+    int kind;
+    qreal distance;
+    quint64 sequence;
+    TileKey key;
+};
+
+static bool higherPriority(const QueuedTile& a, const QueuedTile& b)
+{
+    if (a.zoomDistance != b.zoomDistance)
+        return a.zoomDistance < b.zoomDistance;
+    if (a.kind != b.kind)
+        return a.kind < b.kind;
+    if (a.distance != b.distance)
+        return a.distance < b.distance;
+    return a.sequence < b.sequence;
+}
+
+//The memory cache is charged by the size of the decoded pixels, not per tile
+static int memoryCacheCost(const TileImage& image)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,10,0)
+    return (int) qMin<qint64>(image->sizeInBytes(), INT_MAX);
+#else
+    return image->byteCount();
+#endif
+}
+
+/*
+  Tiles are kept in the formats the raster paint engine draws from directly: RGB32 if they're opaque,
+  ARGB32_Premultiplied if not. The GUI thread can then make pixmaps of them without converting.
+*/
+static QImage toDisplayFormat(const QImage& image)
+{
+    if (image.isNull() || !image.hasAlphaChannel())
+        return image.convertToFormat(QImage::Format_RGB32);
+
+    QImage toRet = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    //Plenty of tiles have an alpha channel they don't use
+    for (int y = 0; y < toRet.height(); y++)
+    {
+        const QRgb * line = reinterpret_cast<const QRgb *>(toRet.constScanLine(y));
+        for (int x = 0; x < toRet.width(); x++)
+        {
+            if (qAlpha(line[x]) != 255)
+                return toRet;
+        }
+    }
+
+    //Opaque premultiplied pixels are RGB32 pixels already
+#if QT_VERSION >= QT_VERSION_CHECK(5,9,0)
+    toRet.reinterpretAsFormat(QImage::Format_RGB32);
+    return toRet;
+#else
+    return toRet.convertToFormat(QImage::Format_RGB32);
+#endif
+}
+
+//Returns a null image if data isn't an image we can read
+static QImage decodeTile(const QByteArray& data)
+{
+    QImage image;
+    if (!image.loadFromData(data))
+        return QImage();
+    return toDisplayFormat(image);
+}
+
+//Produces one tile of a source on a worker thread
+class ProduceTileJob : public TileJob
+{
+public:
+    ProduceTileJob(MapTileSource * source, const TileKey& key) : _source(source), _key(key) {}
+
+    //virtual from TileJob
+    virtual void run()
+    {
+        //The tile may have been cancelled while we were queued
+        if (!_source->isInFlight(_key))
+            return;
+        _source->produceTile(_key.x(), _key.y(), _key.z());
+    }
+
+private:
+    MapTileSource * _source;
+    TileKey _key;
+};
+
+//Decodes a tile that a source received on a worker thread and hands it over
+class DecodeTileJob : public TileJob
+{
+public:
+    DecodeTileJob(MapTileSource * source,
+                  const TileKey& key,
+                  const QByteArray& encodedImage,
+                  const QDateTime& expireTime,
+                  const QByteArray& etag,
+                  const QByteArray& lastModified) :
+        _source(source), _key(key), _encodedImage(encodedImage), _expireTime(expireTime), _etag(etag),
+        _lastModified(lastModified) {}
+
+    //virtual from TileJob
+    virtual void run()
+    {
+        if (!_source->isInFlight(_key))
+            return;
+
+        const QImage image = decodeTile(_encodedImage);
+        if (image.isNull())
+        {
+            qWarning() << "Failed to decode" << _key;
+            _source->prepareFailedTile(_key.x(), _key.y(), _key.z());
+            return;
+        }
+        //decodeTile() made it display-ready already
+        _source->prepareDisplayReadyTile(_key.x(), _key.y(), _key.z(), TileImage(new QImage(image)),
+                                         _encodedImage, _expireTime, _etag, _lastModified);
+    }
+
+private:
+    MapTileSource * _source;
+    TileKey _key;
+    QByteArray _encodedImage;
+    QDateTime _expireTime;
+    QByteArray _etag;
+    QByteArray _lastModified;
+};
+
+//Decodes a tile read from the disk cache on a worker thread and sends it back to the source's thread
+class DecodeCachedTileJob : public TileJob
+{
+public:
+    DecodeCachedTileJob(MapTileSource * source,
+                        const QSharedPointer<DiskTileCache>& cache,
+                        const TileKey& key,
+                        const QByteArray& data,
+                        const QDateTime& expireTime,
+                        const QByteArray& validators) :
+        _source(source), _cache(cache), _key(key), _data(data), _expireTime(expireTime),
+        _validators(validators) {}
+
+    //virtual from TileJob
+    virtual void run()
+    {
+        if (!_source->isInFlight(_key))
+            return;
+
+        const QImage image = decodeTile(_data);
+        if (image.isNull())
+        {
+            qWarning() << "Failed to decode" << _key << "from disk cache. Removing it.";
+            DiskCacheIO::getInstance()->queueRemove(_cache, _key);
+        }
+
+        QMetaObject::invokeMethod(_source,
+                                  "handleDecodedDiskTile",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(TileKey, _key),
+                                  Q_ARG(QImage, image),
+                                  Q_ARG(QDateTime, _expireTime),
+                                  Q_ARG(QByteArray, _validators));
+    }
+
+private:
+    MapTileSource * _source;
+    QSharedPointer<DiskTileCache> _cache;
+    TileKey _key;
+    QByteArray _data;
+    QDateTime _expireTime;
+    QByteArray _validators;
+};
+
+MapTileSource::MapTileSource() :
+    QObject(), _diskCacheFormat(TileFiles), _diskCacheCapacity(-1), _memoryCacheCapacity(-1),
+    _requestOrderDirty(false), _dispatchScheduled(false), _requestSequence(0),
+    _maxConcurrentRequests(DEFAULT_MAX_CONCURRENT_REQUESTS), _havePriorityCenter(false), _priorityZoom(0),
+    _refreshBudget(DEFAULT_REFRESH_TILES_PER_MINUTE), _refreshTokens(DEFAULT_REFRESH_TILES_PER_MINUTE),
+    _refreshRetryScheduled(false), _missingTileTtl(DEFAULT_MISSING_TILE_TTL_SECS),
+    _missingTileColor(Qt::transparent)
+{
+    //Tiles are handed to waiters across threads
+    qRegisterMetaType<TileKey>("TileKey");
+    qRegisterMetaType<TileImage>("TileImage");
+
+    this->setCacheMode(DiskAndMemCaching);
+    this->resetMemoryCacheStats();
+    this->applyMemoryCacheCapacity();
+    _missingTiles.setMaxCost(MAX_MISSING_TILES);
+
+    /*
+      We connect this signal/slot pair to communicate across threads. Requests that are still queued are
+      cancelled right away; the others are cancelled on our thread, after the dispatch that started them.
+    */
+    connect(this,
+            SIGNAL(tileRequestCancelled(quint32,quint32,quint8)),
+            this,
+            SLOT(cancelTileRequest(quint32,quint32,quint8)),
+            Qt::QueuedConnection);
+
+    /*
+      When all our tiles have been invalidated, we clear our temp cache so any misinformed clients
+      that don't notice will get a null tile instead of an old tile.
+    */
+    connect(this,
+            SIGNAL(allTilesInvalidated()),
+            this,
+            SLOT(clearTempCache()));
+}
+
+MapTileSource::~MapTileSource()
+{
+    //Tiles read from disk may still be being decoded
+    this->cancelProducedTiles();
+
+    if (_diskCache.isNull())
+        return;
+
+    //Reads we queued must not come back to a dead object
+    DiskCacheIO::getInstance()->cancelReads(this);
+
+    //Queued writes keep the backend alive. Whoever lets go of it last makes it write out what it buffered.
+    QMutexLocker lock(&_diskCacheLock);
+    _diskCache.clear();
+}
+
+void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z, MapTileSource::TileRequestKind kind)
+{
+    this->queueRequest(x,y,z,kind,true);
+}
+
+TileImage MapTileSource::getFinishedTile(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+    QMutexLocker lock(&_tempCacheLock);
+    TileImage * finished = _tempCache.object(key);
+    if (!finished)
+    {
+        qWarning() << "getFinishedTile() called, but the tile is not present";
+        return TileImage();
+    }
+
+    //The handle stays in the temp cache so that every client that asked for the tile can share it
+    return *finished;
+}
+
+void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z,
+                                QObject *receiver,
+                                const char *member,
+                                MapTileSource::TileRequestKind kind)
+{
+    this->addWaiter(x,y,z,receiver,member,false,0,kind);
+}
+
+void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z,
+                                QObject *receiver,
+                                const char *member,
+                                int tag,
+                                MapTileSource::TileRequestKind kind)
+{
+    this->addWaiter(x,y,z,receiver,member,true,tag,kind);
+}
+
+void MapTileSource::cancelTile(quint32 x, quint32 y, quint8 z, QObject *receiver)
+{
+    const TileKey key(x,y,z);
+
+    QMutexLocker lock(&_waitersLock);
+    QHash<TileKey, QList<TileWaiter> >::iterator it = _waiters.find(key);
+    if (it == _waiters.end())
+        return;
+
+    bool removed = false;
+    QList<TileWaiter>& waiters = it.value();
+    for (int i = 0; i < waiters.size(); i++)
+    {
+        if (waiters.at(i).receiver != receiver)
+            continue;
+        waiters.removeAt(i);
+        removed = true;
+        break;
+    }
+    if (waiters.isEmpty())
+        _waiters.erase(it);
+    lock.unlock();
+
+    //If receiver wasn't waiting anymore, the tile has already been handed over and there's nothing to cancel
+    if (removed)
+        this->cancelTile(x,y,z);
+}
+
+void MapTileSource::cancelTile(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+
+    //If the request hasn't been started yet, we just take it out of the queue
+    QMutexLocker lock(&_requestQueueLock);
+    QHash<TileKey, PendingRequest>::iterator it = _requestQueue.find(key);
+    if (it != _requestQueue.end())
+    {
+        if (--it.value().waiters <= 0)
+        {
+            _requestQueue.erase(it);
+            _requestOrderDirty = true;
+        }
+        return;
+    }
+    lock.unlock();
+
+    //Like requestTile(), this is called from another thread
+    this->tileRequestCancelled(x,y,z);
+}
+
+void MapTileSource::ll2qgsPoints(const QPointF *ll, QPointF *qgs, int count, quint8 zoomLevel) const
+{
+    for (int i = 0; i < count; i++)
+        qgs[i] = this->ll2qgs(ll[i], zoomLevel);
+}
+
+void MapTileSource::qgs2llPoints(const QPointF *qgs, QPointF *ll, int count, quint8 zoomLevel) const
+{
+    for (int i = 0; i < count; i++)
+        ll[i] = this->qgs2ll(qgs[i], zoomLevel);
+}
+
+void MapTileSource::setPriorityCenter(const QPointF &qgs, quint8 zoomLevel)
+{
+    const quint16 tileSize = this->tileSize();
+    if (tileSize == 0)
+        return;
+    const QPointF center = qgs / tileSize;
+
+    QMutexLocker lock(&_requestQueueLock);
+    if (_havePriorityCenter && _priorityZoom == zoomLevel && _priorityCenter == center)
+        return;
+    _havePriorityCenter = true;
+    _priorityCenter = center;
+    _priorityZoom = zoomLevel;
+    _requestOrderDirty = true;
+}
+
+int MapTileSource::maxConcurrentRequests() const
+{
+    QMutexLocker lock(&_requestQueueLock);
+    return _maxConcurrentRequests;
+}
+
+int MapTileSource::queuedRequests() const
+{
+    QMutexLocker lock(&_requestQueueLock);
+    return _requestQueue.size();
+}
+
+int MapTileSource::refreshBudget() const
+{
+    QMutexLocker lock(&_requestQueueLock);
+    return _refreshBudget;
+}
+
+void MapTileSource::setRefreshBudget(int tilesPerMinute)
+{
+    QMutexLocker lock(&_requestQueueLock);
+    _refreshBudget = qMax(0, tilesPerMinute);
+    _refreshTokens = qMin<qreal>(_refreshTokens, _refreshBudget);
+    lock.unlock();
+
+    this->scheduleDispatch();
+}
+
+void MapTileSource::setMaxConcurrentRequests(int count)
+{
+    QMutexLocker lock(&_requestQueueLock);
+    _maxConcurrentRequests = qMax(1, count);
+    lock.unlock();
+
+    //There may be room for more now
+    this->scheduleDispatch();
+}
+
+MapTileSource::CacheMode MapTileSource::cacheMode() const
+{
+    return _cacheMode;
+}
+
+void MapTileSource::setCacheMode(MapTileSource::CacheMode nMode)
+{
+    _cacheMode = nMode;
+}
+
+MapTileSource::DiskCacheFormat MapTileSource::diskCacheFormat() const
+{
+    return _diskCacheFormat;
+}
+
+void MapTileSource::setDiskCacheFormat(MapTileSource::DiskCacheFormat format)
+{
+    if (format == _diskCacheFormat)
+        return;
+    _diskCacheFormat = format;
+
+    //Drop the old backend. The new one is created the next time the disk cache is used.
+    QMutexLocker lock(&_diskCacheLock);
+    _diskCache.clear();
+}
+
+qint64 MapTileSource::diskCacheCapacity() const
+{
+    QMutexLocker lock(&_diskCacheLock);
+    return _diskCacheCapacity;
+}
+
+void MapTileSource::setDiskCacheCapacity(qint64 bytes)
+{
+    QMutexLocker lock(&_diskCacheLock);
+    _diskCacheCapacity = qMax<qint64>(-1, bytes);
+    if (_diskCache.isNull())
+        return;
+    _diskCache->setCapacity(_diskCacheCapacity);
+    lock.unlock();
+
+    DiskCacheIO::getInstance()->requestJanitor();
+}
+
+MapTileSource::DiskCacheStats MapTileSource::diskCacheStats() const
+{
+    QMutexLocker lock(&_diskCacheLock);
+    if (!_diskCache.isNull())
+        return toDiskCacheStats(_diskCache->stats());
+
+    MapTileSource::DiskCacheStats toRet;
+    toRet.bytesUsed = 0;
+    toRet.capacityBytes = _diskCacheCapacity;
+    toRet.expiredEvictions = 0;
+    toRet.lruEvictions = 0;
+    toRet.droppedWrites = 0;
+    toRet.lastScanMsecs = 0;
+    return toRet;
+}
+
+//static
+qint64 MapTileSource::globalDiskCacheCapacity()
+{
+    return DiskCacheIO::getInstance()->globalCapacity();
+}
+
+//static
+void MapTileSource::setGlobalDiskCacheCapacity(qint64 bytes)
+{
+    DiskCacheIO::getInstance()->setGlobalCapacity(bytes);
+}
+
+//static
+MapTileSource::DiskCacheStats MapTileSource::globalDiskCacheStats()
+{
+    return toDiskCacheStats(DiskCacheIO::getInstance()->globalStats());
+}
+
+int MapTileSource::memoryCacheCapacity() const
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    if (_memoryCacheCapacity < 0)
+        return MapTileSource::defaultMemoryCacheCapacity();
+    return _memoryCacheCapacity;
+}
+
+void MapTileSource::setMemoryCacheCapacity(int bytes)
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    _memoryCacheCapacity = qMax(-1, bytes);
+    this->applyMemoryCacheCapacity();
+}
+
+MapTileSource::MemoryCacheStats MapTileSource::memoryCacheStats() const
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    MapTileSource::MemoryCacheStats toRet = _memoryCacheStats;
+    toRet.tileCount = _memoryCache.count();
+    toRet.bytesUsed = _memoryCache.totalCost();
+    toRet.capacityBytes = _memoryCache.maxCost();
+    toRet.missingTileCount = _missingTiles.count();
+    return toRet;
+}
+
+void MapTileSource::resetMemoryCacheStats()
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    _memoryCacheStats.hits = 0;
+    _memoryCacheStats.misses = 0;
+    _memoryCacheStats.evictions = 0;
+    _memoryCacheStats.expirations = 0;
+    _memoryCacheStats.tileCount = 0;
+    _memoryCacheStats.bytesUsed = 0;
+    _memoryCacheStats.capacityBytes = 0;
+    _memoryCacheStats.missingTileHits = 0;
+    _memoryCacheStats.missingTileCount = 0;
+}
+
+int MapTileSource::missingTileTtl() const
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    return _missingTileTtl;
+}
+
+void MapTileSource::setMissingTileTtl(int seconds)
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    _missingTileTtl = qMax(0, seconds);
+    if (_missingTileTtl == 0)
+        _missingTiles.clear();
+}
+
+QColor MapTileSource::missingTileColor() const
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    return _missingTileColor;
+}
+
+void MapTileSource::setMissingTileColor(const QColor &color)
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    if (color == _missingTileColor)
+        return;
+    _missingTileColor = color;
+
+    //Made again the next time it's needed. Clients keep the old one as long as they like.
+    _missingTilePlaceholder.clear();
+}
+
+//static
+int MapTileSource::defaultMemoryCacheCapacity()
+{
+    return _defaultMemoryCacheCapacity.load();
+}
+
+//static
+void MapTileSource::setDefaultMemoryCacheCapacity(int bytes)
+{
+    _defaultMemoryCacheCapacity.store(qMax(0, bytes));
+}
+
+//public slot
+void MapTileSource::compactDiskCache()
+{
+    DiskCacheIO::getInstance()->queueCompact(this->diskCache());
+}
+
+//private slot
+void MapTileSource::dispatchRequests()
+{
+    QMutexLocker lock(&_requestQueueLock);
+    _dispatchScheduled = false;
+    lock.unlock();
+
+    //Start as many requests as we may, best first
+    TileKey key;
+    int waiters = 0;
+    while (this->takeNextRequest(&key, &waiters))
+        this->startTileRequest(key, waiters);
+
+    //Refreshes get whatever the requests leave over
+    this->startRefreshes();
+}
+
+//private
+void MapTileSource::startTileRequest(const TileKey &key, int waiters)
+{
+    const quint32 x = key.x();
+    const quint32 y = key.y();
+    const quint8 z = key.z();
+
+    //Tiles we know don't exist are answered right away, whatever the cache mode
+    if (this->isKnownMissing(key))
+    {
+        const quint16 size = this->tileSize();
+        QMutexLocker lock(&_memoryCacheLock);
+        const TileImage placeholder = this->missingTilePlaceholder(size);
+        lock.unlock();
+
+        this->deliverTile(x,y,z,placeholder);
+        return;
+    }
+
+    //Check the memory cache for the tile first
+    if (this->cacheMode() == DiskAndMemCaching)
+    {
+        bool expired = false;
+        TileImage cached = this->fromMemCache(key, &expired);
+
+        //If we got an image from memory, prepare it for the client and return. Stale is better than nothing.
+        if (!cached.isNull())
+        {
+            this->deliverTile(x,y,z,cached);
+            this->queueRefresh(key);
+            return;
+        }
+    }
+
+    //If the tile is already on its way, whoever asked now gets notified along with everyone else
+    if (!this->beginInFlight(key, waiters))
+        return;
+
+    //The disk cache answers asynchronously (see handleDiskCacheRead())
+    if (this->cacheMode() == DiskAndMemCaching && this->fromDiskCache(key))
+        return;
+
+    //If we get here, the tile was not cached and we must try to retrieve it
+    this->fetchTile(x,y,z);
+}
+
+//private slot
+void MapTileSource::cancelTileRequest(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+
+    //Tiles that have already been retrieved (or were served from memory) have nothing to cancel
+    QMutexLocker lock(&_inFlightLock);
+    QHash<TileKey, InFlightRequest>::iterator it = _inFlight.find(key);
+    if (it == _inFlight.end())
+        return;
+
+    //Someone else still wants it
+    if (--it.value().waiters > 0)
+        return;
+
+    _inFlight.erase(it);
+    lock.unlock();
+
+    //The tile is either waiting for the disk or being fetched
+    if (this->cacheMode() == DiskAndMemCaching)
+        DiskCacheIO::getInstance()->cancelRead(this, key);
+    this->cancelFetch(x,y,z);
+
+    //Its slot can go to someone else
+    this->scheduleDispatch();
+}
+
+//private slot
+void MapTileSource::handleDiskCacheRead(TileKey key, QByteArray data, QDateTime expireTime, QByteArray validators)
+{
+    //Nobody wants it anymore
+    if (!this->isInFlight(key))
+        return;
+
+    //A miss on disk means we have to retrieve it after all
+    if (data.isEmpty())
+    {
+        this->fetchTile(key.x(), key.y(), key.z());
+        return;
+    }
+
+    //It's decoded on a worker and comes back to handleDecodedDiskTile()
+    TileExecutor::getInstance()->submit(this,
+                                        new DecodeCachedTileJob(this, this->diskCache(), key, data,
+                                                                expireTime, validators),
+                                        this->maxConcurrentRequests());
+}
+
+//private slot
+void MapTileSource::handleDecodedDiskTile(TileKey key, QImage image, QDateTime expireTime, QByteArray validators)
+{
+    //A broken tile on disk means we have to retrieve it after all
+    if (image.isNull())
+    {
+        if (!this->isInFlight(key))
+            return;
+        this->fetchTile(key.x(), key.y(), key.z());
+        return;
+    }
+
+    //Keep it in memory too so we don't decode it again
+    const TileImage tile(new QImage(image));
+    this->toMemCache(key, tile, expireTime, validators);
+
+    //An expired tile is shown while we ask whether it's still current
+    this->prepareRetrievedTile(key.x(), key.y(), key.z(), tile);
+    this->queueRefresh(key);
+}
+
+//private slot
+void MapTileSource::clearTempCache()
+{
+    //Workers may be putting tiles into it right now
+    QMutexLocker tempLock(&_tempCacheLock);
+    _tempCache.clear();
+    tempLock.unlock();
+
+    //Requests made after the invalidation must not wait for results based on the old parameters
+    QMutexLocker lock(&_inFlightLock);
+    _inFlight.clear();
+    lock.unlock();
+
+    QMutexLocker queueLock(&_requestQueueLock);
+    _refreshQueue.clear();
+    queueLock.unlock();
+
+    //Tiles that didn't exist may well exist with the new parameters
+    QMutexLocker memoryLock(&_memoryCacheLock);
+    _missingTiles.clear();
+    memoryLock.unlock();
+
+    this->scheduleDispatch();
+}
+
+//private slot
+void MapTileSource::retryRefreshes()
+{
+    QMutexLocker lock(&_requestQueueLock);
+    _refreshRetryScheduled = false;
+    lock.unlock();
+
+    this->scheduleDispatch();
+}
+
+TileImage MapTileSource::fromMemCache(const TileKey &key, bool *expired)
+{
+    TileImage toRet;
+    bool isExpired = false;
+
+    QMutexLocker lock(&_memoryCacheLock);
+    const MemoryCacheEntry * entry = _memoryCache.object(key);
+    if (entry)
+    {
+        //Expired tiles are kept around for revalidation, but only handed out to those who asked for them
+        isExpired = entry->expireTime <= QDateTime::currentDateTimeUtc();
+        if (isExpired)
+            _memoryCacheStats.expirations++;
+        if (!isExpired || expired)
+            toRet = entry->image;
+    }
+
+    if (!toRet.isNull())
+        _memoryCacheStats.hits++;
+    else
+        _memoryCacheStats.misses++;
+
+    if (expired)
+        *expired = isExpired;
+    return toRet;
+}
+
+void MapTileSource::toMemCache(const TileKey &key,
+                               const TileImage &toCache,
+                               const QDateTime &expireTime,
+                               const QByteArray &validators)
+{
+    if (toCache.isNull())
+        return;
+
+    QMutexLocker lock(&_memoryCacheLock);
+
+    //Pick up changes to the process-wide default capacity
+    this->applyMemoryCacheCapacity();
+
+    //Note when the tile will expire
+    MemoryCacheEntry * entry = new MemoryCacheEntry();
+    entry->image = toCache;
+    entry->expireTime = expireTime;
+    entry->validators = validators;
+    if (entry->expireTime.isNull())
+        entry->expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    //Share the tile with the cache. QCache evicts least-recently-used tiles until the new one fits.
+    //An older version of the tile is replaced, which isn't an eviction.
+    const int countBefore = _memoryCache.count() - (_memoryCache.contains(key) ? 1 : 0);
+    const bool inserted = _memoryCache.insert(key,
+                                              entry,
+                                              memoryCacheCost(toCache));
+    _memoryCacheStats.evictions += countBefore + (inserted ? 1 : 0) - _memoryCache.count();
+}
+
+bool MapTileSource::fromDiskCache(const TileKey &key)
 {
-    this->setCacheMode(DiskAndMemCaching);
+    QSharedPointer<DiskTileCache> cache = this->diskCache();
 
-    //We connect this signal/slot pair to communicate across threads.
-    connect(this,
-            SIGNAL(tileRequested(quint32,quint32,quint8)),
-            this,
-            SLOT(startTileRequest(quint32,quint32,quint8)),
-            Qt::QueuedConnection);
+    //If the backend knows the tile isn't there, don't bother the I/O thread
+    if (!cache->mightContain(key))
+        return false;
 
-    /*
-      When all our tiles have been invalidated, we clear our temp cache so any misinformed clients
-      that don't notice will get a null tile instead of an old tile.
-    */
-    connect(this,
-            SIGNAL(allTilesInvalidated()),
-            this,
-            SLOT(clearTempCache()));
+    //The result comes back in handleDiskCacheRead(). If the I/O queue is full, treat it as a miss.
+    return DiskCacheIO::getInstance()->queueRead(cache, key, this, "handleDiskCacheRead");
 }
 
-MapTileSource::~MapTileSource()
+void MapTileSource::toDiskCache(const TileKey &key, const QImage &toCache, const QDateTime &expireTime)
 {
-    this->saveCacheExpirationsToDisk();
+    //Encoded with the source's file format on the I/O thread
+    const QByteArray format = this->tileFileExtension().remove('.').toLatin1();
+
+    QDateTime expires = expireTime;
+    if (expires.isNull())
+        expires = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    //Written behind our back. If the I/O thread is swamped the tile just doesn't get cached, which the
+    //disk cache stats count.
+    DiskCacheIO::getInstance()->queueWrite(this->diskCache(), key, toCache, format, expires);
 }
 
-void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z)
+void MapTileSource::toDiskCache(const TileKey &key,
+                                const QByteArray &encodedTile,
+                                const QDateTime &expireTime,
+                                const QByteArray &validators)
 {
-    /*We emit a signal to communicate across threads. MapTileSource (usually) runs in its own
-      thread, but this method will be called from a different thread (probably the GUI thread).
-      It's easy to communicate across threads with queued signals/slots.
-    */
-    this->tileRequested(x,y,z);
+    if (encodedTile.isEmpty())
+        return;
+
+    QDateTime expires = expireTime;
+    if (expires.isNull())
+        expires = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    //The backend stores the bytes we were given as they are
+    DiskCacheIO::getInstance()->queueWrite(this->diskCache(), key, encodedTile, expires, validators);
+}
+
+//private
+void MapTileSource::applyMemoryCacheCapacity()
+{
+    int capacity = _memoryCacheCapacity;
+    if (capacity < 0)
+        capacity = MapTileSource::defaultMemoryCacheCapacity();
+
+    if (capacity == _memoryCache.maxCost())
+        return;
+
+    const int countBefore = _memoryCache.count();
+    _memoryCache.setMaxCost(capacity);
+    _memoryCacheStats.evictions += countBefore - _memoryCache.count();
+}
+
+void MapTileSource::prepareRetrievedTile(quint32 x, quint32 y, quint8 z, const TileImage &image)
+{
+    //From now on, a request for the tile starts over (and will most likely hit the memory cache)
+    this->endInFlight(TileKey(x,y,z));
+
+    this->deliverTile(x, y, z, image);
 }
 
-QImage *MapTileSource::getFinishedTile(quint32 x, quint32 y, quint8 z)
+//private
+void MapTileSource::deliverTile(quint32 x, quint32 y, quint8 z, const TileImage &image)
 {
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    //Do tile sanity check here optionally
+    if (image.isNull())
+        return;
+
+    //Put it into the "temporary retrieval cache" so the user can grab it
     QMutexLocker lock(&_tempCacheLock);
-    if (!_tempCache.contains(cacheID))
+    _tempCache.insert(TileKey(x,y,z),
+                      new TileImage(image));
+    /*
+      We must explicitly unlock the mutex before emitting tileRetrieved in case
+      we're running in the GUI thread (since the signal can trigger
+      slots immediately in that case).
+    */
+    lock.unlock();
+
+    //Those who asked with a receiver get the tile directly
+    this->notifyWaiters(TileKey(x,y,z), image);
+
+    //Emit signal so user knows to call getFinishedTile()
+    this->tileRetrieved(x,y,z);
+}
+
+void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QImage &image, QDateTime expireTime)
+{
+    //From here on the tile is immutable and shared by the caches and every client
+    const TileImage tile(new QImage(toDisplayFormat(image)));
+
+    //Insert into caches when applicable
+    const TileKey key(x,y,z);
+    if (this->cacheMode() == DiskAndMemCaching)
     {
-        qWarning() << "getFinishedTile() called, but the tile is not present";
-        return 0;
+        this->toMemCache(key, tile, expireTime);
+        this->toDiskCache(key, image, expireTime);
     }
-    return _tempCache.take(cacheID);
+
+    //Put the tile in a client-accessible place and notify them
+    this->prepareRetrievedTile(x, y, z, tile);
 }
 
-MapTileSource::CacheMode MapTileSource::cacheMode() const
+void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z,
+                                             const QImage &image,
+                                             const QByteArray &encodedImage,
+                                             QDateTime expireTime,
+                                             const QByteArray &etag,
+                                             const QByteArray &lastModified)
 {
-    return _cacheMode;
+    const TileImage tile(new QImage(toDisplayFormat(image)));
+    this->prepareDisplayReadyTile(x, y, z, tile, encodedImage, expireTime, etag, lastModified);
 }
 
-void MapTileSource::setCacheMode(MapTileSource::CacheMode nMode)
+//private
+void MapTileSource::prepareDisplayReadyTile(quint32 x, quint32 y, quint8 z,
+                                            const TileImage &tile,
+                                            const QByteArray &encodedImage,
+                                            QDateTime expireTime,
+                                            const QByteArray &etag,
+                                            const QByteArray &lastModified)
 {
-    _cacheMode = nMode;
+    //Insert into caches when applicable. The disk cache gets the original bytes, untouched.
+    const TileKey key(x,y,z);
+    if (this->cacheMode() == DiskAndMemCaching)
+    {
+        const QByteArray validators = joinValidators(etag, lastModified);
+        this->toMemCache(key, tile, expireTime, validators);
+        this->toDiskCache(key, encodedImage, expireTime, validators);
+    }
+
+    //Put the tile in a client-accessible place and notify them
+    this->prepareRetrievedTile(x, y, z, tile);
 }
 
-//private slot
-void MapTileSource::startTileRequest(quint32 x, quint32 y, quint8 z)
+//protected
+void MapTileSource::prepareNotModifiedTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime)
 {
-    //Check caches for the tile first
+    const TileKey key(x,y,z);
     if (this->cacheMode() == DiskAndMemCaching)
     {
-        const QString cacheID = MapTileSource::createCacheID(x,y,z);
-        QImage * cached = this->fromMemCache(cacheID);
-        if (!cached)
-            cached = this->fromDiskCache(cacheID);
+        //Same bytes as before, they're just good for longer now
+        this->setTileExpirationTime(key, expireTime);
 
-        //If we got an image from one of the caches, prepare it for the client and return
-        if (cached)
+        const TileImage cached = this->fromMemCache(key);
+        if (!cached.isNull())
         {
-            this->prepareRetrievedTile(x,y,z,cached);
+            this->prepareRetrievedTile(x, y, z, cached);
             return;
         }
     }
 
-    //If we get here, the tile was not cached and we must try to retrieve it
+    //The tile was evicted while we were asking about it, so we have nothing to show after all
     this->fetchTile(x,y,z);
 }
 
-//private slot
-void MapTileSource::clearTempCache()
+//protected
+void MapTileSource::prepareMissingTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime)
 {
-    _tempCache.clear();
+    const TileKey key(x,y,z);
+    const quint16 size = this->tileSize();
+
+    QMutexLocker lock(&_memoryCacheLock);
+    if (_missingTileTtl > 0)
+    {
+        //The source may know better than our TTL, but not for longer
+        qint64 expires = QDateTime::currentMSecsSinceEpoch() + _missingTileTtl * (qint64) 1000;
+        if (expireTime.isValid())
+            expires = qMin(expires, expireTime.toMSecsSinceEpoch());
+        _missingTiles.insert(key, new qint64(expires), 1);
+    }
+
+    //A tile that has gone away (e.g. a refresh got a 404) mustn't be served from memory anymore
+    _memoryCache.remove(key);
+
+    const TileImage placeholder = this->missingTilePlaceholder(size);
+    lock.unlock();
+
+    //The placeholder isn't cached anywhere else. It's cheaper to remember that the tile is missing.
+    this->prepareRetrievedTile(x, y, z, placeholder);
 }
 
-//protected static
-QString MapTileSource::createCacheID(quint32 x, quint32 y, quint8 z)
+//protected
+void MapTileSource::prepareFailedTile(quint32 x, quint32 y, quint8 z)
 {
-    //We use % because it's more efficient to concatenate with QStringBuilder
-    QString toRet = QString::number(x) % "," % QString::number(y) % "," % QString::number(z);
-    return toRet;
+    //Let the next request for the tile try again
+    const TileKey key(x,y,z);
+    this->endInFlight(key);
+
+    //Only a refresh failed. Everyone who asked has the cached tile, which stays in service.
+    QDateTime expireTime;
+    QByteArray validators;
+    if (this->peekMemCache(key, &expireTime, &validators))
+        return;
+
+    //Don't leave anyone waiting for a tile that isn't coming
+    this->notifyWaiters(key, TileImage());
+    this->tileFailed(x,y,z);
+}
+
+//protected
+void MapTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    Q_UNUSED(x)
+    Q_UNUSED(y)
+    Q_UNUSED(z)
+}
+
+//protected
+void MapTileSource::produceTileOnWorker(quint32 x, quint32 y, quint8 z, int maxConcurrency)
+{
+    TileExecutor::getInstance()->submit(this,
+                                        new ProduceTileJob(this, TileKey(x,y,z)),
+                                        maxConcurrency);
+}
+
+//protected
+void MapTileSource::produceTile(quint32 x, quint32 y, quint8 z)
+{
+    Q_UNUSED(x)
+    Q_UNUSED(y)
+    Q_UNUSED(z)
+}
+
+//protected
+void MapTileSource::prepareEncodedTile(quint32 x, quint32 y, quint8 z,
+                                       const QByteArray &encodedImage,
+                                       QDateTime expireTime,
+                                       const QByteArray &etag,
+                                       const QByteArray &lastModified)
+{
+    TileExecutor::getInstance()->submit(this,
+                                        new DecodeTileJob(this, TileKey(x,y,z), encodedImage, expireTime,
+                                                          etag, lastModified),
+                                        this->maxConcurrentRequests());
+}
+
+//protected
+void MapTileSource::cancelProducedTiles()
+{
+    TileExecutor::getInstance()->cancelAll(this);
+}
+
+//protected
+void MapTileSource::revalidateTile(quint32 x, quint32 y, quint8 z, const QByteArray &etag, const QByteArray &lastModified)
+{
+    Q_UNUSED(etag)
+    Q_UNUSED(lastModified)
+
+    //Sources that can't ask whether a tile has changed just get it again
+    this->fetchTile(x,y,z);
+}
+
+//protected
+QDateTime MapTileSource::getTileExpirationTime(const TileKey &key)
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    MemoryCacheEntry * entry = _memoryCache.object(key);
+    if (entry)
+        return entry->expireTime;
+
+    //Asking the disk cache would mean waiting behind everything queued for the I/O thread
+    return QDateTime();
 }
 
-//protected static
-bool MapTileSource::cacheID2xyz(const QString & string, quint32 *x, quint32 *y, quint32 *z)
+//protected
+void MapTileSource::setTileExpirationTime(const TileKey &key, QDateTime expireTime)
 {
-    QStringList list = string.split(',');
-    if (list.size() != 3)
+    //If they told us when the tile expires, store that expiration. Otherwise, use the default.
+    if (expireTime.isNull())
     {
-        qWarning() << "Bad cacheID" << string << "cannot convert";
-        return false;
+        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
     }
 
-    bool ok = true;
-    *x = list.at(0).toUInt(&ok);
-    if (!ok)
-        return false;
-    *y = list.at(1).toUInt(&ok);
-    if (!ok)
-        return false;
-    *z = list.at(2).toUInt(&ok);
-    return ok;
+    QMutexLocker lock(&_memoryCacheLock);
+    MemoryCacheEntry * entry = _memoryCache.object(key);
+    if (entry)
+        entry->expireTime = expireTime;
+    lock.unlock();
+
+    DiskCacheIO::getInstance()->queueSetExpirationTime(this->diskCache(), key, expireTime);
 }
 
-QImage *MapTileSource::fromMemCache(const QString &cacheID)
+//private
+bool MapTileSource::takeNextRequest(TileKey *key, int *waiters)
 {
-    QImage * toRet = 0;
+    const bool full = this->activeRequests() >= this->maxConcurrentRequests();
+    const bool useMemory = (this->cacheMode() == DiskAndMemCaching);
 
-    if (_memoryCache.contains(cacheID))
+    QMutexLocker lock(&_requestQueueLock);
+    if (_requestOrderDirty)
+        this->sortRequestQueue();
+
+    for (int i = 0; i < _requestOrder.size(); i++)
     {
-        //Figure out when the tile we're loading from cache was supposed to expire
-        QDateTime expireTime = this->getTileExpirationTime(cacheID);
+        const TileKey candidate = _requestOrder.at(i);
+        QHash<TileKey, PendingRequest>::iterator it = _requestQueue.find(candidate);
 
-        //If the cached tile is older than we would like, throw it out
-        if (QDateTime::currentDateTimeUtc().secsTo(expireTime) <= 0)
+        //Cancelled since the queue was sorted
+        if (it == _requestQueue.end())
         {
-            _memoryCache.remove(cacheID);
+            _requestOrder.removeAt(i--);
+            continue;
         }
-        //Otherwise, make a copy of the cached tile and return it to the caller
-        else
+
+        //When we're busy, only tiles we have in memory (or know to be missing) can go ahead since they
+        //cost next to nothing
+        if (full)
         {
-            toRet = new QImage(*_memoryCache.object(cacheID));
+            QMutexLocker memoryLock(&_memoryCacheLock);
+            if (_missingTiles.isEmpty() && !useMemory)
+                return false;
+            if (!(useMemory && _memoryCache.contains(candidate)) && !_missingTiles.contains(candidate))
+                continue;
         }
-    }
 
-    return toRet;
+        *key = candidate;
+        *waiters = it.value().waiters;
+        _requestQueue.erase(it);
+        _requestOrder.removeAt(i);
+        return true;
+    }
+    return false;
 }
 
-void MapTileSource::toMemCache(const QString &cacheID, QImage *toCache, const QDateTime &expireTime)
+//private
+void MapTileSource::sortRequestQueue()
 {
-    if (toCache == 0)
-        return;
+    QVector<QueuedTile> tiles;
+    tiles.reserve(_requestQueue.size());
 
-    if (_memoryCache.contains(cacheID))
-        return;
+    QHash<TileKey, PendingRequest>::const_iterator it;
+    for (it = _requestQueue.constBegin(); it != _requestQueue.constEnd(); ++it)
+    {
+        const TileKey& key = it.key();
+        QueuedTile tile;
+        tile.key = key;
+        tile.kind = it.value().kind;
+        tile.sequence = it.value().sequence;
+        tile.zoomDistance = 0;
+        tile.distance = 0.0;
 
-    //Note when the tile will expire
-    this->setTileExpirationTime(cacheID, expireTime);
+        //Without a center, requests are served in the order they came in
+        if (_havePriorityCenter)
+        {
+            const int zoomDelta = (int)key.z() - (int)_priorityZoom;
+            const qreal scale = pow(2.0, zoomDelta);
+            const qreal dx = key.x() + 0.5 - _priorityCenter.x() * scale;
+            const qreal dy = key.y() + 0.5 - _priorityCenter.y() * scale;
+            tile.zoomDistance = qAbs(zoomDelta);
+            tile.distance = dx*dx + dy*dy;
+        }
+        tiles.append(tile);
+    }
+    qSort(tiles.begin(), tiles.end(), higherPriority);
 
-    //Make a copy of the QImage
-    QImage * copy = new QImage(*toCache);
-    _memoryCache.insert(cacheID,copy);
+    _requestOrder.clear();
+    foreach(const QueuedTile& tile, tiles)
+        _requestOrder.append(tile.key);
+    _requestOrderDirty = false;
 }
 
-QImage *MapTileSource::fromDiskCache(const QString &cacheID)
+//private
+void MapTileSource::scheduleDispatch()
 {
-    //Figure out x,y,z based on the cacheID
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
-        return 0;
+    QMutexLocker lock(&_requestQueueLock);
+    if (_dispatchScheduled || (_requestQueue.isEmpty() && _refreshQueue.isEmpty()))
+        return;
+    _dispatchScheduled = true;
+    lock.unlock();
 
-    //See if we've got it in the cache
-    const QString path = this->getDiskCacheFile(x,y,z);
-    QFile fp(path);
-    if (!fp.exists())
-        return 0;
+    QMetaObject::invokeMethod(this, "dispatchRequests", Qt::QueuedConnection);
+}
 
-    //Figure out when the tile we're loading from cache was supposed to expire
-    QDateTime expireTime = this->getTileExpirationTime(cacheID);
+//private
+void MapTileSource::addWaiter(quint32 x, quint32 y, quint8 z,
+                              QObject *receiver,
+                              const char *member,
+                              bool tagged,
+                              int tag,
+                              MapTileSource::TileRequestKind kind)
+{
+    const TileKey key(x,y,z);
 
-    //If the cached tile is older than we would like, throw it out
-    if (QDateTime::currentDateTimeUtc().secsTo(expireTime) <= 0)
+    QMutexLocker lock(&_waitersLock);
+    QList<TileWaiter>& waiters = _waiters[key];
+    bool alreadyWaiting = false;
+    for (int i = 0; i < waiters.size(); i++)
     {
-        if (!QFile::remove(path))
-            qWarning() << "Failed to remove old cache file" << path;
-        return 0;
-    }
+        if (waiters.at(i).receiver != receiver)
+            continue;
 
-    if (!fp.open(QFile::ReadOnly))
+        //The latest request says how the receiver wants to be told
+        waiters[i].member = member;
+        waiters[i].tagged = tagged;
+        waiters[i].tag = tag;
+        alreadyWaiting = true;
+        break;
+    }
+    if (!alreadyWaiting)
     {
-        qWarning() << "Failed to open" << QFileInfo(fp.fileName()).baseName() << "from cache";
-        return 0;
+        TileWaiter waiter;
+        waiter.receiver = receiver;
+        waiter.member = member;
+        waiter.tagged = tagged;
+        waiter.tag = tag;
+        waiters.append(waiter);
     }
+    lock.unlock();
+
+    /*
+      Still request it: after an invalidation the receiver needs a new tile even though it's already waiting.
+      If its request is still queued, it keeps counting once, so cancelTile() can withdraw it.
+    */
+    this->queueRequest(x,y,z,kind,!alreadyWaiting);
+}
+
+//private
+void MapTileSource::queueRequest(quint32 x, quint32 y, quint8 z, MapTileSource::TileRequestKind kind, bool newWaiter)
+{
+    const TileKey key(x,y,z);
 
-    QByteArray data;
-    quint64 counter = 0;
-    while (data.length() < fp.size())
+    /*
+      MapTileSource (usually) runs in its own thread, but this method will be called from a different
+      thread (probably the GUI thread). The request waits in the queue until dispatchRequests() picks it
+      up on our thread.
+    */
+    QMutexLocker lock(&_requestQueueLock);
+    QHash<TileKey, PendingRequest>::iterator it = _requestQueue.find(key);
+    if (it != _requestQueue.end())
     {
-        data += fp.read(20480);
-        if (++counter >= MAX_DISK_CACHE_READ_ATTEMPTS)
+        if (newWaiter)
+            it.value().waiters++;
+
+        //A tile that was only prefetched is now wanted on screen
+        if (kind == VisibleTile && it.value().kind != VisibleTile)
         {
-            qWarning() << "Reading cache file" << fp.fileName() << "took too long. Aborting.";
-            return 0;
+            it.value().kind = VisibleTile;
+            _requestOrderDirty = true;
         }
     }
-
-    QImage * image = new QImage();
-    if (!image->loadFromData(data))
+    else
     {
-        delete image;
-        return 0;
+        PendingRequest request;
+        request.waiters = 1;
+        request.kind = kind;
+        request.sequence = _requestSequence++;
+        _requestQueue.insert(key, request);
+        _requestOrderDirty = true;
     }
+    lock.unlock();
 
-    return image;
+    this->tileRequested(x,y,z);
+    this->scheduleDispatch();
 }
 
-void MapTileSource::toDiskCache(const QString &cacheID, QImage *toCache, const QDateTime &expireTime)
+//private
+void MapTileSource::queueRefresh(const TileKey &key)
 {
-    //Figure out x,y,z based on the cacheID
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+    if (this->cacheMode() != DiskAndMemCaching)
         return;
 
-    //Find out where we'll be caching
-    const QString filePath = this->getDiskCacheFile(x,y,z);
-
-    //If we've already cached something, do not cache it again
-    QFile fp(filePath);
-    if (fp.exists())
+    QDateTime expireTime;
+    QByteArray validators;
+    if (!this->peekMemCache(key, &expireTime, &validators))
         return;
 
-    //Note when the tile will expire
-    this->setTileExpirationTime(cacheID, expireTime);
-
-    //Auto-detect file format
-    const char * format = 0;
-
-    //No compression for lossy file types!
-    const int quality = 100;
-
-    //Try to write the data
-    if (!toCache->save(filePath,format,quality))
-        qWarning() << "Failed to put" << this->name() << x << y << z << "into disk cache";
-}
-
-void MapTileSource::prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage *image)
-{
-    //Do tile sanity check here optionally
-    if (image == 0)
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const qint64 expires = expireTime.toMSecsSinceEpoch();
+    if (expires > now + REFRESH_AHEAD_MSECS)
         return;
 
-    //Put it into the "temporary retrieval cache" so the user can grab it
-    QMutexLocker lock(&_tempCacheLock);
-    _tempCache.insert(MapTileSource::createCacheID(x,y,z),
-                      image);
-    /*
-      We must explicitly unlock the mutex before emitting tileRetrieved in case
-      we're running in the GUI thread (since the signal can trigger
-      slots immediately in that case).
-    */
+    QMutexLocker lock(&_requestQueueLock);
+    const int index = _refreshQueue.indexOf(key);
+    if (expires <= now)
+    {
+        //Somebody is looking at a stale tile, so it goes first
+        if (index >= 0)
+            _refreshQueue.removeAt(index);
+        else if (_refreshQueue.size() >= MAX_QUEUED_REFRESHES)
+            _refreshQueue.removeLast();
+        _refreshQueue.prepend(key);
+    }
+    else if (index < 0 && _refreshQueue.size() < MAX_QUEUED_REFRESHES)
+        _refreshQueue.append(key);
+    else
+        return;
     lock.unlock();
 
-    //Emit signal so user knows to call getFinishedTile()
-    this->tileRetrieved(x,y,z);
+    this->scheduleDispatch();
 }
 
-void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QImage *image, QDateTime expireTime)
+//private
+void MapTileSource::startRefreshes()
 {
-    //Insert into caches when applicable
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (this->cacheMode() == DiskAndMemCaching)
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (this->activeRequests() < this->maxConcurrentRequests())
     {
-        this->toMemCache(cacheID, image, expireTime);
-        this->toDiskCache(cacheID, image, expireTime);
+        QMutexLocker lock(&_requestQueueLock);
+        if (!_requestQueue.isEmpty() || _refreshQueue.isEmpty())
+            return;
+        const TileKey key = _refreshQueue.first();
+
+        //A tile that has left the memory cache hasn't been used for a while and isn't worth the bandwidth
+        QDateTime expireTime;
+        QByteArray validators;
+        if (!this->peekMemCache(key, &expireTime, &validators))
+        {
+            _refreshQueue.removeFirst();
+            continue;
+        }
+
+        //Expired tiles go regardless. Refreshing ahead of time has to fit in the budget.
+        const qint64 expires = expireTime.toMSecsSinceEpoch();
+        if (expires > now)
+        {
+            //Refreshed by some other means meanwhile, or we're not refreshing ahead at all
+            if (expires > now + REFRESH_AHEAD_MSECS || _refreshBudget == 0)
+            {
+                _refreshQueue.removeFirst();
+                continue;
+            }
+
+            //Refill the budget. We allow bursts of up to one minute's worth.
+            if (_sinceRefreshRefill.isValid())
+                _refreshTokens += _sinceRefreshRefill.restart() / 60000.0 * _refreshBudget;
+            else
+                _sinceRefreshRefill.start();
+            _refreshTokens = qMin<qreal>(_refreshTokens, _refreshBudget);
+
+            if (_refreshTokens < 1.0)
+            {
+                if (!_refreshRetryScheduled)
+                {
+                    _refreshRetryScheduled = true;
+                    const int msecs = (int) ceil((1.0 - _refreshTokens) * 60000.0 / _refreshBudget);
+                    QTimer::singleShot(msecs, this, SLOT(retryRefreshes()));
+                }
+                return;
+            }
+            _refreshTokens -= 1.0;
+        }
+        _refreshQueue.removeFirst();
+        lock.unlock();
+
+        //Already on its way (e.g., somebody requested it while it was being read from disk)
+        if (!this->beginInFlight(key, 0))
+            continue;
+
+        QByteArray etag;
+        QByteArray lastModified;
+        splitValidators(validators, &etag, &lastModified);
+        this->revalidateTile(key.x(), key.y(), key.z(), etag, lastModified);
     }
+}
 
-    //Put the tile in a client-accessible place and notify them
-    this->prepareRetrievedTile(x, y, z, image);
+//private
+bool MapTileSource::peekMemCache(const TileKey &key, QDateTime *expireTime, QByteArray *validators)
+{
+    QMutexLocker lock(&_memoryCacheLock);
+    const MemoryCacheEntry * entry = _memoryCache.object(key);
+    if (!entry)
+        return false;
+    *expireTime = entry->expireTime;
+    *validators = entry->validators;
+    return true;
 }
 
-//protected
-QDateTime MapTileSource::getTileExpirationTime(const QString &cacheID)
+//private
+bool MapTileSource::isKnownMissing(const TileKey &key)
 {
-    //Make sure we've got our expiration database loaded
-    this->loadCacheExpirationsFromDisk();
+    QMutexLocker lock(&_memoryCacheLock);
+    const qint64 * expires = _missingTiles.object(key);
+    if (!expires)
+        return false;
 
-    QDateTime expireTime;
-    if (_cacheExpirations.contains(cacheID))
-        expireTime = _cacheExpirations.value(cacheID);
-    else
+    //Time to find out whether it exists by now
+    if (*expires <= QDateTime::currentMSecsSinceEpoch())
     {
-        qWarning() << "Tile" << cacheID << "has unknown expire time. Resetting to default of" << DEFAULT_CACHE_DAYS << "days.";
-        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
-        _cacheExpirations.insert(cacheID,expireTime);
+        _missingTiles.remove(key);
+        return false;
     }
 
-    return expireTime;
+    _memoryCacheStats.missingTileHits++;
+    return true;
 }
 
-//protected
-void MapTileSource::setTileExpirationTime(const QString &cacheID, QDateTime expireTime)
+//private
+TileImage MapTileSource::missingTilePlaceholder(quint16 size)
 {
-    //Make sure we've got our expiration database loaded
-    this->loadCacheExpirationsFromDisk();
-
-    //If they told us when the tile expires, store that expiration. Otherwise, use the default.
-    if (expireTime.isNull())
+    if (_missingTilePlaceholder.isNull() || _missingTilePlaceholder->width() != size)
     {
-        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+        QImage image(size, size, QImage::Format_ARGB32_Premultiplied);
+        image.fill(_missingTileColor);
+        _missingTilePlaceholder = TileImage(new QImage(image));
     }
-
-    _cacheExpirations.insert(cacheID, expireTime);
+    return _missingTilePlaceholder;
 }
 
 //private
-QDir MapTileSource::getDiskCacheDirectory(quint32 x, quint32 y, quint8 z) const
+bool MapTileSource::beginInFlight(const TileKey &key, int waiters)
 {
-    Q_UNUSED(y)
-    QString pathString = QDir::homePath() % "/" % MAPGRAPHICS_CACHE_FOLDER_NAME % "/" % this->name() % "/" % QString::number(z) % "/" % QString::number(x);
-    QDir toRet = QDir(pathString);
-    if (!toRet.exists())
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QMutexLocker lock(&_inFlightLock);
+    QHash<TileKey, InFlightRequest>::iterator it = _inFlight.find(key);
+
+    //Subclasses that never report failures would otherwise block the tile forever
+    if (it != _inFlight.end() && now - it.value().started < IN_FLIGHT_TIMEOUT_MS)
     {
-        if (!toRet.mkpath(toRet.absolutePath()))
-            qWarning() << "Failed to create cache directory" << toRet.absolutePath();
+        it.value().waiters += waiters;
+        return false;
     }
-    return toRet;
+
+    InFlightRequest request;
+    request.started = now;
+    request.waiters = waiters;
+    _inFlight.insert(key, request);
+    return true;
 }
 
 //private
-QString MapTileSource::getDiskCacheFile(quint32 x, quint32 y, quint8 z) const
+void MapTileSource::endInFlight(const TileKey &key)
 {
-    QString toRet = this->getDiskCacheDirectory(x,y,z).absolutePath() % "/" % QString::number(y) % "." % this->tileFileExtension();
-    return toRet;
+    QMutexLocker lock(&_inFlightLock);
+    _inFlight.remove(key);
+    lock.unlock();
+
+    //Its slot can go to the next request
+    this->scheduleDispatch();
 }
 
 //private
-void MapTileSource::loadCacheExpirationsFromDisk()
+void MapTileSource::notifyWaiters(const TileKey &key, const TileImage &image)
 {
-    if (_cacheExpirationsLoaded)
-        return;
+    QMutexLocker lock(&_waitersLock);
+    const QList<TileWaiter> waiters = _waiters.take(key);
+    lock.unlock();
 
-    //If we try to do this and succeed or even fail, don't try again
-    _cacheExpirationsLoaded = true;
+    foreach(const TileWaiter& waiter, waiters)
+    {
+        //Receivers are supposed to cancel before they die, but just in case
+        if (waiter.receiver.isNull())
+            continue;
 
-    QDir dir = this->getDiskCacheDirectory(0,0,0);
-    QString path = dir.absolutePath() % "/" % "cacheExpirations.db";
-    _cacheExpirationsFile = path;
+        if (waiter.tagged)
+            QMetaObject::invokeMethod(waiter.receiver.data(),
+                                      waiter.member.constData(),
+                                      Qt::QueuedConnection,
+                                      Q_ARG(TileKey, key),
+                                      Q_ARG(TileImage, image),
+                                      Q_ARG(int, waiter.tag));
+        else
+            QMetaObject::invokeMethod(waiter.receiver.data(),
+                                      waiter.member.constData(),
+                                      Qt::QueuedConnection,
+                                      Q_ARG(TileKey, key),
+                                      Q_ARG(TileImage, image));
+    }
+}
 
-    QFile fp(path);
-    if (!fp.exists())
-        return;
+//private
+int MapTileSource::activeRequests()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
 
-    if (!fp.open(QIODevice::ReadOnly))
+    QMutexLocker lock(&_inFlightLock);
+    int count = 0;
+    foreach(const InFlightRequest& request, _inFlight)
     {
-        qWarning() << "Failed to open cache expiration file for reading:" << fp.errorString();
-        return;
+        if (now - request.started < IN_FLIGHT_TIMEOUT_MS)
+            count++;
     }
+    return count;
+}
 
-    QDataStream stream(&fp);
-    stream >> _cacheExpirations;
+//private
+bool MapTileSource::isInFlight(const TileKey &key)
+{
+    QMutexLocker lock(&_inFlightLock);
+    return _inFlight.contains(key);
 }
 
-void MapTileSource::saveCacheExpirationsToDisk()
+//private
+QSharedPointer<DiskTileCache> MapTileSource::diskCache()
 {
-    if (!_cacheExpirationsLoaded || _cacheExpirationsFile.isEmpty())
-        return;
+    QMutexLocker lock(&_diskCacheLock);
+    if (!_diskCache.isNull())
+        return _diskCache;
 
-    QFile fp(_cacheExpirationsFile);
+    const QString directory = QDir::homePath() % "/" % MAPGRAPHICS_CACHE_FOLDER_NAME % "/" % this->name();
+    QSharedPointer<DiskTileCache> backend;
+    if (this->diskCacheFormat() == PackFiles)
+        backend = QSharedPointer<DiskTileCache>(new PackFileTileCache(directory));
+    else
+        backend = QSharedPointer<DiskTileCache>(new TileFileCache(directory, this->tileFileExtension()));
 
-    if (!fp.open(QIODevice::Truncate | QIODevice::WriteOnly))
-    {
-        qWarning() << "Failed to open cache expiration file for writing:" << fp.errorString();
-        return;
-    }
+    /*
+      Sources with the same name (e.g., the same layer in two views) cache in the same directory, so they
+      have to use the same backend. A new one is opened in the background, which gets things like index
+      loading out of the way before the first tile is requested.
+    */
+    _diskCache = DiskCacheIO::getInstance()->shareBackend(directory, backend);
+    if (_diskCacheCapacity >= 0)
+        _diskCache->setCapacity(_diskCacheCapacity);
 
-    QDataStream stream(&fp);
-    stream << _cacheExpirations;
-    qDebug() << "Cache expirations saved to" << _cacheExpirationsFile;
+    return _diskCache;
 }
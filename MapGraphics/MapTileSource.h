@@ -6,13 +6,29 @@
 #include <QPointF>
 #include <QImage>
 #include <QCache>
+#include <QHash>
 #include <QMutex>
+#include <QAtomicInt>
 #include <QDateTime>
-#include <QDir>
-#include <QFile>
-#include <QHash>
+#include <QSharedPointer>
+#include <QPointer>
+#include <QList>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QColor>
 
 #include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief A reference-counted handle to a decoded, immutable map tile. The memory cache, the clients and
+ * composite sources all share the same pixels; copying a TileImage only bumps a reference count. A null
+ * TileImage means "no tile".
+ */
+typedef QSharedPointer<const QImage> TileImage;
+Q_DECLARE_METATYPE(TileImage)
+
+class DiskTileCache;
 
 class MAPGRAPHICSSHARED_EXPORT MapTileSource : public QObject
 {
@@ -29,6 +45,62 @@ public:
         DiskAndMemCaching
     };
 
+    /**
+     * @brief How the disk cache is laid out. TileFiles stores one file per tile under
+     * <cache>/<name>/<z>/<x>/<y>.<ext>. PackFiles appends tiles to a few large pack files and keeps an
+     * index of them in memory, which scales much better to millions of tiles.
+     */
+    enum DiskCacheFormat
+    {
+        TileFiles,
+        PackFiles
+    };
+
+    /**
+     * @brief Why a tile is wanted. Tiles that are on screen (VisibleTile) are loaded before tiles that are
+     * only requested in case they're needed soon (PrefetchTile).
+     */
+    enum TileRequestKind
+    {
+        VisibleTile,
+        PrefetchTile
+    };
+
+    /**
+     * @brief Counters describing how well the in-memory tile cache is doing. The cache is limited in
+     * bytes, and each tile costs the number of bytes its decoded pixels take up.
+     */
+    struct MemoryCacheStats
+    {
+        quint64 hits;
+        quint64 misses;
+        quint64 evictions;
+        quint64 expirations;
+        int tileCount;
+        int bytesUsed;
+        int capacityBytes;
+
+        //Requests answered by the negative cache, and how many missing tiles it remembers
+        quint64 missingTileHits;
+        int missingTileCount;
+    };
+
+    /**
+     * @brief Size and janitor counters of a disk cache. The janitor removes tiles that expired long ago
+     * first and then least recently used ones whenever the cache is over its capacity. droppedWrites counts
+     * tiles that weren't cached because the disk cache I/O thread was too busy.
+     */
+    struct DiskCacheStats
+    {
+        qint64 bytesUsed;
+        qint64 capacityBytes;
+        quint64 expiredEvictions;
+        quint64 lruEvictions;
+        quint64 droppedWrites;
+        qint64 lastScanMsecs;
+        QDateTime lastScan;
+    };
+
 public:
     explicit MapTileSource();
     virtual ~MapTileSource();
@@ -38,28 +110,263 @@ public:
      * A tileRetrieved signal will be emitted when the tile is available, at which point it can be
      * retrieved using getFinishedTile()
      *
+     * Requests are queued and served in order of priority: tiles on the zoom level of the priority center
+     * first, then visible tiles before prefetched ones, then the ones closest to the priority center.
+     * Requests for the same tile are merged.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @param kind
+     */
+    void requestTile(quint32 x, quint32 y, quint8 z,
+                     MapTileSource::TileRequestKind kind = VisibleTile);
+
+    /**
+     * @brief Same as above, but only receiver is told when the tile is available: the slot named member
+     * is invoked (queued) with the arguments (TileKey key, TileImage tile). Nobody else is bothered, and
+     * there's nothing to connect or disconnect. If receiver is already waiting for the tile, it is
+     * notified only once. If the tile can't be retrieved, receiver gets a null TileImage.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @param receiver
+     * @param member the name of the slot, e.g. "handleTileRetrieved"
+     * @param kind
+     */
+    void requestTile(quint32 x, quint32 y, quint8 z,
+                     QObject * receiver,
+                     const char * member,
+                     MapTileSource::TileRequestKind kind = VisibleTile);
+
+    /**
+     * @brief Same as above, but member is invoked with a third argument, (TileKey key, TileImage tile,
+     * int tag), so a receiver that asks several sources for the same tile can tell which one answered. If
+     * receiver is already waiting for the tile, the new tag replaces the old one.
+     */
+    void requestTile(quint32 x, quint32 y, quint8 z,
+                     QObject * receiver,
+                     const char * member,
+                     int tag,
+                     MapTileSource::TileRequestKind kind = VisibleTile);
+
+    /**
+     * @brief Retrieves a handle to a retrieved image tile. You must call requestTile and wait for the
+     * tileRetrieved signal before calling this method. Returns a null TileImage on failure.
+     * The tile is shared and immutable; nobody has to delete it.
+     *
      * @param x
      * @param y
      * @param z
+     * @return TileImage
      */
-    void requestTile(quint32 x, quint32 y, quint8 z);
+    TileImage getFinishedTile(quint32 x, quint32 y, quint8 z);
 
     /**
-     * @brief Retrieves a pointer to a retrieved image tile. You must call requestTile and wait for the
-     * tileRetrieved signal before calling this method. Returns a QImage pointer on success, null on failure.
-     * The caller takes ownership of the QImage pointer - i.e., the caller is responsible for deleting it.
+     * @brief Withdraws a request made with requestTile() for a tile that isn't needed anymore (e.g., it
+     * scrolled out of view). Once every client that requested the tile has withdrawn its request, queued
+     * disk reads for the tile are dropped and the source is told to stop fetching it. A tileRetrieved
+     * signal may still arrive for it if the tile was already on its way.
      *
      * @param x
      * @param y
      * @param z
-     * @return QImage
      */
-    QImage * getFinishedTile(quint32 x, quint32 y, quint8 z);
+    void cancelTile(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief Withdraws a request made by receiver with the requestTile() overload that takes one. Once this
+     * returns, receiver won't be invoked for the tile anymore unless a result was already on its way.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @param receiver
+     */
+    void cancelTile(quint32 x, quint32 y, quint8 z, QObject * receiver);
+
+    /**
+     * @brief Tells the source where the user is looking so queued requests can be served from there
+     * outwards. Call it whenever the view moves or zooms; queued requests are re-prioritized. Until it's
+     * called, requests are served first-come, first-served.
+     *
+     * @param qgs the center of the view in QGraphicsScene coordinates
+     * @param zoomLevel the zoom level being displayed
+     */
+    virtual void setPriorityCenter(const QPointF& qgs, quint8 zoomLevel);
+
+    /**
+     * @brief Returns how many tiles the source may be reading from disk or fetching at once. Tiles served
+     * from memory don't count.
+     *
+     * @return int
+     */
+    int maxConcurrentRequests() const;
+
+    /**
+     * @brief Sets how many tiles the source may be reading from disk or fetching at once. The others wait
+     * in the queue, where they can still be re-prioritized or cancelled.
+     *
+     * @param count at least 1
+     */
+    void setMaxConcurrentRequests(int count);
+
+    /**
+     * @brief Returns the number of requested tiles that are waiting in the queue, i.e. haven't been
+     * started yet. Safe to call from any thread.
+     *
+     * @return int
+     */
+    int queuedRequests() const;
+
+    /**
+     * @brief Returns how many tiles per minute the source may refresh in the background because they're
+     * about to expire. Expired tiles are always refreshed when they're requested, budget or not.
+     *
+     * @return int
+     */
+    int refreshBudget() const;
+
+    /**
+     * @brief Sets how many tiles per minute the source may refresh ahead of their expiration. Refreshes
+     * only run while no requested tiles are waiting. Pass 0 to only refresh tiles that have expired.
+     *
+     * @param tilesPerMinute
+     */
+    void setRefreshBudget(int tilesPerMinute);
 
     MapTileSource::CacheMode cacheMode() const;
 
     void setCacheMode(MapTileSource::CacheMode);
 
+    MapTileSource::DiskCacheFormat diskCacheFormat() const;
+
+    /**
+     * @brief Chooses the layout of this source's disk cache. Tiles cached in the other format are not
+     * migrated. Call this before any tiles are requested.
+     *
+     * @param format
+     */
+    void setDiskCacheFormat(MapTileSource::DiskCacheFormat format);
+
+    /**
+     * @brief Returns the number of bytes this source's disk cache may take up, or -1 if only the global
+     * capacity applies.
+     *
+     * @return qint64
+     */
+    qint64 diskCacheCapacity() const;
+
+    /**
+     * @brief Limits this source's disk cache to the given number of bytes. Pass -1 for no limit of its
+     * own. The limit is enforced by a background janitor, so the cache may briefly grow beyond it.
+     * Sources with the same name share their disk cache, and the limit set last applies to all of them.
+     *
+     * @param bytes
+     */
+    void setDiskCacheCapacity(qint64 bytes);
+
+    /**
+     * @brief Returns the size of this source's disk cache and how much the janitor has had to throw out.
+     * bytesUsed is only exact after the janitor's first run. Safe to call from any thread.
+     *
+     * @return DiskCacheStats
+     */
+    MapTileSource::DiskCacheStats diskCacheStats() const;
+
+    /**
+     * @brief Returns the number of bytes the disk caches of all sources together may take up, or -1 for no
+     * limit (the default).
+     *
+     * @return qint64
+     */
+    static qint64 globalDiskCacheCapacity();
+
+    /**
+     * @brief Limits the disk caches of all sources together to the given number of bytes. When they're over,
+     * each one gives up space in proportion to its size. Pass -1 for no limit.
+     *
+     * @param bytes
+     */
+    static void setGlobalDiskCacheCapacity(qint64 bytes);
+
+    /**
+     * @brief Returns the totals over the disk caches of all sources in use
+     *
+     * @return DiskCacheStats
+     */
+    static MapTileSource::DiskCacheStats globalDiskCacheStats();
+
+    /**
+     * @brief Returns the number of bytes of decoded tiles this source keeps in memory. Unless
+     * setMemoryCacheCapacity() has been called, this is the process-wide default.
+     *
+     * @return int
+     */
+    int memoryCacheCapacity() const;
+
+    /**
+     * @brief Limits the in-memory tile cache of this source to the given number of bytes. Pass a negative
+     * value to go back to the process-wide default. Least-recently-used tiles are evicted to make room.
+     *
+     * @param bytes
+     */
+    void setMemoryCacheCapacity(int bytes);
+
+    /**
+     * @brief Returns a snapshot of the memory cache counters. Safe to call from any thread.
+     *
+     * @return MemoryCacheStats
+     */
+    MapTileSource::MemoryCacheStats memoryCacheStats() const;
+
+    /**
+     * @brief Zeroes the hit/miss/eviction counters of the memory cache
+     */
+    void resetMemoryCacheStats();
+
+    /**
+     * @brief Returns for how many seconds the source remembers that a tile doesn't exist (see
+     * prepareMissingTile()). Meanwhile, requests for it get the missing tile placeholder right away.
+     *
+     * @return int
+     */
+    int missingTileTtl() const;
+
+    /**
+     * @brief Sets for how many seconds the source remembers that a tile doesn't exist. Pass 0 to forget
+     * right away, so every request for a missing tile asks the source again.
+     *
+     * @param seconds
+     */
+    void setMissingTileTtl(int seconds);
+
+    /**
+     * @brief Returns the color of the placeholder that stands in for tiles that don't exist. Transparent by
+     * default, so layers below show through.
+     *
+     * @return QColor
+     */
+    QColor missingTileColor() const;
+    void setMissingTileColor(const QColor& color);
+
+    /**
+     * @brief Returns the memory cache capacity (in bytes) used by every source that hasn't been given its
+     * own with setMemoryCacheCapacity()
+     *
+     * @return int
+     */
+    static int defaultMemoryCacheCapacity();
+
+    /**
+     * @brief Sets the memory cache capacity (in bytes) used by every source that hasn't been given its
+     * own with setMemoryCacheCapacity(). Existing sources pick up the change on their next cache insert.
+     *
+     * @param bytes
+     */
+    static void setDefaultMemoryCacheCapacity(int bytes);
+
     /**
      * @brief Converst from geo (lat,lon) coordinates into QGraphicsScene coordinates. A MapTileSource
      * implementation has to implement this method.
@@ -80,6 +387,18 @@ public:
      */
     virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const=0;
 
+    /**
+     * @brief Converts count points from geo (lat,lon) coordinates into QGraphicsScene coordinates in one
+     * call. ll and qgs may be the same array. The default implementation calls ll2qgs() for every point;
+     * sources that can do better (e.g. the Web Mercator ones, see WebMercator) reimplement it.
+     */
+    virtual void ll2qgsPoints(const QPointF * ll, QPointF * qgs, int count, quint8 zoomLevel) const;
+
+    /**
+     * @brief The batch version of qgs2ll(), see ll2qgsPoints()
+     */
+    virtual void qgs2llPoints(const QPointF * qgs, QPointF * ll, int count, quint8 zoomLevel) const;
+
     /**
      * @brief Pure-virtual method that returns the number of tiles on a given zoom level.
      *
@@ -133,7 +452,9 @@ public:
 signals:
     /**
      * @brief Signal emitted when a tile that was requested with requestTile() has been retrieved and can
-     * be gotten at using getFinishedTile()
+     * be gotten at using getFinishedTile(). Tiles made by produceTileOnWorker() or prepareEncodedTile()
+     * are announced from the worker thread, so only connect to it with a direct connection if the slot
+     * is thread-safe.
      *
      * @param x
      * @param y
@@ -141,6 +462,18 @@ signals:
      */
     void tileRetrieved(quint32 x, quint32 y, quint8 z);
 
+    /**
+     * @brief Signal emitted when a tile that was requested with requestTile() could not be retrieved,
+     * e.g. because its server is down. Nothing more will come for the request; request the tile again
+     * to retry. Not emitted when only a refresh of a cached tile failed, since the cached tile stays.
+     * Like tileRetrieved(), it may be emitted from a worker thread.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void tileFailed(quint32 x, quint32 y, quint8 z);
+
     /**
      * @brief Signal emitted when a tile is requested using requestTile().
      *
@@ -150,6 +483,15 @@ signals:
      */
     void tileRequested(quint32 x, quint32 y, quint8 z);
 
+    /**
+     * @brief Signal emitted when a tile request is withdrawn using cancelTile().
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void tileRequestCancelled(quint32 x, quint32 y, quint8 z);
+
     /*!
      \brief Emitted when vital parameters of the tile source have changed and anyone displaying the tiles should
       refresh.
@@ -158,80 +500,91 @@ signals:
     void allTilesInvalidated();
     
 public slots:
+    /**
+     * @brief Reclaims disk space taken up by superseded and removed tiles. Only does anything for the
+     * PackFiles format. This rewrites the whole cache, so invoke it (queued) while the source is idle.
+     */
+    void compactDiskCache();
 
 private slots:
-    void startTileRequest(quint32 x, quint32 y, quint8 z);
+    void dispatchRequests();
+    void cancelTileRequest(quint32 x, quint32 y, quint8 z);
+    void handleDiskCacheRead(TileKey key, QByteArray data, QDateTime expireTime, QByteArray validators);
+    void handleDecodedDiskTile(TileKey key, QImage image, QDateTime expireTime, QByteArray validators);
     void clearTempCache();
+    void retryRefreshes();
 
 protected:
     /**
-     * @brief This static method takes the x,y,z of a tile and creates a unique string that is used
-     * as a key in the caches to keep track of the tile.
-     *
-     * @param x x-coordinate of the tile
-     * @param y y-coordinate of the tile
-     * @param z zoom-level of the tile
-     * @return QString unique cacheID
-     */
-    static QString createCacheID(quint32 x, quint32 y, quint8 z);
-
-    /**
-     * @brief This static convenience method takes a cacheID and places the numberical x,y,z values that
-     * generated the cacheID into the variables pointed to by x,y,z. Returns true on success, false on failure.
-     *
-     * @param string the cacheID you are converting
-     * @param x where you want the x value
-     * @param y where you want the y value
-     * @param z where you want the z value
-     * @return bool
-     */
-    static bool cacheID2xyz(const QString & string, quint32 * x, quint32 * y, quint32 * z);
-
-    /**
-     * @brief Given a cacheID, retrieve the tile with that cacheID from memcache. Returns a pointer
-     * to a QImage on success, null on failure. Caller takes responsibility for deleting the returned
-     * QImage
+     * @brief Given a TileKey, retrieve the tile with that key from memcache. Returns a shared handle
+     * to the cached tile on success, a null TileImage on failure. No pixels are copied.
+     * Expired tiles are only returned if expired is given, in which case it's set to whether the tile
+     * has expired.
      *
-     * @param cacheID cacheID of the tile you want to get from cache
-     * @return QImage
+     * @param key key of the tile you want to get from cache
+     * @param expired
+     * @return TileImage
      */
-    QImage * fromMemCache(const QString& cacheID);
+    TileImage fromMemCache(const TileKey& key, bool * expired = 0);
 
     /**
-     * @brief Given a cacheID and a pointer to a QImage, inserts the QImage pointed to by the pointer into
-     * the memory cache using cacheID as the key
+     * @brief Given a TileKey and a tile, inserts the tile into the memory cache using the TileKey as
+     * the key, replacing any older version. The cache shares the tile with everyone else holding it.
      *
-     * @param cacheID
+     * @param key
      * @param toCache
+     * @param expireTime
+     * @param validators what the server needs to tell whether the tile has changed (see revalidateTile())
      */
-    void toMemCache(const QString& cacheID, QImage * toCache, const QDateTime &expireTime = QDateTime());
+    void toMemCache(const TileKey& key,
+                    const TileImage& toCache,
+                    const QDateTime &expireTime = QDateTime(),
+                    const QByteArray& validators = QByteArray());
 
     /**
-     * @brief Given a cacheID, retrieve the tile with that cacheID from the disk cache. Returns a
-     * pointer to a QImage on success, null on failure. Caller takes responsibility for deleting the
-     * returned QImage
+     * @brief Given a TileKey, starts reading the tile with that key from the disk cache on the I/O
+     * thread. Returns false if the tile is known not to be cached (or the I/O thread is too busy), in which
+     * case it should be fetched right away. Otherwise the tile is handed to the client when the read
+     * completes, or fetched if it turns out not to be usable.
      *
-     * @param cacheID cacheID of the tile you want to get from cache
-     * @return QImage
+     * @param key key of the tile you want to get from cache
+     * @return bool
      */
-    QImage * fromDiskCache(const QString& cacheID);
+    bool fromDiskCache(const TileKey& key);
 
     /**
-     * @brief Given a cacheID and a pointer to a QImage, inserts the QImage pointed to by the pointer into
-     * the disk cache using cacheID as the key.
+     * @brief Given a TileKey and a QImage, encodes the QImage as tileFileExtension() and inserts it into
+     * the disk cache using the TileKey as the key. Only used for tiles that have no original encoded form
+     * (i.e., tiles generated locally). Encoding and writing happen later, on the I/O thread.
      * Optionally, takes a QDateTime object that specifies the time that the QImage should be kept cached 
      * until. Defaults to 7 days.
      *
-     * @param cacheID
+     * @param key
      * @param toCache
      * @param cacheUntil
      */
-    void toDiskCache(const QString& cacheID, QImage * toCache, const QDateTime &expireTime = QDateTime());
+    void toDiskCache(const TileKey& key, const QImage& toCache, const QDateTime &expireTime = QDateTime());
+
+    /**
+     * @brief Given a TileKey and the encoded bytes of a tile (e.g., a PNG or JPEG exactly as the server
+     * sent it), writes the bytes to the disk cache verbatim. Nothing is decoded or re-encoded. The write
+     * happens later, on the I/O thread.
+     *
+     * @param key
+     * @param encodedTile
+     * @param expireTime
+     * @param validators
+     */
+    void toDiskCache(const TileKey& key,
+                     const QByteArray& encodedTile,
+                     const QDateTime &expireTime = QDateTime(),
+                     const QByteArray& validators = QByteArray());
 
     /**
      * @brief Fetches (from MapQuest or OSM or whatever) or generates the tile if it isn't cached.
      * This is where the rubber hits the road, so to speak, for a MapTileSource. When successful, this method
-     * should just call prepareRetrievedTile. On failure, do nothing.
+     * should just call prepareNewlyReceivedTile. On failure, call prepareFailedTile.
+     * fetchTile is never called for a tile that is still being fetched; duplicate requests are coalesced.
      *
      * @param x x-coordinate of the tile
      * @param y y-coordinate of the tile
@@ -242,79 +595,315 @@ protected:
                            quint32 y,
                            quint8 z)=0;
 
-    //Call only for tiles which were newly-generated or newly-acquired from the network (i.e., not cached)
-    void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QImage * image, QDateTime expireTime = QDateTime());
+    /**
+     * @brief Called when nobody wants a tile that fetchTile() was asked for anymore. Sources that can,
+     * should abort the download or generation of the tile and forget about it. Neither
+     * prepareNewlyReceivedTile nor prepareFailedTile have to be called for it. Does nothing by default.
+     *
+     * @param x x-coordinate of the tile
+     * @param y y-coordinate of the tile
+     * @param z zoom-level of the tile
+     */
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
 
     /**
-     * @brief Returns the time when the tile is supposed to expire from any caches.
-     * This should only be called on tiles which are actually cached!
-     * @param cacheID The cacheID of the tile
-     * @return QDateTime of the tile's expiration (time after which it should be re-requested or regenerated)
+     * @brief Called instead of fetchTile() for a cached tile that has expired or is about to. Meanwhile the
+     * cached tile is shown. Sources that talk HTTP should send a conditional request with etag
+     * (If-None-Match) and lastModified (If-Modified-Since), whichever isn't empty, and call
+     * prepareNotModifiedTile() if the server says the tile hasn't changed. Otherwise they finish as they
+     * would for fetchTile(). By default, this just calls fetchTile().
+     *
+     * @param x x-coordinate of the tile
+     * @param y y-coordinate of the tile
+     * @param z zoom-level of the tile
+     * @param etag the ETag the tile was served with, if any
+     * @param lastModified the Last-Modified date the tile was served with, if any
      */
-    QDateTime getTileExpirationTime(const QString& cacheID);
+    virtual void revalidateTile(quint32 x,
+                                quint32 y,
+                                quint8 z,
+                                const QByteArray& etag,
+                                const QByteArray& lastModified);
 
     /**
-     * @brief Sets the time when the tile is supposed to expire from any caches
-     * @param cacheID of the tile
-     * @param QDateTime of the tile's expiration (time after which it should be re-requested or regenerated)
+     * @brief Has produceTile() called for the tile on one of the shared worker threads (see TileExecutor)
+     * instead of on ours. Up to maxConcurrency tiles of this source are produced at once, so pass more than
+     * 1 only if produceTile() is thread-safe. Tiles that nobody wants anymore when their turn comes are
+     * skipped. Sources that use this must call cancelProducedTiles() in their destructor.
      */
-    void setTileExpirationTime(const QString& cacheID, QDateTime expireTime);
+    void produceTileOnWorker(quint32 x, quint32 y, quint8 z, int maxConcurrency = 1);
 
-private:
     /**
-     * @brief prepareRetrievedTile prepares a generated/retrieve tile for retrieval by the client
-     * and notifies the client that the tile is ready.
+     * @brief Generates or loads the tile on a worker thread, for sources that use produceTileOnWorker().
+     * Finishes like fetchTile() does. Does nothing by default.
      */
-    void prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage * image);
+    virtual void produceTile(quint32 x,
+                             quint32 y,
+                             quint8 z);
+
+    //Drops the tiles queued by produceTileOnWorker() or prepareEncodedTile() and waits for running ones
+    void cancelProducedTiles();
+
+    /*
+      Call only for tiles which were newly-generated or newly-acquired from the network (i.e., not cached).
+      This and the other prepare* methods may be called from any thread; produceTile() and the decoding of
+      prepareEncodedTile() call them from a worker thread.
+    */
+    void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QImage& image, QDateTime expireTime = QDateTime());
+
+    /*
+      Same as above, for sources that still hold the tile's original encoded bytes (e.g., the network payload).
+      The bytes go to the disk cache as-is; image is the decoded version used for display. etag and
+      lastModified are the response's validators, which are handed back to revalidateTile() later.
+    */
+    void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z,
+                                  const QImage& image,
+                                  const QByteArray& encodedImage,
+                                  QDateTime expireTime = QDateTime(),
+                                  const QByteArray& etag = QByteArray(),
+                                  const QByteArray& lastModified = QByteArray());
+
+    /**
+     * @brief Same as above, for tiles that still have to be decoded. They're decoded on the shared worker
+     * threads, several at once, into RGB32 (opaque tiles) or ARGB32_Premultiplied, which the GUI thread can
+     * draw without converting. A tile that can't be decoded fails. Sources that use this must call
+     * cancelProducedTiles() in their destructor.
+     */
+    void prepareEncodedTile(quint32 x, quint32 y, quint8 z,
+                            const QByteArray& encodedImage,
+                            QDateTime expireTime = QDateTime(),
+                            const QByteArray& etag = QByteArray(),
+                            const QByteArray& lastModified = QByteArray());
 
     /**
-     * @brief Given the x,y, and z of a tile, returns the directory where it should be cached on disk
+     * @brief Call when revalidateTile() learns that the cached tile is still current (e.g., HTTP 304).
+     * The cached tile is kept and stays good until expireTime (the default if it's null).
      *
      * @param x
      * @param y
      * @param z
-     * @return QDir
+     * @param expireTime
      */
-    QDir getDiskCacheDirectory(quint32 x, quint32 y, quint8 z) const;
+    void prepareNotModifiedTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime = QDateTime());
 
     /**
-     * @brief Given the x,y, and z of a tile, returns the full path to the file where it should be
-     * cached on disk
+     * @brief Call when fetchTile() learns that the tile doesn't exist, e.g. HTTP 404 or a file that isn't
+     * there. The client gets the missing tile placeholder and requests for the tile are answered with it,
+     * without calling fetchTile(), until expireTime or for missingTileTtl(), whichever is sooner.
      *
      * @param x
      * @param y
      * @param z
-     * @return QString
+     * @param expireTime
      */
-    QString getDiskCacheFile(quint32 x, quint32 y, quint8 z) const;
+    void prepareMissingTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime = QDateTime());
 
-    /*!
-     \brief Loads cache expiration times from disk if necessary
-    */
-    void loadCacheExpirationsFromDisk();
+    /**
+     * @brief Call when fetchTile() could not produce the tile, so the next request for it tries again
+     * instead of waiting for a result that will never come. Whoever asked for the tile is told that it
+     * failed (see tileFailed()).
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void prepareFailedTile(quint32 x, quint32 y, quint8 z);
 
-    void saveCacheExpirationsToDisk();
+    /**
+     * @brief Returns the time when the tile is supposed to expire from any caches.
+     * Only the memory cache is asked, so this never waits for disk I/O.
+     * @param key The TileKey of the tile
+     * @return QDateTime of the tile's expiration (time after which it should be re-requested or regenerated),
+     * or a null QDateTime if the tile isn't in the memory cache
+     */
+    QDateTime getTileExpirationTime(const TileKey& key);
 
-    bool _cacheExpirationsLoaded;
+    /**
+     * @brief Sets the time when the tile is supposed to expire from any caches
+     * @param key of the tile
+     * @param QDateTime of the tile's expiration (time after which it should be re-requested or regenerated)
+     */
+    void setTileExpirationTime(const TileKey& key, QDateTime expireTime);
 
-    /*
-      loadCacheExpirationsFromDisk() stores the place where it loaded from here.
-      When we're destructing and need to serialize out we can use this instead of
-      foolishly trying to call a pure-virtual method (name()) from the destructor
-    */
-    QString _cacheExpirationsFile;
+private:
+    friend class ProduceTileJob;
+    friend class DecodeTileJob;
+    friend class DecodeCachedTileJob;
+
+    /**
+     * @brief Makes sure the memory cache uses the current capacity and counts any tiles that had to be
+     * evicted because of it. Call with _memoryCacheLock held.
+     */
+    void applyMemoryCacheCapacity();
+
+    /**
+     * @brief prepareRetrievedTile prepares a generated/retrieve tile for retrieval by the client
+     * and notifies the client that the tile is ready.
+     */
+    void prepareRetrievedTile(quint32 x, quint32 y, quint8 z, const TileImage& image);
+
+    //prepareNewlyReceivedTile() with the original bytes, for a tile that is in a display format already
+    void prepareDisplayReadyTile(quint32 x, quint32 y, quint8 z,
+                                 const TileImage& tile,
+                                 const QByteArray& encodedImage,
+                                 QDateTime expireTime,
+                                 const QByteArray& etag,
+                                 const QByteArray& lastModified);
+
+    //Hands the tile to the client without ending its retrieval, e.g. a stale tile that is being revalidated
+    void deliverTile(quint32 x, quint32 y, quint8 z, const TileImage& image);
+
+    //Queues a refresh of a tile in the memory cache if it has expired or is about to
+    void queueRefresh(const TileKey& key);
+
+    //Starts queued refreshes while nothing else is waiting and the budget allows
+    void startRefreshes();
+
+    //Looks at a tile in the memory cache without counting it as a hit. Call with _memoryCacheLock not held.
+    bool peekMemCache(const TileKey& key, QDateTime * expireTime, QByteArray * validators);
+
+    //Whether the negative cache says the tile doesn't exist. Call with _memoryCacheLock not held.
+    bool isKnownMissing(const TileKey& key);
+
+    //The image every missing tile of the given size shares, made on first use. Call with _memoryCacheLock held.
+    TileImage missingTilePlaceholder(quint16 size);
+
+    //Serves a request taken off the queue from memory, or starts reading or fetching the tile
+    void startTileRequest(const TileKey& key, int waiters);
+
+    /**
+     * @brief Takes the request with the highest priority off the queue. Returns false if there's none or
+     * if enough requests are running already. Memory cache hits are served right away.
+     */
+    bool takeNextRequest(TileKey * key, int * waiters);
+
+    //Sorts _requestOrder by priority. Call with _requestQueueLock held.
+    void sortRequestQueue();
+
+    //Makes sure dispatchRequests() runs soon on the source's thread. Safe to call from any thread.
+    void scheduleDispatch();
+
+    //Registers receiver as waiting for the tile (once) and requests it
+    void addWaiter(quint32 x, quint32 y, quint8 z,
+                   QObject * receiver,
+                   const char * member,
+                   bool tagged,
+                   int tag,
+                   MapTileSource::TileRequestKind kind);
+
+    /**
+     * @brief Queues a request for the tile. If one is queued already, newWaiter says whether this is one
+     * more request for it or the same one asked again, which only counts once.
+     */
+    void queueRequest(quint32 x, quint32 y, quint8 z, MapTileSource::TileRequestKind kind, bool newWaiter);
+
+    /**
+     * @brief Marks the tile as being retrieved on behalf of waiters requests. Returns false if it already
+     * is, in which case the pending retrieval will serve these requests too.
+     */
+    bool beginInFlight(const TileKey& key, int waiters);
+
+    //The number of tiles being read or fetched right now, not counting requests that have timed out
+    int activeRequests();
+
+    //The tile has been retrieved or has failed
+    void endInFlight(const TileKey& key);
+
+    //Hands the tile (null if it failed) to everyone who asked for it with a receiver
+    void notifyWaiters(const TileKey& key, const TileImage& image);
+
+    //Whether the tile is still being retrieved for someone, i.e. hasn't completed, failed or been cancelled
+    bool isInFlight(const TileKey& key);
+
+    /**
+     * @brief Returns the disk cache backend, creating it on first use. It can't be created in the
+     * constructor because it needs name() and tileFileExtension().
+     *
+     * @return QSharedPointer<DiskTileCache>
+     */
+    QSharedPointer<DiskTileCache> diskCache();
 
     MapTileSource::CacheMode _cacheMode;
 
-    //Temporary cache for QImage tiles waiting for the client to take them
-    QCache<QString, QImage> _tempCache;
+    MapTileSource::DiskCacheFormat _diskCacheFormat;
+    QSharedPointer<DiskTileCache> _diskCache;
+    qint64 _diskCacheCapacity;
+    mutable QMutex _diskCacheLock;
+
+    //Memory cache entries remember when their tile expires and how to revalidate it
+    struct MemoryCacheEntry
+    {
+        TileImage image;
+        QDateTime expireTime;
+        QByteArray validators;
+    };
+
+    //Temporary cache for tiles waiting for the client to take them
+    QCache<TileKey, TileImage> _tempCache;
     QMutex _tempCacheLock;
 
     //The "real" cache, where tiles are saved in memory so we don't download them again
-    QCache<QString, QImage> _memoryCache;
+    QCache<TileKey, MemoryCacheEntry> _memoryCache;
+    mutable QMutex _memoryCacheLock;
+    int _memoryCacheCapacity;
+    MapTileSource::MemoryCacheStats _memoryCacheStats;
 
-    QHash<QString, QDateTime> _cacheExpirations;
-    
+    static QAtomicInt _defaultMemoryCacheCapacity;
+
+    //The negative cache: tiles that don't exist, and until when (msecs since epoch) we believe that
+    QCache<TileKey, qint64> _missingTiles;
+    int _missingTileTtl;
+    QColor _missingTileColor;
+    TileImage _missingTilePlaceholder;
+
+    //Tiles that are being read from disk or fetched, when that started and how many requests wait for them
+    struct InFlightRequest
+    {
+        qint64 started;
+        int waiters;
+    };
+    QHash<TileKey, InFlightRequest> _inFlight;
+    QMutex _inFlightLock;
+
+    //Requests that haven't been started yet. _requestOrder holds their keys, highest priority first.
+    struct PendingRequest
+    {
+        int waiters;
+        MapTileSource::TileRequestKind kind;
+        quint64 sequence;
+    };
+    QHash<TileKey, PendingRequest> _requestQueue;
+    QList<TileKey> _requestOrder;
+    bool _requestOrderDirty;
+    bool _dispatchScheduled;
+    quint64 _requestSequence;
+    int _maxConcurrentRequests;
+
+    //Where the view is centered, in tiles of _priorityZoom
+    bool _havePriorityCenter;
+    QPointF _priorityCenter;
+    quint8 _priorityZoom;
+
+    //Cached tiles to revalidate once the request queue is empty, expired ones first
+    QList<TileKey> _refreshQueue;
+    int _refreshBudget;
+    qreal _refreshTokens;
+    QElapsedTimer _sinceRefreshRefill;
+    bool _refreshRetryScheduled;
+    mutable QMutex _requestQueueLock;
+
+    //Who to notify (and how) when a tile is available
+    struct TileWaiter
+    {
+        QPointer<QObject> receiver;
+        QByteArray member;
+        bool tagged;
+        int tag;
+    };
+    QHash<TileKey, QList<TileWaiter> > _waiters;
+    QMutex _waitersLock;
 };
 
 #endif // MAPTILESOURCE_H
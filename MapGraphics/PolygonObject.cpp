@@ -1,6 +1,6 @@
 #include "PolygonObject.h"
 
-#include "guts/Conversions.h"
+#include "guts/EnuFrame.h"
 #include "CircleObject.h"
 
 #include <QtDebug>
@@ -32,14 +32,13 @@ QRectF PolygonObject::boundingRect() const
 {
     QRectF latLonRect = _geoPoly.boundingRect();
     QPointF latLonCenter = latLonRect.center();
-    Position latLonCenterPos(latLonCenter,0.0);
-    Position topLeftPos(latLonRect.topLeft(),0.0);
-    Position bottomRightPos(latLonRect.bottomRight(),0.0);
+    const EnuFrame frame(Position(latLonCenter,0.0));
 
-    QPointF topLeftENU = Conversions::lla2enu(topLeftPos,latLonCenterPos).toPointF();
-    QPointF bottomRightENU = Conversions::lla2enu(bottomRightPos,latLonCenterPos).toPointF();
+    QPolygonF corners;
+    corners << latLonRect.topLeft() << latLonRect.bottomRight();
+    const QPolygonF enuCorners = frame.lla2enu(corners);
 
-    return QRectF(topLeftENU,bottomRightENU);
+    return QRectF(enuCorners.at(0),enuCorners.at(1));
 }
 
 //virtual from MapGraphicsObject
@@ -57,15 +56,17 @@ void PolygonObject::paint(QPainter *painter, const QStyleOptionGraphicsItem *opt
 
     painter->setRenderHint(QPainter::Antialiasing,true);
 
-    QPolygonF enuPoly;
-
-    Position latLonCenterPos(_geoPoly.boundingRect().center(),0);
-    foreach(QPointF latLon, _geoPoly)
+    /*
+      Convert all of the vertices in one go, but only when the polygon has changed. _enuPolySource shares its
+      data with _geoPoly until then, so checking is cheap.
+    */
+    if (_enuPolySource != _geoPoly)
     {
-        Position latLonPos(latLon,0.0);
-        QPointF enu = Conversions::lla2enu(latLonPos,latLonCenterPos).toPointF();
-        enuPoly << enu;
+        const EnuFrame frame(Position(_geoPoly.boundingRect().center(),0));
+        _enuPoly = frame.lla2enu(_geoPoly);
+        _enuPolySource = _geoPoly;
     }
+    const QPolygonF& enuPoly = _enuPoly;
 
     painter->setBrush(_fillColor);
     painter->drawPolygon(enuPoly);
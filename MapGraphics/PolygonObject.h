@@ -60,6 +60,10 @@ private:
     QPolygonF _geoPoly;
     QColor _fillColor;
 
+    //_geoPoly in meters around its center, and the _geoPoly it was converted from
+    QPolygonF _enuPoly;
+    QPolygonF _enuPolySource;
+
     QList<MapGraphicsObject *> _editCircles;
     QList<MapGraphicsObject *> _addVertexCircles;
     
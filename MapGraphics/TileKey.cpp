@@ -0,0 +1,27 @@
+#include "TileKey.h"
+
+//static
+const quint8 TileKey::MAX_ZOOM;
+
+//Non-member method for streaming to qDebug
+QDebug operator<<(QDebug dbg, const TileKey& key)
+{
+    dbg.nospace() << "TileKey(" << key.x() << "," << key.y() << "," << key.z() << ")";
+
+    return dbg.space();
+}
+
+//Non-member methods for serializing and de-serializing
+QDataStream& operator<<(QDataStream& stream, const TileKey& key)
+{
+    stream << key.packed();
+    return stream;
+}
+
+QDataStream& operator>>(QDataStream& stream, TileKey& key)
+{
+    quint64 packed;
+    stream >> packed;
+    key = TileKey::fromPacked(packed);
+    return stream;
+}
@@ -0,0 +1,103 @@
+#ifndef TILEKEY_H
+#define TILEKEY_H
+
+#include <QtGlobal>
+#include <QHash>
+#include <QMetaType>
+#include <QDataStream>
+#include <QtDebug>
+
+#include "MapGraphics_global.h"
+
+/**
+ * @brief TileKey identifies a map tile by its x, y and zoom level. The three values are packed into a
+ * single quint64 so that keys are trivially copyable and cheap to hash and compare. x and y must fit
+ * into 28 bits each, which covers every tile on zoom levels 0 through MAX_ZOOM (28). Views and the
+ * built-in sources never go deeper than that.
+ *
+ * Layout (most significant bits first): 8 bits zoom | 28 bits x | 28 bits y
+ */
+class MAPGRAPHICSSHARED_EXPORT TileKey
+{
+public:
+    //The deepest zoom level whose tiles all have keys
+    static const quint8 MAX_ZOOM = 28;
+
+    TileKey() : _packed(0) {}
+
+    TileKey(quint32 x, quint32 y, quint8 z) :
+        _packed((quint64(z) << Z_SHIFT) |
+                (quint64(x & COORD_MASK) << X_SHIFT) |
+                quint64(y & COORD_MASK))
+    {
+        Q_ASSERT(x <= COORD_MASK && y <= COORD_MASK);
+    }
+
+    quint32 x() const
+    {
+        return quint32((_packed >> X_SHIFT) & COORD_MASK);
+    }
+
+    quint32 y() const
+    {
+        return quint32(_packed & COORD_MASK);
+    }
+
+    quint8 z() const
+    {
+        return quint8(_packed >> Z_SHIFT);
+    }
+
+    quint64 packed() const
+    {
+        return _packed;
+    }
+
+    static TileKey fromPacked(quint64 packed)
+    {
+        TileKey toRet;
+        toRet._packed = packed;
+        return toRet;
+    }
+
+    bool operator ==(const TileKey& other) const
+    {
+        return _packed == other._packed;
+    }
+
+    bool operator !=(const TileKey& other) const
+    {
+        return _packed != other._packed;
+    }
+
+    //Orders by zoom level, then x, then y
+    bool operator <(const TileKey& other) const
+    {
+        return _packed < other._packed;
+    }
+
+private:
+    static const quint64 COORD_MASK = 0x0FFFFFFF;
+    static const int X_SHIFT = 28;
+    static const int Z_SHIFT = 56;
+
+    quint64 _packed;
+};
+
+Q_DECLARE_TYPEINFO(TileKey, Q_PRIMITIVE_TYPE);
+Q_DECLARE_METATYPE(TileKey)
+
+//Non-member method for hashing
+inline uint qHash(const TileKey& key)
+{
+    return qHash(key.packed());
+}
+
+//Non-member method for streaming to qDebug
+MAPGRAPHICSSHARED_EXPORT QDebug operator<<(QDebug dbg, const TileKey& key);
+
+//Non-member methods for serializing and de-serializing
+MAPGRAPHICSSHARED_EXPORT QDataStream& operator<<(QDataStream& stream, const TileKey& key);
+MAPGRAPHICSSHARED_EXPORT QDataStream& operator>>(QDataStream& stream, TileKey& key);
+
+#endif // TILEKEY_H
@@ -1,14 +1,52 @@
 #include "Conversions.h"
 
+#include "EnuFrame.h"
+#include "Wgs84.h"
+
 #include <cmath>
 #include <QtDebug>
 
-const qreal pi = 3.141592653589793238462643383;
-const qreal A_EARTH = 6378137;
-const qreal flattening = 1.0/298.257223563;
-const qreal NAV_E2 = (2.0-flattening)*flattening;
-const qreal deg2rad = pi/180.0;
-const qreal rad2deg = 180.0/pi;
+/*
+  The Newton iteration xyz2lla used before the closed form, kept as a reference for test(). Its Jacobian
+  lacked the altitude term of dz/dlat, so it diverged far above the surface, and its absolute tolerance
+  couldn't be reached there either. Both are fixed here. Returns false if it didn't converge.
+*/
+static bool iterativeEcef2lla(qreal x, qreal y, qreal z, qreal * lat, qreal * alt)
+{
+    const qreal rhosqrd = x*x + y*y;
+    const qreal rho = std::sqrt(rhosqrd);
+    const qreal tolerance = 1e-9 * qMax<qreal>(1.0, std::sqrt(rhosqrd + z*z) / Wgs84::A_EARTH);
+    qreal templat = std::atan2(z,rho);
+    qreal tempalt = std::sqrt(rhosqrd + z*z) - Wgs84::A_EARTH;
+
+    for (int i = 0; i < 50; i++)
+    {
+        const qreal slat = std::sin(templat);
+        const qreal clat = std::cos(templat);
+        const qreal q = 1.0 - Wgs84::E2*slat*slat;
+        const qreal r_n = Wgs84::A_EARTH/std::sqrt(q);
+        const qreal drdl = r_n*Wgs84::E2*slat*clat/q;
+
+        const qreal rhoerror = (r_n + tempalt)*clat - rho;
+        const qreal zerror = (r_n*(1.0 - Wgs84::E2) + tempalt)*slat - z;
+        if (qAbs(rhoerror) <= tolerance && qAbs(zerror) <= tolerance)
+        {
+            *lat = templat*Wgs84::RAD2DEG;
+            *alt = tempalt;
+            return true;
+        }
+
+        const qreal aa = drdl*clat - (r_n + tempalt)*slat;
+        const qreal bb = clat;
+        const qreal cc = (1.0 - Wgs84::E2)*drdl*slat + (r_n*(1.0 - Wgs84::E2) + tempalt)*clat;
+        const qreal dd = slat;
+
+        const qreal invdet = 1.0/(aa*dd - bb*cc);
+        templat = templat - invdet*(dd*rhoerror - bb*zerror);
+        tempalt = tempalt - invdet*(-1*cc*rhoerror + aa*zerror);
+    }
+    return false;
+}
 
 //static
 QVector3D Conversions::lla2xyz(qreal wlat, qreal wlon, qreal walt)
@@ -22,14 +60,10 @@ QVector3D Conversions::lla2xyz(qreal wlat, qreal wlon, qreal walt)
         return toRet;
     }
 
-    qreal slat = sin(wlat*deg2rad);
-    qreal clat = cos(wlat*deg2rad);
-    qreal r_n = A_EARTH/sqrt(1.0 - NAV_E2*slat*slat);
-
-    toRet.setX((r_n + walt)*clat*cos(wlon*deg2rad));
-    toRet.setY((r_n + walt)*clat*sin(wlon*deg2rad));
-    toRet.setZ((r_n*(1.0 - NAV_E2) + walt)*slat);
+    qreal x, y, z;
+    Wgs84::lla2ecef(wlat, wlon, walt, &x, &y, &z);
 
+    toRet = QVector3D(x, y, z);
     return toRet;
 }
 
@@ -56,61 +90,22 @@ Position Conversions::xyz2lla(qreal x, qreal y, qreal z)
         return toRet;
     }
 
-    if (x == 0.0 && y == 0.0)
-        toRet.setLongitude(0.0);
-    else
-        toRet.setLongitude(atan2(y,x)*rad2deg);
-
-    qreal rhosqrd = x*x + y*y;
-    qreal rho = sqrt(rhosqrd);
-    qreal templat = atan2(z,rho);
-    qreal tempalt = sqrt(rhosqrd + z*z) - A_EARTH;
-    qreal rhoerror = 1000.0;
-    qreal zerror = 1000.0;
-
-    while (abs(rhoerror) > 0.000001 || abs(zerror) > 0.000001)
-    {
-        qreal slat = sin(templat);
-        qreal clat = cos(templat);
-        qreal q = 1.0 - NAV_E2*slat*slat;
-        qreal r_n = A_EARTH/sqrt(q);
-        qreal drdl = r_n*NAV_E2*slat*clat/q;
+    qreal lat, lon, alt;
+    Wgs84::ecef2lla(x, y, z, &lat, &lon, &alt);
 
-        rhoerror = (r_n + tempalt)*clat - rho;
-        zerror = (r_n*(1.0 - NAV_E2) + tempalt)*slat - z;
-
-        qreal aa = drdl*clat - (r_n + tempalt)*slat;
-        qreal bb = clat;
-        qreal cc = (1.0 - NAV_E2)*(drdl*slat + r_n*clat);
-        qreal dd = slat;
-
-        qreal invdet = 1.0/(aa*dd - bb*cc);
-        templat = templat - invdet*(dd*rhoerror - bb*zerror);
-        tempalt = tempalt - invdet*(-1*cc*rhoerror + aa*zerror);
-    }
+    //atan2(0,0) is 0 anyway, but don't count on it
+    if (x == 0.0 && y == 0.0)
+        lon = 0.0;
 
-    toRet.setLatitude(templat*rad2deg);
-    toRet.setAltitude(tempalt);
+    toRet.setLongitude(lon);
+    toRet.setLatitude(lat);
+    toRet.setAltitude(alt);
     return toRet;
 }
 
 QVector3D Conversions::xyz2enu(const QVector3D &xyz, qreal reflat, qreal reflon, qreal refalt)
 {
-    QVector3D refxyz = Conversions::lla2xyz(reflat,reflon,refalt);
-    QVector3D diffxyz = xyz - refxyz;
-
-    QTransform R1 = Conversions::rot(90.0 + reflon,3);
-    QTransform R2 = Conversions::rot(90.0-reflat,1);
-    QTransform R = R2*R1;
-
-    //MAKE THIS MATRIX MULTIPLY
-    qreal x = R.m11()*diffxyz.x() + R.m12()*diffxyz.y() + R.m13()*diffxyz.z();
-    qreal y = R.m21()*diffxyz.x() + R.m22()*diffxyz.y() + R.m23()*diffxyz.z();
-    qreal z = R.m31()*diffxyz.x() + R.m32()*diffxyz.y() + R.m33()*diffxyz.z();
-
-    QVector3D enu(x,y,z);
-
-    return enu;
+    return EnuFrame(reflat, reflon, refalt).xyz2enu(xyz);
 }
 
 QVector3D Conversions::xyz2enu(const QVector3D &xyz, const Position &refLLA)
@@ -139,26 +134,7 @@ QVector3D Conversions::xyz2enu(qreal x, qreal y, qreal z, const Position &refLLA
 
 QVector3D Conversions::enu2xyz(const QVector3D & enu, qreal reflat, qreal reflon, qreal refalt)
 {
-    const QTransform R1 = Conversions::rot(90.0 + reflon,3);
-    const QTransform R2 = Conversions::rot(90.0 - reflat,1);
-    const QTransform R = R2*R1;
-
-    const QTransform invR = R.inverted();
-    if (invR.isIdentity())
-    {
-        qDebug() << "Failed to invert rotation matrix --- did you enter a bad lat,lon,or alt?";
-        return enu;
-    }
-
-    qreal x = invR.m11()*enu.x() + invR.m12()*enu.y() + invR.m13()*enu.z();
-    qreal y = invR.m21()*enu.x() + invR.m22()*enu.y() + invR.m23()*enu.z();
-    qreal z = invR.m31()*enu.x() + invR.m32()*enu.y() + invR.m33()*enu.z();
-
-    QVector3D diffxyz(x,y,z);
-
-    QVector3D refxyz = Conversions::lla2xyz(reflat,reflon,refalt);
-
-    return (diffxyz + refxyz);
+    return EnuFrame(reflat, reflon, refalt).enu2xyz(enu);
 }
 
 QVector3D Conversions::enu2xyz(const QVector3D & enu, const Position & refLLA)
@@ -187,8 +163,7 @@ QVector3D Conversions::enu2xyz(qreal east, qreal north, qreal up, const Position
 
 Position Conversions::enu2lla(const QVector3D & enu, qreal reflat, qreal reflon, qreal refalt)
 {
-    QVector3D xyz = Conversions::enu2xyz(enu,reflat,reflon,refalt);
-    return Conversions::xyz2lla(xyz);
+    return EnuFrame(reflat, reflon, refalt).enu2lla(enu);
 }
 
 Position Conversions::enu2lla(const QVector3D & enu, const Position & refLLA)
@@ -217,10 +192,7 @@ Position Conversions::enu2lla(qreal east, qreal north, qreal up, const Position
 
 QVector3D Conversions::lla2enu(qreal lat, qreal lon, qreal alt, qreal reflat, qreal reflon, qreal refalt)
 {
-    QVector3D xyz = Conversions::lla2xyz(lat,lon,alt);
-    QVector3D enu = Conversions::xyz2enu(xyz,reflat,reflon,refalt);
-
-    return enu;
+    return EnuFrame(reflat, reflon, refalt).lla2enu(Position(lon, lat, alt));
 }
 
 QVector3D Conversions::lla2enu(qreal lat, qreal lon, qreal alt, const Position & refLLA)
@@ -251,17 +223,45 @@ QVector3D Conversions::lla2enu(const Position & lla, const Position & refLLA)
                                 refLLA.altitude());
 }
 
+//static
+void Conversions::lla2enu(const qreal *lat, const qreal *lon, const qreal *alt,
+                          qreal *east, qreal *north, qreal *up,
+                          int count, const Position &refLLA)
+{
+    EnuFrame(refLLA).lla2enu(lat, lon, alt, east, north, up, count);
+}
+
+//static
+void Conversions::enu2lla(const qreal *east, const qreal *north, const qreal *up,
+                          qreal *lat, qreal *lon, qreal *alt,
+                          int count, const Position &refLLA)
+{
+    EnuFrame(refLLA).enu2lla(east, north, up, lat, lon, alt, count);
+}
+
+//static
+QPolygonF Conversions::lla2enu(const QPolygonF &lonLat, const Position &refLLA)
+{
+    return EnuFrame(refLLA).lla2enu(lonLat);
+}
+
+//static
+QPolygonF Conversions::enu2lla(const QPolygonF &eastNorth, const Position &refLLA)
+{
+    return EnuFrame(refLLA).enu2lla(eastNorth);
+}
+
 qreal Conversions::degreesLatPerMeter(const qreal latitude)
 {
-    const qreal latRad = latitude * (pi / 180.0);
+    const qreal latRad = latitude * Wgs84::DEG2RAD;
     qreal meters = 111132.954 - 559.822 * cos(2.0 * latRad) + 1.175 * cos(4.0 * latRad);
     return 1.0 / meters;
 }
 
 qreal Conversions::degreesLonPerMeter(const qreal latitude)
 {
-    const qreal latRad = latitude * (pi / 180.0);
-    qreal meters = (pi * A_EARTH * cos(latRad)) / (180.0 * sqrt(1.0 - NAV_E2 * pow(sin(latRad), 2.0)));
+    const qreal latRad = latitude * Wgs84::DEG2RAD;
+    qreal meters = (Wgs84::PI * Wgs84::A_EARTH * cos(latRad)) / (180.0 * sqrt(1.0 - Wgs84::E2 * pow(sin(latRad), 2.0)));
     return 1.0 / meters;
 }
 
@@ -269,8 +269,8 @@ QTransform Conversions::rot(qreal angle, quint32 axis)
 {
     QTransform toRet;
 
-    qreal cang = cos(angle*deg2rad);
-    qreal sang = sin(angle*deg2rad);
+    qreal cang = cos(angle*Wgs84::DEG2RAD);
+    qreal sang = sin(angle*Wgs84::DEG2RAD);
 
     switch(axis)
     {
@@ -313,6 +313,44 @@ void Conversions::test()
     else
         qDebug() << "Passed LLA -> ENU -> LLA -> ENU";
 
+    //The closed form against the iteration, from the south pole to the north pole and from 10 km below
+    //the ellipsoid to 40000 km above it
+    const qreal lats[] = {-90.0, -89.999, -75.0, -60.0, -45.0, -30.0, -15.0, 0.0,
+                          15.0, 30.0, 45.0, 60.0, 75.0, 89.999, 90.0};
+    const qreal alts[] = {-10000.0, 0.0, 1000.0, 100000.0, 1000000.0, 10000000.0, 40000000.0};
+    const qreal lons[] = {-179.5, -111.649253, 0.0, 45.0};
+    qreal maxLatError = 0.0;
+    qreal maxAltError = 0.0;
+    bool converged = true;
+    for (uint i = 0; i < sizeof(lats) / sizeof(lats[0]); i++)
+    {
+        for (uint j = 0; j < sizeof(alts) / sizeof(alts[0]); j++)
+        {
+            for (uint k = 0; k < sizeof(lons) / sizeof(lons[0]); k++)
+            {
+                qreal x, y, z;
+                Wgs84::lla2ecef(lats[i], lons[k], alts[j], &x, &y, &z);
+
+                qreal lat, lon, alt;
+                Wgs84::ecef2lla(x, y, z, &lat, &lon, &alt);
+
+                qreal refLat, refAlt;
+                if (!iterativeEcef2lla(x, y, z, &refLat, &refAlt))
+                {
+                    converged = false;
+                    continue;
+                }
+                maxLatError = qMax(maxLatError, qAbs(lat - refLat));
+                maxAltError = qMax(maxAltError, qAbs(alt - refAlt));
+            }
+        }
+    }
+
+    if (!converged || maxLatError > 1e-13 || maxAltError > 2e-8)
+        qDebug() << "Failed closed form XYZ -> LLA. Max error" << maxLatError << "degrees," << maxAltError << "meters";
+    else
+        qDebug() << "Passed closed form XYZ -> LLA. Max error" << maxLatError << "degrees," << maxAltError << "meters";
+
     qDebug() << degreesLatPerMeter(15.0);
     qDebug() << degreesLonPerMeter(15.0);
 }
@@ -4,6 +4,7 @@
 #include <QTransform>
 #include <QVector3D>
 #include <QPointF>
+#include <QPolygonF>
 
 #include "MapGraphics_global.h"
 #include "Position.h"
@@ -34,6 +35,22 @@ public:
     static QVector3D lla2enu(const Position & lla, qreal reflat, qreal reflon, qreal refalt);
     static QVector3D lla2enu(const Position & lla, const Position & refLLA);
 
+    /*
+      Batch versions, in double precision, for arrays of points around the same reference (structure of
+      arrays). The reference is set up once. alt/up may be null for 0, and alt/up outputs may be null if not
+      wanted. Output arrays may be the same as input arrays.
+    */
+    static void lla2enu(const qreal * lat, const qreal * lon, const qreal * alt,
+                        qreal * east, qreal * north, qreal * up,
+                        int count, const Position & refLLA);
+    static void enu2lla(const qreal * east, const qreal * north, const qreal * up,
+                        qreal * lat, qreal * lon, qreal * alt,
+                        int count, const Position & refLLA);
+
+    //Polygons on the ground: (lon,lat) points to (east,north) points in meters and back. Altitude is ignored.
+    static QPolygonF lla2enu(const QPolygonF & lonLat, const Position & refLLA);
+    static QPolygonF enu2lla(const QPolygonF & eastNorth, const Position & refLLA);
+
     static qreal degreesLatPerMeter(const qreal latitude);
     static qreal degreesLonPerMeter(const qreal latitude);
 
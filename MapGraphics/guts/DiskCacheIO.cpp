@@ -0,0 +1,550 @@
+#include "DiskCacheIO.h"
+
+#include <QMutexLocker>
+#include <QCoreApplication>
+#include <QMetaObject>
+#include <QBuffer>
+#include <QDir>
+#include <QtDebug>
+
+//Reads beyond this are refused and become misses, writes beyond this are dropped
+const int MAX_QUEUED_READS = 512;
+const int MAX_QUEUED_TILE_WRITES = 256;
+
+//How long the backends may sit on changes before they're flushed to disk
+const int FLUSH_INTERVAL_MS = 2000;
+
+//The janitor runs this often, or after the shorter interval if a cache has outgrown its capacity
+const qint64 JANITOR_INTERVAL_MS = 10 * 60 * 1000;
+const qint64 JANITOR_MIN_INTERVAL_MS = 30 * 1000;
+
+//No compression for lossy file types!
+const int ENCODE_QUALITY = 100;
+
+//static
+DiskCacheIO * DiskCacheIO::_instance = 0;
+QMutex DiskCacheIO::_instanceMutex;
+
+//static
+DiskCacheIO *DiskCacheIO::getInstance()
+{
+    QMutexLocker lock(&_instanceMutex);
+    if (!DiskCacheIO::_instance)
+    {
+        DiskCacheIO::_instance = new DiskCacheIO();
+        DiskCacheIO::_instance->start();
+
+        //Make sure queued writes make it to disk before the application goes away
+        qAddPostRoutine(DiskCacheIO::shutdown);
+    }
+    return DiskCacheIO::_instance;
+}
+
+DiskCacheIO::~DiskCacheIO()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _stopping = true;
+        _wakeUp.wakeAll();
+    }
+    this->wait();
+}
+
+bool DiskCacheIO::queueRead(const QSharedPointer<DiskTileCache> &cache, const TileKey &key, QObject *receiver, const char *member)
+{
+    Job job;
+    job.type = Read;
+    job.cache = cache;
+    job.key = key;
+    job.receiver = receiver;
+    job.member = member;
+
+    QMutexLocker lock(&_mutex);
+    if (_stopping || _reads.size() >= MAX_QUEUED_READS)
+        return false;
+    this->enqueue(job);
+    return true;
+}
+
+bool DiskCacheIO::queueWrite(const QSharedPointer<DiskTileCache> &cache, const TileKey &key, const QByteArray &data, const QDateTime &expireTime, const QByteArray &validators)
+{
+    Job job;
+    job.type = Write;
+    job.cache = cache;
+    job.key = key;
+    job.data = data;
+    job.expireTime = expireTime;
+    job.validators = validators;
+
+    QMutexLocker lock(&_mutex);
+    if (_stopping)
+        return false;
+    if (_queuedTileWrites >= MAX_QUEUED_TILE_WRITES)
+    {
+        lock.unlock();
+        cache->noteDroppedWrite();
+        return false;
+    }
+    this->enqueue(job);
+    return true;
+}
+
+bool DiskCacheIO::queueWrite(const QSharedPointer<DiskTileCache> &cache, const TileKey &key, const QImage &image, const QByteArray &format, const QDateTime &expireTime, const QByteArray &validators)
+{
+    Job job;
+    job.type = WriteImage;
+    job.cache = cache;
+    job.key = key;
+    job.image = image;
+    job.member = format;
+    job.expireTime = expireTime;
+    job.validators = validators;
+
+    QMutexLocker lock(&_mutex);
+    if (_stopping)
+        return false;
+    if (_queuedTileWrites >= MAX_QUEUED_TILE_WRITES)
+    {
+        lock.unlock();
+        cache->noteDroppedWrite();
+        return false;
+    }
+    this->enqueue(job);
+    return true;
+}
+
+void DiskCacheIO::queueRemove(const QSharedPointer<DiskTileCache> &cache, const TileKey &key)
+{
+    Job job;
+    job.type = Remove;
+    job.cache = cache;
+    job.key = key;
+
+    QMutexLocker lock(&_mutex);
+    this->enqueue(job);
+}
+
+void DiskCacheIO::queueSetExpirationTime(const QSharedPointer<DiskTileCache> &cache, const TileKey &key, const QDateTime &expireTime)
+{
+    Job job;
+    job.type = SetExpiration;
+    job.cache = cache;
+    job.key = key;
+    job.expireTime = expireTime;
+
+    QMutexLocker lock(&_mutex);
+    this->enqueue(job);
+}
+
+void DiskCacheIO::queueOpen(const QSharedPointer<DiskTileCache> &cache)
+{
+    Job job;
+    job.type = Open;
+    job.cache = cache;
+
+    QMutexLocker lock(&_mutex);
+    _backends.append(cache.toWeakRef());
+    this->enqueue(job);
+}
+
+QSharedPointer<DiskTileCache> DiskCacheIO::shareBackend(const QString &directory, const QSharedPointer<DiskTileCache> &backend)
+{
+    const QString path = QDir(directory).absolutePath();
+
+    QMutexLocker lock(&_mutex);
+    QSharedPointer<DiskTileCache> existing = _backendsByDirectory.value(path).toStrongRef();
+    if (!existing.isNull())
+        return existing;
+
+    _backendsByDirectory.insert(path, backend.toWeakRef());
+
+    Job job;
+    job.type = Open;
+    job.cache = backend;
+    _backends.append(backend.toWeakRef());
+    this->enqueue(job);
+    return backend;
+}
+
+void DiskCacheIO::queueCompact(const QSharedPointer<DiskTileCache> &cache)
+{
+    Job job;
+    job.type = Compact;
+    job.cache = cache;
+
+    QMutexLocker lock(&_mutex);
+    this->enqueue(job);
+}
+
+void DiskCacheIO::cancelReads(QObject *receiver)
+{
+    QMutexLocker lock(&_mutex);
+    QQueue<Job>::iterator it = _reads.begin();
+    while (it != _reads.end())
+    {
+        if (it->receiver == receiver)
+            it = _reads.erase(it);
+        else
+            ++it;
+    }
+
+    //Results are delivered with _mutex held, so a read that is in progress right now won't be delivered
+    if (_currentReceiver == receiver)
+        _currentCancelled = true;
+}
+
+void DiskCacheIO::cancelRead(QObject *receiver, const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    QQueue<Job>::iterator it = _reads.begin();
+    while (it != _reads.end())
+    {
+        if (it->receiver == receiver && it->key == key)
+            it = _reads.erase(it);
+        else
+            ++it;
+    }
+}
+
+qint64 DiskCacheIO::globalCapacity() const
+{
+    QMutexLocker lock(&_mutex);
+    return _globalCapacity;
+}
+
+void DiskCacheIO::setGlobalCapacity(qint64 bytes)
+{
+    QMutexLocker lock(&_mutex);
+    _globalCapacity = qMax<qint64>(-1, bytes);
+    _janitorRequested = true;
+    _wakeUp.wakeOne();
+}
+
+void DiskCacheIO::requestJanitor()
+{
+    QMutexLocker lock(&_mutex);
+    _janitorRequested = true;
+    _wakeUp.wakeOne();
+}
+
+DiskTileCache::Stats DiskCacheIO::globalStats()
+{
+    QMutexLocker lock(&_mutex);
+    QList<QSharedPointer<DiskTileCache> > backends = this->liveBackends();
+
+    DiskTileCache::Stats toRet;
+    toRet.bytesUsed = 0;
+    toRet.capacityBytes = _globalCapacity;
+    toRet.expiredEvictions = 0;
+    toRet.lruEvictions = 0;
+    toRet.droppedWrites = 0;
+    toRet.lastScanMsecs = _lastJanitorMsecs;
+    toRet.lastScan = _lastJanitorRun;
+    lock.unlock();
+
+    foreach(const QSharedPointer<DiskTileCache>& cache, backends)
+    {
+        const DiskTileCache::Stats stats = cache->stats();
+        toRet.bytesUsed += stats.bytesUsed;
+        toRet.expiredEvictions += stats.expiredEvictions;
+        toRet.lruEvictions += stats.lruEvictions;
+        toRet.droppedWrites += stats.droppedWrites;
+    }
+    return toRet;
+}
+
+//protected
+//virtual from QThread
+void DiskCacheIO::run()
+{
+    QMutexLocker lock(&_mutex);
+    _sinceFlush.start();
+    _sinceJanitor.start();
+    forever
+    {
+        if (_unflushed && _sinceFlush.elapsed() >= FLUSH_INTERVAL_MS)
+            this->flushBackends(lock);
+
+        //Reads first. When we're stopping, nobody is waiting for them anymore.
+        Job job;
+        if (!_reads.isEmpty() && !_stopping)
+            job = _reads.dequeue();
+        else if (!_writes.isEmpty())
+            job = _writes.dequeue();
+        else if (_stopping)
+            break;
+        else if (this->msecsUntilJanitor() == 0)
+        {
+            //Only when we're idle
+            this->runJanitor(lock);
+            continue;
+        }
+        else
+        {
+            //Sleep until there's work, or until it's time to flush or clean up
+            qint64 timeout = this->msecsUntilJanitor();
+            if (_unflushed)
+            {
+                const qint64 untilFlush = qMax<qint64>(1, FLUSH_INTERVAL_MS - _sinceFlush.elapsed());
+                timeout = (timeout < 0) ? untilFlush : qMin(timeout, untilFlush);
+            }
+
+            if (timeout < 0)
+                _wakeUp.wait(&_mutex);
+            else
+                _wakeUp.wait(&_mutex, (unsigned long) timeout);
+            continue;
+        }
+
+        if (job.type == Write || job.type == WriteImage)
+            _queuedTileWrites--;
+        _currentReceiver = job.receiver;
+        _currentCancelled = false;
+
+        lock.unlock();
+        this->process(job);
+
+        //Only jobs that change a backend leave something to flush
+        const bool modified = job.type == Write || job.type == WriteImage
+                || job.type == Remove || job.type == SetExpiration;
+
+        //A cache that has outgrown its capacity gets the janitor soon
+        bool overCapacity = false;
+        qint64 written = 0;
+        if (job.type == Write || job.type == WriteImage)
+        {
+            written = job.data.size();
+            const qint64 capacity = job.cache->capacity();
+            overCapacity = capacity >= 0 && job.cache->stats().bytesUsed > capacity;
+        }
+
+        //Let go of the backend before relocking. If this was the last reference it flushes to disk.
+        job = Job();
+        lock.relock();
+
+        _bytesSinceJanitor += written;
+        if (overCapacity || (_globalCapacity >= 0 && _bytesAfterJanitor + _bytesSinceJanitor > _globalCapacity))
+            _janitorRequested = true;
+
+        _currentReceiver = 0;
+        if (modified && !_unflushed)
+        {
+            _unflushed = true;
+            _sinceFlush.restart();
+        }
+    }
+
+    _reads.clear();
+    this->flushBackends(lock);
+}
+
+//private
+DiskCacheIO::DiskCacheIO() :
+    QThread(), _queuedTileWrites(0), _stopping(false), _unflushed(false),
+    _globalCapacity(-1), _janitorRequested(true), _lastJanitorMsecs(0), _bytesAfterJanitor(0), _bytesSinceJanitor(0),
+    _currentReceiver(0), _currentCancelled(false)
+{
+    //Read results carry a TileKey across threads
+    qRegisterMetaType<TileKey>("TileKey");
+}
+
+//private static
+void DiskCacheIO::shutdown()
+{
+    QMutexLocker lock(&_instanceMutex);
+    delete DiskCacheIO::_instance;
+    DiskCacheIO::_instance = 0;
+}
+
+//private
+void DiskCacheIO::enqueue(const DiskCacheIO::Job &job)
+{
+    if (job.type == Read)
+        _reads.enqueue(job);
+    else
+    {
+        if (job.type == Write || job.type == WriteImage)
+            _queuedTileWrites++;
+        _writes.enqueue(job);
+    }
+    _wakeUp.wakeOne();
+}
+
+//private
+QList<QSharedPointer<DiskTileCache> > DiskCacheIO::liveBackends()
+{
+    QList<QSharedPointer<DiskTileCache> > toRet;
+    QList<QWeakPointer<DiskTileCache> >::iterator it = _backends.begin();
+    while (it != _backends.end())
+    {
+        QSharedPointer<DiskTileCache> cache = it->toStrongRef();
+        if (cache.isNull())
+        {
+            //Backends flush themselves when they're destroyed
+            it = _backends.erase(it);
+            continue;
+        }
+        toRet.append(cache);
+        ++it;
+    }
+
+    QHash<QString, QWeakPointer<DiskTileCache> >::iterator dirIt = _backendsByDirectory.begin();
+    while (dirIt != _backendsByDirectory.end())
+    {
+        if (dirIt.value().isNull())
+            dirIt = _backendsByDirectory.erase(dirIt);
+        else
+            ++dirIt;
+    }
+    return toRet;
+}
+
+//private
+void DiskCacheIO::flushBackends(QMutexLocker &lock)
+{
+    QList<QSharedPointer<DiskTileCache> > backends = this->liveBackends();
+    _unflushed = false;
+
+    lock.unlock();
+    foreach(const QSharedPointer<DiskTileCache>& cache, backends)
+        cache->flush();
+    backends.clear();
+    lock.relock();
+}
+
+//private
+qint64 DiskCacheIO::msecsUntilJanitor() const
+{
+    if (_backends.isEmpty())
+        return -1;
+
+    const qint64 interval = _janitorRequested ? JANITOR_MIN_INTERVAL_MS : JANITOR_INTERVAL_MS;
+    return qMax<qint64>(0, interval - _sinceJanitor.elapsed());
+}
+
+//private
+void DiskCacheIO::runJanitor(QMutexLocker &lock)
+{
+    QList<QSharedPointer<DiskTileCache> > backends = this->liveBackends();
+    const qint64 globalCapacity = _globalCapacity;
+    _janitorRequested = false;
+    _bytesSinceJanitor = 0;
+    lock.unlock();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    //First every cache on its own budget. That also tells us how big they are.
+    qint64 total = 0;
+    foreach(const QSharedPointer<DiskTileCache>& cache, backends)
+    {
+        cache->runJanitor(cache->capacity());
+        total += cache->stats().bytesUsed;
+    }
+
+    //If they're too big together, each one gives up space in proportion to its size
+    if (globalCapacity >= 0 && total > globalCapacity)
+    {
+        const qint64 before = total;
+        total = 0;
+        foreach(const QSharedPointer<DiskTileCache>& cache, backends)
+        {
+            qint64 share = (qint64) ((double) globalCapacity * cache->stats().bytesUsed / before);
+            if (cache->capacity() >= 0)
+                share = qMin(share, cache->capacity());
+            cache->runJanitor(share);
+            total += cache->stats().bytesUsed;
+        }
+    }
+
+    backends.clear();
+    lock.relock();
+
+    _bytesAfterJanitor = total;
+    _lastJanitorMsecs = timer.elapsed();
+    _lastJanitorRun = QDateTime::currentDateTimeUtc();
+    _sinceJanitor.restart();
+}
+
+//private
+void DiskCacheIO::process(DiskCacheIO::Job &job)
+{
+    switch (job.type)
+    {
+    case Read:
+        this->processRead(job);
+        break;
+
+    case Write:
+    case WriteImage:
+        this->processWrite(job);
+        break;
+
+    case Remove:
+        job.cache->remove(job.key);
+        break;
+
+    case SetExpiration:
+        job.cache->setExpirationTime(job.key, job.expireTime);
+        break;
+
+    case Open:
+        job.cache->open();
+        break;
+
+    case Compact:
+        job.cache->compact();
+        break;
+    }
+}
+
+//private
+void DiskCacheIO::processRead(DiskCacheIO::Job &job)
+{
+    //Decoding is up to the receiver, so it doesn't hold up the other reads
+    QByteArray data;
+    QDateTime expireTime;
+    QByteArray validators;
+    if (job.cache->read(job.key, &data, &expireTime, &validators))
+    {
+        //Expired tiles are still good for showing while they're revalidated, but not forever
+        if (DiskTileCache::isPastRetention(expireTime.toMSecsSinceEpoch(), QDateTime::currentMSecsSinceEpoch()))
+        {
+            job.cache->remove(job.key);
+            data.clear();
+        }
+    }
+    else
+        data.clear();
+
+    QMutexLocker lock(&_mutex);
+    if (_currentCancelled)
+        return;
+
+    QMetaObject::invokeMethod(job.receiver,
+                              job.member.constData(),
+                              Qt::QueuedConnection,
+                              Q_ARG(TileKey, job.key),
+                              Q_ARG(QByteArray, data),
+                              Q_ARG(QDateTime, expireTime),
+                              Q_ARG(QByteArray, validators));
+}
+
+//private
+void DiskCacheIO::processWrite(DiskCacheIO::Job &job)
+{
+    //Whatever is cached already gets replaced: we're only asked to write tiles that are newer
+    if (job.type == WriteImage)
+    {
+        QBuffer buffer(&job.data);
+        buffer.open(QIODevice::WriteOnly);
+        if (!job.image.save(&buffer, job.member.constData(), ENCODE_QUALITY))
+        {
+            qWarning() << "Failed to encode" << job.key << "for the disk cache";
+            return;
+        }
+    }
+
+    if (!job.cache->write(job.key, job.data, job.expireTime, job.validators))
+        qWarning() << "Failed to put" << job.key << "into disk cache";
+}
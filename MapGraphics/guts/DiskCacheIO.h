@@ -0,0 +1,202 @@
+#ifndef DISKCACHEIO_H
+#define DISKCACHEIO_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QList>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QWeakPointer>
+#include <QImage>
+#include <QDateTime>
+
+#include "TileKey.h"
+#include "DiskTileCache.h"
+
+/*!
+ \brief The I/O stage of the disk caches. A single thread shared by all tile sources that does every
+ read, write and maintenance operation on the DiskTileCache backends, so tile source threads never wait
+ on the disk.
+
+ Reads go ahead of writes. Both queues are bounded: when the read queue is full, the read is refused
+ and the caller should treat the tile as a miss; when the write queue is full, the tile simply isn't
+ cached. New tiles are written behind, i.e., the caller never waits for them to hit the disk.
+
+ Every backend that has been opened is flushed a couple of seconds after it was last used, so a crash
+ loses at most that much.
+
+ When there's nothing else to do, a janitor enforces the capacity of each backend and a global capacity
+ shared by all of them, throwing out tiles that expired long ago first and then the least recently used ones. It runs
+ every few minutes, or sooner when a cache has grown beyond its capacity.
+*/
+class DiskCacheIO : public QThread
+{
+public:
+    static DiskCacheIO * getInstance();
+
+    ~DiskCacheIO();
+
+    /*!
+     \brief Queues a read of a tile. When it's done, member of receiver is invoked (queued) with the
+     arguments (TileKey key, QByteArray data, QDateTime expireTime, QByteArray validators). data is the
+     encoded tile, which the receiver decodes, or empty if the tile is not cached. Expired tiles are
+     delivered too, so check expireTime.
+     Returns false if the read queue is full, in which case nothing is invoked.
+    */
+    bool queueRead(const QSharedPointer<DiskTileCache>& cache,
+                   const TileKey& key,
+                   QObject * receiver,
+                   const char * member);
+
+    /*!
+     \brief Queues a write of already-encoded tile bytes, replacing whatever is cached for the tile. Returns
+     false if the write queue is full, which is counted in the droppedWrites of cache's stats.
+    */
+    bool queueWrite(const QSharedPointer<DiskTileCache>& cache,
+                    const TileKey& key,
+                    const QByteArray& data,
+                    const QDateTime& expireTime,
+                    const QByteArray& validators = QByteArray());
+
+    //Same as above, but the image is encoded as format on the I/O thread first
+    bool queueWrite(const QSharedPointer<DiskTileCache>& cache,
+                    const TileKey& key,
+                    const QImage& image,
+                    const QByteArray& format,
+                    const QDateTime& expireTime,
+                    const QByteArray& validators = QByteArray());
+
+    //Throws the tile out of the cache, e.g. because it turned out to be broken
+    void queueRemove(const QSharedPointer<DiskTileCache>& cache, const TileKey& key);
+
+    void queueSetExpirationTime(const QSharedPointer<DiskTileCache>& cache,
+                                const TileKey& key,
+                                const QDateTime& expireTime);
+
+    /*!
+     \brief Lets the backend do its startup work (e.g., loading an index) in the background. From then on
+     the backend is flushed periodically.
+    */
+    void queueOpen(const QSharedPointer<DiskTileCache>& cache);
+
+    /*!
+     \brief Returns the live backend that caches in directory, if there is one, so sources that cache in
+     the same directory share a backend instead of overwriting each other's files. Otherwise backend
+     becomes the one for directory and is opened (see queueOpen()).
+    */
+    QSharedPointer<DiskTileCache> shareBackend(const QString& directory,
+                                               const QSharedPointer<DiskTileCache>& backend);
+
+    void queueCompact(const QSharedPointer<DiskTileCache>& cache);
+
+    /*!
+     \brief Drops queued reads for receiver. Once this returns, receiver won't be invoked anymore, so call
+     it before receiver is destroyed.
+    */
+    void cancelReads(QObject * receiver);
+
+    /*!
+     \brief Drops a queued read of one tile for receiver, if it hasn't started yet. A read that is already
+     in progress is still delivered.
+    */
+    void cancelRead(QObject * receiver, const TileKey& key);
+
+    //The number of bytes all disk caches together may use, or -1 for no limit
+    qint64 globalCapacity() const;
+    void setGlobalCapacity(qint64 bytes);
+
+    //Makes the janitor run as soon as it's allowed to, e.g. because a capacity changed
+    void requestJanitor();
+
+    //Totals over all open disk caches. capacityBytes is the global capacity, the scan is the janitor's last.
+    DiskTileCache::Stats globalStats();
+
+protected:
+    //virtual from QThread
+    virtual void run();
+
+private:
+    DiskCacheIO();
+
+    static void shutdown();
+
+    enum JobType
+    {
+        Read,
+        Write,
+        WriteImage,
+        Remove,
+        SetExpiration,
+        Open,
+        Compact
+    };
+
+    struct Job
+    {
+        Job() : type(Read), receiver(0) {}
+
+        JobType type;
+        QSharedPointer<DiskTileCache> cache;
+        TileKey key;
+        QByteArray data;
+        QImage image;
+        QDateTime expireTime;
+        QByteArray validators;
+        QObject * receiver;
+        QByteArray member;
+    };
+
+    void enqueue(const Job& job);
+
+    //Call with _mutex held. Returns the backends that are still alive and forgets the others.
+    QList<QSharedPointer<DiskTileCache> > liveBackends();
+
+    //Call with _mutex held. Unlocks it while the backends are flushed.
+    void flushBackends(QMutexLocker& lock);
+
+    //Call with _mutex held. Returns how long until the janitor should run, or -1 if it doesn't need to.
+    qint64 msecsUntilJanitor() const;
+
+    //Call with _mutex held. Unlocks it while the janitor works.
+    void runJanitor(QMutexLocker& lock);
+
+    void process(Job& job);
+    void processRead(Job& job);
+    void processWrite(Job& job);
+
+    static DiskCacheIO * _instance;
+    static QMutex _instanceMutex;
+
+    mutable QMutex _mutex;
+    QWaitCondition _wakeUp;
+    QQueue<Job> _reads;
+    QQueue<Job> _writes;
+    int _queuedTileWrites;
+    bool _stopping;
+
+    QList<QWeakPointer<DiskTileCache> > _backends;
+
+    //The backends by the absolute path of their directory
+    QHash<QString, QWeakPointer<DiskTileCache> > _backendsByDirectory;
+    QElapsedTimer _sinceFlush;
+    bool _unflushed;
+
+    qint64 _globalCapacity;
+    QElapsedTimer _sinceJanitor;
+    bool _janitorRequested;
+    qint64 _lastJanitorMsecs;
+    QDateTime _lastJanitorRun;
+
+    //What all caches took up after the janitor's last run, and roughly how much has been written since
+    qint64 _bytesAfterJanitor;
+    qint64 _bytesSinceJanitor;
+
+    //The receiver of the read being processed, and whether it was cancelled meanwhile
+    QObject * _currentReceiver;
+    bool _currentCancelled;
+};
+
+#endif // DISKCACHEIO_H
@@ -0,0 +1,107 @@
+#include "DiskTileCache.h"
+
+#include <QMutexLocker>
+#include <QElapsedTimer>
+
+//When the janitor has to evict, it goes this far below the capacity so it doesn't have to run again right away
+const qreal JANITOR_LOW_WATERMARK = 0.9;
+
+//Expired tiles are kept this long. Servers rarely change tiles, so most of them only need revalidating.
+const qint64 STALE_RETENTION_MSECS = 30LL * 24 * 60 * 60 * 1000;
+
+DiskTileCache::DiskTileCache()
+{
+    _stats.bytesUsed = 0;
+    _stats.capacityBytes = -1;
+    _stats.expiredEvictions = 0;
+    _stats.lruEvictions = 0;
+    _stats.droppedWrites = 0;
+    _stats.lastScanMsecs = 0;
+}
+
+DiskTileCache::~DiskTileCache()
+{
+}
+
+DiskTileCache::Stats DiskTileCache::stats() const
+{
+    QMutexLocker lock(&_statsLock);
+    return _stats;
+}
+
+qint64 DiskTileCache::capacity() const
+{
+    QMutexLocker lock(&_statsLock);
+    return _stats.capacityBytes;
+}
+
+void DiskTileCache::setCapacity(qint64 bytes)
+{
+    QMutexLocker lock(&_statsLock);
+    _stats.capacityBytes = qMax<qint64>(-1, bytes);
+}
+
+void DiskTileCache::runJanitor(qint64 maxBytes)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    const qint64 target = (qint64) (maxBytes * JANITOR_LOW_WATERMARK);
+
+    quint64 expired = 0;
+    quint64 lru = 0;
+    const qint64 bytesUsed = this->trim(maxBytes, target, &expired, &lru);
+
+    QMutexLocker lock(&_statsLock);
+    _stats.bytesUsed = bytesUsed;
+    _stats.expiredEvictions += expired;
+    _stats.lruEvictions += lru;
+    _stats.lastScanMsecs = timer.elapsed();
+    _stats.lastScan = QDateTime::currentDateTimeUtc();
+}
+
+void DiskTileCache::noteDroppedWrite()
+{
+    QMutexLocker lock(&_statsLock);
+    _stats.droppedWrites++;
+}
+
+//static
+bool DiskTileCache::isPastRetention(qint64 expires, qint64 now)
+{
+    return expires + STALE_RETENTION_MSECS <= now;
+}
+
+//virtual
+void DiskTileCache::open()
+{
+}
+
+//virtual
+bool DiskTileCache::mightContain(const TileKey &key) const
+{
+    Q_UNUSED(key)
+
+    //Without a way to tell, the tile has to be looked for
+    return true;
+}
+
+//virtual
+void DiskTileCache::compact()
+{
+    //Backends that never leave garbage behind have nothing to do
+}
+
+//protected
+void DiskTileCache::adjustBytesUsed(qint64 delta)
+{
+    QMutexLocker lock(&_statsLock);
+    _stats.bytesUsed = qMax<qint64>(0, _stats.bytesUsed + delta);
+}
+
+//protected
+void DiskTileCache::setBytesUsed(qint64 bytes)
+{
+    QMutexLocker lock(&_statsLock);
+    _stats.bytesUsed = bytes;
+}
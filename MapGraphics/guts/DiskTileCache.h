@@ -0,0 +1,130 @@
+#ifndef DISKTILECACHE_H
+#define DISKTILECACHE_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QMutex>
+
+#include "TileKey.h"
+
+/*!
+ \brief Storage backend for the disk cache of a MapTileSource. MapTileSource::fromDiskCache() and
+ MapTileSource::toDiskCache() go through this interface, so every caching source can use any backend.
+
+ Backends store tiles as the encoded bytes they were given (PNG, JPEG, ...) together with the time
+ the tile expires and the validators the server sent with it (its ETag and Last-Modified date), which
+ are opaque to the backend. They never decode anything.
+
+ Expired tiles are kept for a while (see isPastRetention()) so they can be shown while they're being
+ revalidated and, if the server says they haven't changed, don't have to be downloaded again.
+
+ Backends are not thread-safe. Apart from mightContain() and the capacity and stats accessors, they're
+ only ever used from the DiskCacheIO thread.
+
+ A backend may be given a capacity in bytes. The DiskCacheIO janitor enforces it every now and then by
+ calling runJanitor(), which throws out tiles that expired long ago first and then the least recently
+ used ones.
+*/
+class DiskTileCache
+{
+public:
+    struct Stats
+    {
+        qint64 bytesUsed;
+        qint64 capacityBytes;
+        quint64 expiredEvictions;
+        quint64 lruEvictions;
+        quint64 droppedWrites;
+        qint64 lastScanMsecs;
+        QDateTime lastScan;
+    };
+
+    DiskTileCache();
+    virtual ~DiskTileCache();
+
+    //Returns a snapshot of the size and janitor counters of the cache. Safe to call from any thread.
+    DiskTileCache::Stats stats() const;
+
+    //The number of bytes the cache may use, or -1 for no limit. Safe to call from any thread.
+    qint64 capacity() const;
+    void setCapacity(qint64 bytes);
+
+    /*!
+     \brief Removes tiles past retention and, if the cache holds more than maxBytes, least recently used tiles
+     until it's comfortably below that. A negative maxBytes means no limit. Records how it went in stats().
+    */
+    void runJanitor(qint64 maxBytes);
+
+    //Counts a write that was dropped because the I/O thread was too busy. Safe to call from any thread.
+    void noteDroppedWrite();
+
+    //Does any startup work the backend needs (e.g., loading an index). Called once, before anything else.
+    virtual void open();
+
+    /*!
+     \brief Returns false only if the tile is definitely not in the cache. Unlike everything else this is
+     safe to call from any thread and never touches the disk, so a miss can go to the network right away.
+    */
+    virtual bool mightContain(const TileKey& key) const;
+
+    /*!
+     \brief Reads the encoded bytes, the expiration time and the validators of a cached tile. Returns
+     false if the tile is not in the cache. Expired tiles are returned too.
+    */
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime, QByteArray * validators)=0;
+
+    /*!
+     \brief Stores the encoded bytes of a tile, the time it expires and its validators (which may be
+     empty). Replaces any previous version. Returns true on success.
+    */
+    virtual bool write(const TileKey& key,
+                       const QByteArray& data,
+                       const QDateTime& expireTime,
+                       const QByteArray& validators)=0;
+
+    //Returns true if the tile is in the cache (expired or not)
+    virtual bool contains(const TileKey& key)=0;
+
+    //Removes the tile from the cache, if it's there
+    virtual void remove(const TileKey& key)=0;
+
+    //Returns the expiration time of a cached tile, or a null QDateTime if the tile isn't cached
+    virtual QDateTime expirationTime(const TileKey& key)=0;
+
+    //Changes the expiration time of a cached tile without touching its data
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime)=0;
+
+    //Makes sure everything written so far is on disk
+    virtual void flush()=0;
+
+    /*!
+     \brief Reclaims disk space taken up by removed or superseded tiles. This can take a while and
+     should only be run while the cache isn't busy.
+    */
+    virtual void compact();
+
+    /*!
+     \brief Returns true if a tile that expires (expired) at expires, in msecs since the epoch, has been
+     expired for so long that it's not worth keeping for revalidation anymore.
+    */
+    static bool isPastRetention(qint64 expires, qint64 now);
+
+protected:
+    /*!
+     \brief Does the work of runJanitor(). Removes tiles past retention. Then, if more than maxBytes are used
+     (and maxBytes isn't negative), removes least recently used tiles until no more than targetBytes are.
+     Adds the number of tiles removed to the counters and returns the number of bytes the cache takes up
+     afterwards.
+    */
+    virtual qint64 trim(qint64 maxBytes, qint64 targetBytes, quint64 * expiredEvictions, quint64 * lruEvictions)=0;
+
+    //Keep the size estimate up to date between janitor runs
+    void adjustBytesUsed(qint64 delta);
+    void setBytesUsed(qint64 bytes);
+
+private:
+    mutable QMutex _statsLock;
+    DiskTileCache::Stats _stats;
+};
+
+#endif // DISKTILECACHE_H
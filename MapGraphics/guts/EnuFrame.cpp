@@ -0,0 +1,174 @@
+#include "EnuFrame.h"
+
+#include "Wgs84.h"
+
+EnuFrame::EnuFrame()
+{
+    this->setReference(0.0, 0.0, 0.0);
+}
+
+EnuFrame::EnuFrame(const Position &reference)
+{
+    this->setReference(reference.latitude(), reference.longitude(), reference.altitude());
+}
+
+EnuFrame::EnuFrame(qreal reflat, qreal reflon, qreal refalt)
+{
+    this->setReference(reflat, reflon, refalt);
+}
+
+Position EnuFrame::reference() const
+{
+    return _reference;
+}
+
+bool EnuFrame::operator ==(const EnuFrame &other) const
+{
+    return _reference == other._reference;
+}
+
+bool EnuFrame::operator !=(const EnuFrame &other) const
+{
+    return !(*this == other);
+}
+
+void EnuFrame::xyz2enu(qreal x, qreal y, qreal z, qreal *east, qreal *north, qreal *up) const
+{
+    const qreal dx = x - _x0;
+    const qreal dy = y - _y0;
+    const qreal dz = z - _z0;
+
+    *east = _east[0]*dx + _east[1]*dy + _east[2]*dz;
+    *north = _north[0]*dx + _north[1]*dy + _north[2]*dz;
+    *up = _up[0]*dx + _up[1]*dy + _up[2]*dz;
+}
+
+void EnuFrame::enu2xyz(qreal east, qreal north, qreal up, qreal *x, qreal *y, qreal *z) const
+{
+    *x = _x0 + _east[0]*east + _north[0]*north + _up[0]*up;
+    *y = _y0 + _east[1]*east + _north[1]*north + _up[1]*up;
+    *z = _z0 + _east[2]*east + _north[2]*north + _up[2]*up;
+}
+
+QVector3D EnuFrame::xyz2enu(const QVector3D &xyz) const
+{
+    qreal east, north, up;
+    this->xyz2enu(xyz.x(), xyz.y(), xyz.z(), &east, &north, &up);
+    return QVector3D(east, north, up);
+}
+
+QVector3D EnuFrame::enu2xyz(const QVector3D &enu) const
+{
+    qreal x, y, z;
+    this->enu2xyz(enu.x(), enu.y(), enu.z(), &x, &y, &z);
+    return QVector3D(x, y, z);
+}
+
+void EnuFrame::lla2enu(qreal lat, qreal lon, qreal alt, qreal *east, qreal *north, qreal *up) const
+{
+    qreal x, y, z;
+    Wgs84::lla2ecef(lat, lon, alt, &x, &y, &z);
+    this->xyz2enu(x, y, z, east, north, up);
+}
+
+void EnuFrame::enu2lla(qreal east, qreal north, qreal up, qreal *lat, qreal *lon, qreal *alt) const
+{
+    qreal x, y, z;
+    this->enu2xyz(east, north, up, &x, &y, &z);
+    Wgs84::ecef2lla(x, y, z, lat, lon, alt);
+}
+
+QVector3D EnuFrame::lla2enu(const Position &lla) const
+{
+    qreal east, north, up;
+    this->lla2enu(lla.latitude(), lla.longitude(), lla.altitude(), &east, &north, &up);
+    return QVector3D(east, north, up);
+}
+
+Position EnuFrame::enu2lla(const QVector3D &enu) const
+{
+    qreal lat, lon, alt;
+    this->enu2lla(enu.x(), enu.y(), enu.z(), &lat, &lon, &alt);
+    return Position(lon, lat, alt);
+}
+
+void EnuFrame::lla2enu(const qreal *lat, const qreal *lon, const qreal *alt,
+                       qreal *east, qreal *north, qreal *up, int count) const
+{
+    //A missing array becomes a single element with a stride of 0, so the loop doesn't check for it
+    const qreal zero = 0.0;
+    qreal scratch;
+    const qreal * altIn = (alt != 0) ? alt : &zero;
+    qreal * upOut = (up != 0) ? up : &scratch;
+    const int altStride = (alt != 0) ? 1 : 0;
+    const int upStride = (up != 0) ? 1 : 0;
+
+    for (int i = 0; i < count; i++)
+        this->lla2enu(lat[i], lon[i], altIn[i * altStride], east + i, north + i, upOut + i * upStride);
+}
+
+void EnuFrame::enu2lla(const qreal *east, const qreal *north, const qreal *up,
+                       qreal *lat, qreal *lon, qreal *alt, int count) const
+{
+    //Same as above
+    const qreal zero = 0.0;
+    qreal scratch;
+    const qreal * upIn = (up != 0) ? up : &zero;
+    qreal * altOut = (alt != 0) ? alt : &scratch;
+    const int upStride = (up != 0) ? 1 : 0;
+    const int altStride = (alt != 0) ? 1 : 0;
+
+    for (int i = 0; i < count; i++)
+        this->enu2lla(east[i], north[i], upIn[i * upStride], lat + i, lon + i, altOut + i * altStride);
+}
+
+QPolygonF EnuFrame::lla2enu(const QPolygonF &lonLat) const
+{
+    QPolygonF toRet(lonLat.size());
+    for (int i = 0; i < lonLat.size(); i++)
+    {
+        const QPointF& ll = lonLat.at(i);
+        qreal east, north, up;
+        this->lla2enu(ll.y(), ll.x(), 0.0, &east, &north, &up);
+        toRet[i] = QPointF(east, north);
+    }
+    return toRet;
+}
+
+QPolygonF EnuFrame::enu2lla(const QPolygonF &eastNorth) const
+{
+    QPolygonF toRet(eastNorth.size());
+    for (int i = 0; i < eastNorth.size(); i++)
+    {
+        const QPointF& en = eastNorth.at(i);
+        qreal lat, lon, alt;
+        this->enu2lla(en.x(), en.y(), 0.0, &lat, &lon, &alt);
+        toRet[i] = QPointF(lon, lat);
+    }
+    return toRet;
+}
+
+//private
+void EnuFrame::setReference(qreal reflat, qreal reflon, qreal refalt)
+{
+    _reference = Position(reflon, reflat, refalt);
+
+    const qreal sinLat = std::sin(reflat*Wgs84::DEG2RAD);
+    const qreal cosLat = std::cos(reflat*Wgs84::DEG2RAD);
+    const qreal sinLon = std::sin(reflon*Wgs84::DEG2RAD);
+    const qreal cosLon = std::cos(reflon*Wgs84::DEG2RAD);
+
+    _east[0] = -sinLon;
+    _east[1] = cosLon;
+    _east[2] = 0.0;
+
+    _north[0] = -sinLat*cosLon;
+    _north[1] = -sinLat*sinLon;
+    _north[2] = cosLat;
+
+    _up[0] = cosLat*cosLon;
+    _up[1] = cosLat*sinLon;
+    _up[2] = sinLat;
+
+    Wgs84::lla2ecef(reflat, reflon, refalt, &_x0, &_y0, &_z0);
+}
@@ -0,0 +1,69 @@
+#ifndef ENUFRAME_H
+#define ENUFRAME_H
+
+#include <QVector3D>
+#include <QPolygonF>
+
+#include "MapGraphics_global.h"
+#include "Position.h"
+
+/*!
+ \brief A local east/north/up frame with its origin at a reference position. The reference's ECEF
+ coordinates and the ECEF <-> ENU rotation are worked out once, when the frame is made; converting between
+ ECEF and ENU then takes only multiply-adds. Make one frame and reuse it for every point around the same
+ reference.
+
+ Everything is in double precision: lat/lon in degrees, everything else in meters. Batch methods take
+ structure-of-arrays input. alt/up inputs may be null for 0, alt/up outputs may be null if not wanted, and
+ outputs may be the same arrays as inputs.
+*/
+class MAPGRAPHICSSHARED_EXPORT EnuFrame
+{
+public:
+    EnuFrame();
+    explicit EnuFrame(const Position& reference);
+    EnuFrame(qreal reflat, qreal reflon, qreal refalt);
+
+    Position reference() const;
+
+    bool operator ==(const EnuFrame& other) const;
+    bool operator !=(const EnuFrame& other) const;
+
+    //ECEF <-> ENU
+    void xyz2enu(qreal x, qreal y, qreal z, qreal * east, qreal * north, qreal * up) const;
+    void enu2xyz(qreal east, qreal north, qreal up, qreal * x, qreal * y, qreal * z) const;
+    QVector3D xyz2enu(const QVector3D& xyz) const;
+    QVector3D enu2xyz(const QVector3D& enu) const;
+
+    //Geodetic <-> ENU
+    void lla2enu(qreal lat, qreal lon, qreal alt, qreal * east, qreal * north, qreal * up) const;
+    void enu2lla(qreal east, qreal north, qreal up, qreal * lat, qreal * lon, qreal * alt) const;
+    QVector3D lla2enu(const Position& lla) const;
+    Position enu2lla(const QVector3D& enu) const;
+
+    void lla2enu(const qreal * lat, const qreal * lon, const qreal * alt,
+                 qreal * east, qreal * north, qreal * up, int count) const;
+    void enu2lla(const qreal * east, const qreal * north, const qreal * up,
+                 qreal * lat, qreal * lon, qreal * alt, int count) const;
+
+    //Polygons on the ground: (lon,lat) points to (east,north) points and back. Altitude is ignored.
+    QPolygonF lla2enu(const QPolygonF& lonLat) const;
+    QPolygonF enu2lla(const QPolygonF& eastNorth) const;
+
+private:
+    void setReference(qreal reflat, qreal reflon, qreal refalt);
+
+    Position _reference;
+
+    //Rows of the ECEF -> ENU rotation. Its inverse is its transpose.
+    qreal _east[3];
+    qreal _north[3];
+    qreal _up[3];
+
+    //The reference in ECEF
+    qreal _x0;
+    qreal _y0;
+    qreal _z0;
+};
+
+#endif // ENUFRAME_H
@@ -1,53 +1,1016 @@
 #include "MapGraphicsNetwork.h"
 
 #include <QMutexLocker>
-#include <QNetworkRequest>
+#include <QNetworkReply>
 #include <QThread>
+#include <QTimer>
+#include <QUrl>
+#include <QCoreApplication>
 #include <QtDebug>
+#include <cmath>
+#include <algorithm>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5,10,0)
+#include <QRandomGenerator>
+#endif
 
 const QByteArray DEFAULT_USER_AGENT = "MapGraphics";
 
+//What QNetworkAccessManager opens per host over HTTP/1.1 anyway
+const int DEFAULT_MAX_IN_FLIGHT_PER_HOST = 6;
+
+const int DEFAULT_TIMEOUT_MSECS = 30 * 1000;
+const int DEFAULT_MAX_RETRIES = 3;
+const int DEFAULT_RETRY_BASE_DELAY_MSECS = 500;
+const qint64 MAX_RETRY_DELAY_MSECS = 60 * 1000;
+
+const int DEFAULT_FAILURE_THRESHOLD = 5;
+const int DEFAULT_CIRCUIT_COOLDOWN_MSECS = 30 * 1000;
+
+//Hedging starts once a group of mirrors has this many latencies, and looks at the most recent ones only
+const int MIN_HEDGE_SAMPLES = 20;
+const int HEDGE_LATENCY_WINDOW = 100;
+
+//Sooner than this, a hedge would mostly duplicate requests that are about to be answered anyway
+const qint64 MIN_HEDGE_DELAY_MSECS = 20;
+
+//Failures that may well be gone if we try again a bit later, and that say something about the host
+static bool isTransientFailure(const NetworkResponse& response)
+{
+    if (response.httpStatus >= 500 || response.httpStatus == 408 || response.httpStatus == 429)
+        return true;
+
+    //No answer at all: couldn't connect, connection dropped, timed out...
+    return response.httpStatus == 0
+            && response.error != QNetworkReply::NoError
+            && response.error != QNetworkReply::OperationCanceledError;
+}
+
+//The delay the server asked for with Retry-After, in msecs. We only understand the delta-seconds form.
+static qint64 retryAfterMsecs(const NetworkResponse& response)
+{
+    bool ok = false;
+    const qint64 seconds = response.header("Retry-After").trimmed().toLongLong(&ok);
+    if (!ok || seconds < 0)
+        return 0;
+    return qMin(seconds * 1000, MAX_RETRY_DELAY_MSECS);
+}
+
 //static
-QHash<QThread *, MapGraphicsNetwork *> MapGraphicsNetwork::_instances = QHash<QThread *, MapGraphicsNetwork*>();
-QMutex MapGraphicsNetwork::_mutex;
+MapGraphicsNetwork * MapGraphicsNetwork::_instance = 0;
+QMutex MapGraphicsNetwork::_instanceMutex;
+
+MapGraphicsNetwork::HostState::HostState() :
+    maxInFlight(-1), rate(0.0), burst(1.0), tokens(1.0), consecutiveFailures(0), openUntil(-1), probing(false)
+{
+    stats.inFlight = 0;
+    stats.queued = 0;
+    stats.started = 0;
+    stats.finished = 0;
+    stats.totalQueueMsecs = 0;
+    stats.maxQueueMsecs = 0;
+    stats.retries = 0;
+    stats.timeouts = 0;
+    stats.failures = 0;
+    stats.circuitOpens = 0;
+    stats.circuitOpen = false;
+    stats.hedgesSent = 0;
+    stats.hedgesWon = 0;
+}
+
+MapGraphicsNetwork::LatencyWindow::LatencyWindow() :
+    next(0)
+{
+}
 
 //static
 MapGraphicsNetwork *MapGraphicsNetwork::getInstance()
 {
-    QMutexLocker lock(&_mutex);
-    QThread * current = QThread::currentThread();
-    if (!MapGraphicsNetwork::_instances.contains(current))
-        MapGraphicsNetwork::_instances.insert(current, new MapGraphicsNetwork());
-    return MapGraphicsNetwork::_instances.value(current);
+    QMutexLocker lock(&_instanceMutex);
+    if (!MapGraphicsNetwork::_instance)
+    {
+        MapGraphicsNetwork::_instance = new MapGraphicsNetwork();
+
+        //Make sure downloads are stopped before the application goes away
+        qAddPostRoutine(MapGraphicsNetwork::shutdown);
+    }
+    return MapGraphicsNetwork::_instance;
 }
 
 MapGraphicsNetwork::~MapGraphicsNetwork()
 {
-    delete _manager;
-    _manager = 0;
+    //The manager and its replies belong to the network thread
+    QMetaObject::invokeMethod(this, "destroyManager", Qt::BlockingQueuedConnection);
+    _thread->quit();
+    _thread->wait();
+    delete _thread;
 }
 
-QNetworkReply *MapGraphicsNetwork::get(QNetworkRequest &request)
+quint64 MapGraphicsNetwork::queueGet(const QNetworkRequest &request,
+                                     QObject *receiver,
+                                     const char *member,
+                                     const QStringList &mirrors)
 {
-    request.setRawHeader("User-Agent",
-                         _userAgent);
-    QNetworkReply * toRet = _manager->get(request);
-    return toRet;
+    QNetworkRequest toSend(request);
+    QUrl url = toSend.url();
+
+    QMutexLocker lock(&_mutex);
+    if (!mirrors.isEmpty())
+    {
+        url.setHost(this->nextMirror(mirrors));
+        toSend.setUrl(url);
+    }
+
+    toSend.setRawHeader("User-Agent", _userAgent);
+#if QT_VERSION >= QT_VERSION_CHECK(5,8,0)
+    toSend.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, _http2Enabled);
+#endif
+
+    const quint64 ticket = _nextTicket++;
+    PendingGet get;
+    get.request = toSend;
+    get.host = url.host();
+    get.receiver = receiver;
+    get.member = member;
+    get.mirrors = mirrors;
+    get.queued.start();
+    get.queueMsecs = 0;
+    get.attempts = 0;
+    get.sent = false;
+    get.group = mirrors.isEmpty() ? get.host : mirrors.join(",");
+    get.partner = 0;
+    get.isHedge = false;
+    get.awaitingHedge = false;
+    _gets.insert(ticket, get);
+
+    HostState& host = this->hostState(get.host);
+    host.queue.enqueue(ticket);
+    host.stats.queued++;
+
+    this->schedulePump();
+    return ticket;
+}
+
+void MapGraphicsNetwork::cancel(quint64 ticket)
+{
+    QMutexLocker lock(&_mutex);
+    this->withdraw(ticket);
+}
+
+void MapGraphicsNetwork::cancelAll(QObject *receiver)
+{
+    QMutexLocker lock(&_mutex);
+    QList<quint64> tickets;
+    QHash<quint64, PendingGet>::const_iterator it;
+    for (it = _gets.constBegin(); it != _gets.constEnd(); ++it)
+    {
+        if (it.value().receiver == receiver)
+            tickets.append(it.key());
+    }
+
+    foreach(quint64 ticket, tickets)
+        this->withdraw(ticket);
 }
 
 void MapGraphicsNetwork::setUserAgent(const QByteArray &agent)
 {
+    QMutexLocker lock(&_mutex);
     _userAgent = agent;
 }
 
 QByteArray MapGraphicsNetwork::userAgent() const
 {
+    QMutexLocker lock(&_mutex);
     return _userAgent;
 }
 
+int MapGraphicsNetwork::maxInFlight(const QString &host) const
+{
+    QMutexLocker lock(&_mutex);
+    const int configured = _hosts.value(host).maxInFlight;
+    return (configured < 0) ? _defaultMaxInFlight : configured;
+}
+
+void MapGraphicsNetwork::setMaxInFlight(const QString &host, int requests)
+{
+    QMutexLocker lock(&_mutex);
+    this->hostState(host).maxInFlight = qMax(1, requests);
+
+    //There may be room for more now
+    this->schedulePump();
+}
+
+int MapGraphicsNetwork::defaultMaxInFlight() const
+{
+    QMutexLocker lock(&_mutex);
+    return _defaultMaxInFlight;
+}
+
+void MapGraphicsNetwork::setDefaultMaxInFlight(int requests)
+{
+    QMutexLocker lock(&_mutex);
+    _defaultMaxInFlight = qMax(1, requests);
+    this->schedulePump();
+}
+
+qreal MapGraphicsNetwork::rateLimit(const QString &host) const
+{
+    QMutexLocker lock(&_mutex);
+    return _hosts.value(host).rate;
+}
+
+void MapGraphicsNetwork::setRateLimit(const QString &host, qreal requestsPerSecond, int burst)
+{
+    QMutexLocker lock(&_mutex);
+    HostState& state = this->hostState(host);
+    state.rate = qMax<qreal>(0.0, requestsPerSecond);
+    state.burst = qMax(1, burst);
+    state.tokens = state.burst;
+    state.sinceRefill.invalidate();
+    this->schedulePump();
+}
+
+bool MapGraphicsNetwork::isHttp2Enabled() const
+{
+    QMutexLocker lock(&_mutex);
+    return _http2Enabled;
+}
+
+void MapGraphicsNetwork::setHttp2Enabled(bool enabled)
+{
+    QMutexLocker lock(&_mutex);
+    _http2Enabled = enabled;
+}
+
+int MapGraphicsNetwork::timeout() const
+{
+    QMutexLocker lock(&_mutex);
+    return _timeout;
+}
+
+void MapGraphicsNetwork::setTimeout(int msecs)
+{
+    QMutexLocker lock(&_mutex);
+    _timeout = qMax(1, msecs);
+}
+
+int MapGraphicsNetwork::maxRetries() const
+{
+    QMutexLocker lock(&_mutex);
+    return _maxRetries;
+}
+
+void MapGraphicsNetwork::setMaxRetries(int retries)
+{
+    QMutexLocker lock(&_mutex);
+    _maxRetries = qMax(0, retries);
+}
+
+int MapGraphicsNetwork::retryBaseDelay() const
+{
+    QMutexLocker lock(&_mutex);
+    return _retryBaseDelay;
+}
+
+void MapGraphicsNetwork::setRetryBaseDelay(int msecs)
+{
+    QMutexLocker lock(&_mutex);
+    _retryBaseDelay = qMax(0, msecs);
+}
+
+int MapGraphicsNetwork::failureThreshold() const
+{
+    QMutexLocker lock(&_mutex);
+    return _failureThreshold;
+}
+
+int MapGraphicsNetwork::circuitCooldown() const
+{
+    QMutexLocker lock(&_mutex);
+    return _circuitCooldown;
+}
+
+void MapGraphicsNetwork::setCircuitBreaker(int failureThreshold, int cooldownMsecs)
+{
+    QMutexLocker lock(&_mutex);
+    _failureThreshold = qMax(0, failureThreshold);
+    _circuitCooldown = qMax(0, cooldownMsecs);
+}
+
+bool MapGraphicsNetwork::isCircuitOpen(const QString &host) const
+{
+    QMutexLocker lock(&_mutex);
+    QHash<QString, HostState>::const_iterator found = _hosts.constFind(host);
+    return found != _hosts.constEnd() && this->isOpen(found.value());
+}
+
+qreal MapGraphicsNetwork::hedgePercentile() const
+{
+    QMutexLocker lock(&_mutex);
+    return _hedgePercentile;
+}
+
+void MapGraphicsNetwork::setHedgePercentile(qreal percentile)
+{
+    QMutexLocker lock(&_mutex);
+    _hedgePercentile = qBound<qreal>(0.0, percentile, 1.0);
+}
+
+QStringList MapGraphicsNetwork::hosts() const
+{
+    QMutexLocker lock(&_mutex);
+    return _hosts.keys();
+}
+
+MapGraphicsNetwork::HostStats MapGraphicsNetwork::hostStats(const QString &host) const
+{
+    QMutexLocker lock(&_mutex);
+    QHash<QString, HostState>::const_iterator found = _hosts.constFind(host);
+    if (found == _hosts.constEnd())
+        return HostState().stats;
+
+    MapGraphicsNetwork::HostStats toRet = found.value().stats;
+    toRet.circuitOpen = this->isOpen(found.value());
+    return toRet;
+}
+
 //protected
-MapGraphicsNetwork::MapGraphicsNetwork()
+MapGraphicsNetwork::MapGraphicsNetwork() :
+    QObject(), _manager(0), _userAgent(DEFAULT_USER_AGENT), _defaultMaxInFlight(DEFAULT_MAX_IN_FLIGHT_PER_HOST),
+    _http2Enabled(true), _timeout(DEFAULT_TIMEOUT_MSECS), _maxRetries(DEFAULT_MAX_RETRIES),
+    _retryBaseDelay(DEFAULT_RETRY_BASE_DELAY_MSECS), _failureThreshold(DEFAULT_FAILURE_THRESHOLD),
+    _circuitCooldown(DEFAULT_CIRCUIT_COOLDOWN_MSECS), _hedgePercentile(0.0), _nextTicket(1), _pumpScheduled(false),
+    _refillScheduled(false), _retryTimer(0)
+{
+    _clock.start();
+
+    //Responses are handed to receivers across threads
+    qRegisterMetaType<NetworkResponse>("NetworkResponse");
+
+    _thread = new QThread();
+    this->moveToThread(_thread);
+    _thread->start();
+
+    //The manager has to be created on the thread that uses it
+    QMetaObject::invokeMethod(this, "initialize", Qt::QueuedConnection);
+}
+
+//private slot
+void MapGraphicsNetwork::initialize()
+{
+    _manager = new QNetworkAccessManager(this);
+
+    _retryTimer = new QTimer(this);
+    _retryTimer->setSingleShot(true);
+    connect(_retryTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(retryDue()));
+
+    this->pump();
+}
+
+//private slot
+void MapGraphicsNetwork::destroyManager()
+{
+    foreach(QNetworkReply * reply, _replies.keys())
+    {
+        reply->disconnect(this);
+        reply->abort();
+        delete reply;
+    }
+    _replies.clear();
+
+    delete _manager;
+    _manager = 0;
+}
+
+//private slot
+void MapGraphicsNetwork::pump()
+{
+    QMutexLocker lock(&_mutex);
+    _pumpScheduled = false;
+    if (!_manager)
+        return;
+
+    //Every host sends what its limits allow, in the order the requests came in
+    qint64 untilRefill = -1;
+    QHash<QString, HostState>::iterator it;
+    for (it = _hosts.begin(); it != _hosts.end(); ++it)
+    {
+        HostState& host = it.value();
+
+        //The host is down as far as we know, so there's no point in making anyone wait for it
+        if (this->isOpen(host))
+        {
+            while (!host.queue.isEmpty())
+            {
+                const quint64 ticket = host.queue.dequeue();
+                host.stats.queued--;
+                QHash<quint64, PendingGet>::iterator refusedGet = _gets.find(ticket);
+                if (refusedGet == _gets.end())
+                    continue;
+
+                NetworkResponse refused;
+                refused.error = QNetworkReply::ServiceUnavailableError;
+                refused.errorString = "Circuit breaker open for " + it.key();
+                refused.host = it.key();
+                refused.circuitOpen = true;
+                if (refusedGet.value().isHedge)
+                    this->hedgeFailed(ticket, refused);
+                else if (refusedGet.value().partner != 0)
+                {
+                    //The hedge is out on another mirror and may still come through
+                    refusedGet.value().sent = false;
+                    refusedGet.value().awaitingHedge = true;
+                }
+                else
+                {
+                    host.stats.failures++;
+                    this->finish(ticket, refused);
+                }
+            }
+            continue;
+        }
+
+        //Half-open: a single request finds out whether the host is back
+        int maxInFlight = (host.maxInFlight < 0) ? _defaultMaxInFlight : host.maxInFlight;
+        if (host.openUntil >= 0)
+            maxInFlight = 1;
+
+        while (!host.queue.isEmpty() && host.stats.inFlight < maxInFlight)
+        {
+            if (host.rate > 0.0)
+            {
+                //Refill the bucket for the time that has passed
+                if (host.sinceRefill.isValid())
+                    host.tokens = qMin(host.burst, host.tokens + host.sinceRefill.restart() / 1000.0 * host.rate);
+                else
+                    host.sinceRefill.start();
+
+                if (host.tokens < 1.0)
+                {
+                    const qint64 wait = (qint64) ceil((1.0 - host.tokens) * 1000.0 / host.rate);
+                    untilRefill = (untilRefill < 0) ? wait : qMin(untilRefill, wait);
+                    break;
+                }
+                host.tokens -= 1.0;
+            }
+
+            const quint64 ticket = host.queue.dequeue();
+            host.stats.queued--;
+            QHash<quint64, PendingGet>::iterator get = _gets.find(ticket);
+            if (get == _gets.end())
+                continue;
+
+            this->send(ticket, get.value());
+            if (host.openUntil >= 0)
+                host.probing = true;
+            if (get.value().isHedge)
+                host.stats.hedgesSent++;
+            host.stats.inFlight++;
+            host.stats.started++;
+            host.stats.totalQueueMsecs += get.value().queueMsecs;
+            host.stats.maxQueueMsecs = qMax(host.stats.maxQueueMsecs, get.value().queueMsecs);
+        }
+    }
+
+    //Come back when a rate-limited host has a token again
+    if (untilRefill >= 0 && !_refillScheduled)
+    {
+        _refillScheduled = true;
+        QTimer::singleShot((int) untilRefill, this, SLOT(refill()));
+    }
+}
+
+//private slot
+void MapGraphicsNetwork::refill()
+{
+    QMutexLocker lock(&_mutex);
+    _refillScheduled = false;
+    lock.unlock();
+
+    this->pump();
+}
+
+//private slot
+void MapGraphicsNetwork::abortTicket(quint64 ticket)
+{
+    //It may have finished in the meantime
+    QNetworkReply * reply = _replies.key(ticket, 0);
+    if (reply == 0)
+        return;
+    _replies.remove(reply);
+
+    //Nobody wants the result, so don't let abort() lead to handleReplyFinished()
+    reply->disconnect(this);
+    reply->abort();
+    reply->deleteLater();
+
+    QMutexLocker lock(&_mutex);
+    HostState& host = this->hostState(reply->request().url().host());
+    host.stats.inFlight--;
+
+    //An aborted probe tells us nothing, so the next request gets to probe
+    host.probing = false;
+    this->schedulePump();
+}
+
+//private slot
+void MapGraphicsNetwork::retryDue()
+{
+    QMutexLocker lock(&_mutex);
+    const qint64 now = _clock.elapsed();
+    while (!_retrying.isEmpty() && _retrying.firstKey() <= now)
+    {
+        const quint64 ticket = _retrying.take(_retrying.firstKey());
+        QHash<quint64, PendingGet>::iterator get = _gets.find(ticket);
+        if (get == _gets.end())
+            continue;
+
+        //Back into the queue of its (maybe new) host. Queue time starts over.
+        get.value().queued.restart();
+        HostState& host = this->hostState(get.value().host);
+        host.queue.enqueue(ticket);
+        host.stats.queued++;
+    }
+
+    this->startRetryTimer();
+    this->schedulePump();
+}
+
+//private slot
+void MapGraphicsNetwork::handleReplyTimeout()
+{
+    QTimer * timer = qobject_cast<QTimer *>(QObject::sender());
+    if (timer == 0)
+        return;
+
+    //The timer belongs to the reply it's timing
+    QNetworkReply * reply = qobject_cast<QNetworkReply *>(timer->parent());
+    if (reply == 0 || !_replies.contains(reply))
+        return;
+
+    //abort() finishes the reply, which takes us to handleReplyFinished()
+    reply->setProperty("timedOut", true);
+    reply->abort();
+}
+
+//private slot
+void MapGraphicsNetwork::handleHedgeTimeout()
+{
+    QTimer * timer = qobject_cast<QTimer *>(QObject::sender());
+    if (timer == 0)
+        return;
+
+    //The timer belongs to the reply that is taking long
+    QNetworkReply * reply = qobject_cast<QNetworkReply *>(timer->parent());
+    if (reply == 0 || !_replies.contains(reply))
+        return;
+    const quint64 ticket = _replies.value(reply);
+
+    QMutexLocker lock(&_mutex);
+    QHash<quint64, PendingGet>::iterator it = _gets.find(ticket);
+    if (it == _gets.end() || it.value().partner != 0)
+        return;
+    const QString primaryHost = it.value().host;
+    const QStringList mirrors = it.value().mirrors;
+
+    //Another mirror...
+    QString target;
+    for (int i = 0; i < mirrors.size(); i++)
+    {
+        target = this->nextMirror(mirrors);
+        if (target != primaryHost)
+            break;
+    }
+    if (target.isEmpty() || target == primaryHost)
+        return;
+
+    //...that can take the request right away. Otherwise the hedge would only add to the load.
+    QHash<QString, HostState>::const_iterator found = _hosts.constFind(target);
+    if (found != _hosts.constEnd())
+    {
+        const HostState& state = found.value();
+        const int maxInFlight = (state.maxInFlight < 0) ? _defaultMaxInFlight : state.maxInFlight;
+        if (this->isOpen(state) || !state.queue.isEmpty() || state.stats.inFlight >= maxInFlight)
+            return;
+    }
+
+    PendingGet hedge = it.value();
+    QUrl url = hedge.request.url();
+    url.setHost(target);
+    hedge.request.setUrl(url);
+    hedge.host = target;
+    hedge.mirrors.clear();
+    hedge.queued.start();
+    hedge.queueMsecs = 0;
+    hedge.attempts = 0;
+    hedge.sent = false;
+    hedge.partner = ticket;
+    hedge.isHedge = true;
+    hedge.awaitingHedge = false;
+
+    const quint64 hedgeTicket = _nextTicket++;
+    it.value().partner = hedgeTicket;
+    _gets.insert(hedgeTicket, hedge);
+
+    //It goes through the host's queue, so the host's limits apply
+    HostState& host = this->hostState(target);
+    host.queue.enqueue(hedgeTicket);
+    host.stats.queued++;
+    this->schedulePump();
+}
+
+//private slot
+void MapGraphicsNetwork::handleReplyFinished()
+{
+    QNetworkReply * reply = qobject_cast<QNetworkReply *>(QObject::sender());
+    if (reply == 0)
+    {
+        qWarning() << "QNetworkReply cast failure";
+        return;
+    }
+    reply->deleteLater();
+
+    if (!_replies.contains(reply))
+        return;
+    const quint64 ticket = _replies.take(reply);
+
+    NetworkResponse response;
+    const bool timedOut = reply->property("timedOut").toBool();
+    if (timedOut)
+    {
+        response.error = QNetworkReply::TimeoutError;
+        response.errorString = "Request timed out";
+    }
+    else
+    {
+        response.error = reply->error();
+        response.errorString = reply->errorString();
+    }
+    response.httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    response.body = reply->readAll();
+    response.headers = reply->rawHeaderPairs();
+    response.host = reply->request().url().host();
+
+    const bool failed = isTransientFailure(response);
+
+    QMutexLocker lock(&_mutex);
+    HostState& host = this->hostState(response.host);
+    host.stats.inFlight--;
+    host.stats.finished++;
+    if (timedOut)
+        host.stats.timeouts++;
+    this->recordOutcome(host, failed);
+    this->schedulePump();
+
+    //Cancelled after the reply was done, but before we got to it
+    QHash<quint64, PendingGet>::iterator it = _gets.find(ticket);
+    if (it == _gets.end())
+        return;
+
+    //Answers are what hedging is timed by
+    if (!failed)
+    {
+        LatencyWindow& window = _latencies[it.value().group];
+        const qint64 latency = it.value().queued.elapsed();
+        if (window.samples.size() < HEDGE_LATENCY_WINDOW)
+            window.samples.append(latency);
+        else
+        {
+            window.samples[window.next] = latency;
+            window.next = (window.next + 1) % HEDGE_LATENCY_WINDOW;
+        }
+    }
+
+    /*
+      A hedge that fails is simply dropped. The request it hedged is still on it. Only a good answer wins:
+      a 404 from one mirror doesn't mean the request won't get the tile from another.
+    */
+    if (it.value().isHedge)
+    {
+        if (response.error == QNetworkReply::NoError || response.httpStatus == 304)
+        {
+            host.stats.hedgesWon++;
+            this->hedgeWon(ticket, response);
+        }
+        else
+            this->hedgeFailed(ticket, response);
+        return;
+    }
+
+    if (failed)
+    {
+        //Worth another try, maybe on another mirror
+        if (it.value().attempts <= _maxRetries)
+        {
+            host.stats.retries++;
+            this->scheduleRetry(ticket, it.value(), retryAfterMsecs(response));
+            return;
+        }
+
+        //Out of tries, but the hedge may still come through
+        if (it.value().partner != 0)
+        {
+            it.value().sent = false;
+            it.value().awaitingHedge = true;
+            return;
+        }
+        host.stats.failures++;
+    }
+
+    //We were first, so our hedge isn't needed anymore
+    const quint64 partner = it.value().partner;
+    this->finish(ticket, response);
+    if (partner != 0)
+        this->withdraw(partner);
+}
+
+//private static
+void MapGraphicsNetwork::shutdown()
+{
+    QMutexLocker lock(&_instanceMutex);
+    delete MapGraphicsNetwork::_instance;
+    MapGraphicsNetwork::_instance = 0;
+}
+
+//private
+MapGraphicsNetwork::HostState &MapGraphicsNetwork::hostState(const QString &host)
+{
+    return _hosts[host];
+}
+
+//private
+void MapGraphicsNetwork::schedulePump()
+{
+    if (_pumpScheduled)
+        return;
+    _pumpScheduled = true;
+    QMetaObject::invokeMethod(this, "pump", Qt::QueuedConnection);
+}
+
+//private
+void MapGraphicsNetwork::withdraw(quint64 ticket)
+{
+    QHash<quint64, PendingGet>::iterator it = _gets.find(ticket);
+    if (it == _gets.end())
+        return;
+    const PendingGet get = it.value();
+    _gets.erase(it);
+    this->stop(ticket, get);
+
+    if (get.partner == 0)
+        return;
+
+    //A request takes its hedge along. A hedge leaves its request alone.
+    if (get.isHedge)
+    {
+        QHash<quint64, PendingGet>::iterator primary = _gets.find(get.partner);
+        if (primary != _gets.end())
+            primary.value().partner = 0;
+    }
+    else
+        this->withdraw(get.partner);
+}
+
+//private
+void MapGraphicsNetwork::stop(quint64 ticket, const MapGraphicsNetwork::PendingGet &get)
+{
+    //Not sent yet, so it just leaves the queue (or stops waiting for its retry)
+    if (!get.sent)
+    {
+        HostState& state = this->hostState(get.host);
+        if (state.queue.removeOne(ticket))
+            state.stats.queued--;
+        else
+        {
+            QMultiMap<qint64, quint64>::iterator retry;
+            for (retry = _retrying.begin(); retry != _retrying.end(); ++retry)
+            {
+                if (retry.value() != ticket)
+                    continue;
+                _retrying.erase(retry);
+                break;
+            }
+        }
+        return;
+    }
+
+    //The reply lives on the network thread
+    QMetaObject::invokeMethod(this, "abortTicket", Qt::QueuedConnection, Q_ARG(quint64, ticket));
+}
+
+//private
+void MapGraphicsNetwork::send(quint64 ticket, MapGraphicsNetwork::PendingGet &get)
+{
+    get.sent = true;
+    get.attempts++;
+    get.queueMsecs = get.queued.restart();
+
+    QNetworkReply * reply = _manager->get(get.request);
+    _replies.insert(reply, ticket);
+    connect(reply,
+            SIGNAL(finished()),
+            this,
+            SLOT(handleReplyFinished()));
+
+    //The timer dies with the reply
+    QTimer * timer = new QTimer(reply);
+    timer->setSingleShot(true);
+    connect(timer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(handleReplyTimeout()));
+    timer->start(_timeout);
+
+    //Ask another mirror too if this one takes unusually long
+    if (!get.isHedge && get.partner == 0 && get.mirrors.size() > 1)
+    {
+        const qint64 delay = this->hedgeDelay(get.group);
+        if (delay >= 0)
+        {
+            QTimer * hedgeTimer = new QTimer(reply);
+            hedgeTimer->setSingleShot(true);
+            connect(hedgeTimer,
+                    SIGNAL(timeout()),
+                    this,
+                    SLOT(handleHedgeTimeout()));
+            hedgeTimer->start((int) delay);
+        }
+    }
+}
+
+//private
+void MapGraphicsNetwork::hedgeFailed(quint64 hedgeTicket, NetworkResponse &response)
+{
+    QHash<quint64, PendingGet>::iterator it = _gets.find(hedgeTicket);
+    if (it == _gets.end())
+        return;
+    const quint64 primary = it.value().partner;
+    _gets.erase(it);
+
+    QHash<quint64, PendingGet>::iterator primaryIt = _gets.find(primary);
+    if (primaryIt == _gets.end())
+        return;
+    primaryIt.value().partner = 0;
+
+    //The request gave up before and was counting on us
+    if (primaryIt.value().awaitingHedge)
+        this->finish(primary, response);
+}
+
+//private
+void MapGraphicsNetwork::hedgeWon(quint64 hedgeTicket, NetworkResponse &response)
+{
+    QHash<quint64, PendingGet>::iterator it = _gets.find(hedgeTicket);
+    if (it == _gets.end())
+        return;
+    const quint64 primary = it.value().partner;
+    _gets.erase(it);
+
+    QHash<quint64, PendingGet>::iterator primaryIt = _gets.find(primary);
+    if (primaryIt == _gets.end())
+        return;
+
+    //The request lost the race. Its receiver gets our answer instead.
+    const PendingGet get = primaryIt.value();
+    this->stop(primary, get);
+    this->finish(primary, response);
+}
+
+//private
+qint64 MapGraphicsNetwork::hedgeDelay(const QString &group) const
+{
+    if (_hedgePercentile <= 0.0)
+        return -1;
+
+    QHash<QString, LatencyWindow>::const_iterator found = _latencies.constFind(group);
+    if (found == _latencies.constEnd() || found.value().samples.size() < MIN_HEDGE_SAMPLES)
+        return -1;
+
+    QVector<qint64> samples = found.value().samples;
+    const int index = (int) (_hedgePercentile * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return qMax(MIN_HEDGE_DELAY_MSECS, samples.at(index));
+}
+
+//private
+void MapGraphicsNetwork::finish(quint64 ticket, NetworkResponse &response)
+{
+    QHash<quint64, PendingGet>::iterator it = _gets.find(ticket);
+    if (it == _gets.end())
+        return;
+    const PendingGet get = it.value();
+    _gets.erase(it);
+
+    if (get.sent)
+    {
+        response.queueMsecs = get.queueMsecs;
+        response.elapsedMsecs = get.queued.elapsed();
+    }
+    else
+        response.queueMsecs = get.queued.elapsed();
+    response.attempts = get.attempts;
+
+    //Delivered with _mutex held, so a cancel() that has returned can't be overtaken
+    QMetaObject::invokeMethod(get.receiver,
+                              get.member.constData(),
+                              Qt::QueuedConnection,
+                              Q_ARG(quint64, ticket),
+                              Q_ARG(NetworkResponse, response));
+}
+
+//private
+void MapGraphicsNetwork::scheduleRetry(quint64 ticket, MapGraphicsNetwork::PendingGet &get, qint64 notBefore)
+{
+    //Exponential backoff with "equal jitter", so retries of requests that failed together spread out
+    const int exponent = qMin(get.attempts - 1, 16);
+    const qint64 ceiling = qMin(MAX_RETRY_DELAY_MSECS, (qint64) _retryBaseDelay << exponent);
+#if QT_VERSION >= QT_VERSION_CHECK(5,10,0)
+    const qint64 jitter = QRandomGenerator::global()->bounded(ceiling / 2 + 1);
+#else
+    const qint64 jitter = qrand() % (ceiling / 2 + 1);
+#endif
+    const qint64 delay = qMax(ceiling / 2 + jitter, notBefore);
+
+    //Another mirror may well be doing better
+    get.sent = false;
+    if (!get.mirrors.isEmpty())
+    {
+        QUrl url = get.request.url();
+        url.setHost(this->nextMirror(get.mirrors));
+        get.request.setUrl(url);
+        get.host = url.host();
+    }
+
+    _retrying.insert(_clock.elapsed() + delay, ticket);
+    this->startRetryTimer();
+}
+
+//private
+void MapGraphicsNetwork::startRetryTimer()
+{
+    if (_retrying.isEmpty())
+    {
+        _retryTimer->stop();
+        return;
+    }
+    _retryTimer->start((int) qMax<qint64>(0, _retrying.firstKey() - _clock.elapsed()));
+}
+
+//private
+void MapGraphicsNetwork::recordOutcome(MapGraphicsNetwork::HostState &host, bool failed)
+{
+    //Any answer that isn't a failure means the host is fine
+    if (!failed)
+    {
+        host.consecutiveFailures = 0;
+        host.openUntil = -1;
+        host.probing = false;
+        return;
+    }
+
+    host.consecutiveFailures++;
+    const bool probeFailed = host.probing;
+    host.probing = false;
+
+    //Stragglers that fail while the breaker is open don't keep it open longer
+    if (this->isOpen(host))
+        return;
+
+    if (probeFailed || (_failureThreshold > 0 && host.consecutiveFailures >= _failureThreshold))
+    {
+        host.openUntil = _clock.elapsed() + _circuitCooldown;
+        host.stats.circuitOpens++;
+    }
+}
+
+//private
+QString MapGraphicsNetwork::nextMirror(const QStringList &mirrors)
+{
+    //Each group of mirrors takes turns on its own
+    int& next = _nextMirror[mirrors.join(",")];
+
+    QString fallback;
+    for (int i = 0; i < mirrors.size(); i++)
+    {
+        const QString candidate = mirrors.at(next % mirrors.size());
+        next = (next + 1) % mirrors.size();
+
+        QHash<QString, HostState>::const_iterator found = _hosts.constFind(candidate);
+        if (found == _hosts.constEnd() || !this->isOpen(found.value()))
+            return candidate;
+        if (fallback.isEmpty())
+            fallback = candidate;
+    }
+
+    //They're all down. The request will fail right away, which is what we want.
+    return fallback;
+}
+
+//private
+bool MapGraphicsNetwork::isOpen(const MapGraphicsNetwork::HostState &host) const
 {
-    _manager = new QNetworkAccessManager();
-    this->setUserAgent(DEFAULT_USER_AGENT);
+    return host.openUntil >= 0 && _clock.elapsed() < host.openUntil;
 }
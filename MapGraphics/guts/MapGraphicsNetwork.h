@@ -1,33 +1,300 @@
 ﻿#ifndef MAPGRAPHICSNETWORK_H
 #define MAPGRAPHICSNETWORK_H
 
+#include <QObject>
 #include <QMutex>
 #include <QNetworkAccessManager>
+#include <QNetworkRequest>
 #include <QHash>
+#include <QQueue>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QMultiMap>
+#include <QVector>
 
 #include "MapGraphics_global.h"
+#include "NetworkResponse.h"
 
-class MAPGRAPHICSSHARED_EXPORT MapGraphicsNetwork
+class QThread;
+class QNetworkReply;
+class QTimer;
+
+/*!
+ \brief The network service shared by all tile sources. A single thread with a single
+ QNetworkAccessManager does every download, so connections to a host are pooled (and multiplexed over
+ HTTP/2 where the server and Qt support it) no matter how many sources or threads use the host.
+
+ Requests are queued per host. A host gets at most maxInFlight() requests at once and, if it has a rate
+ limit, no more requests per second than that (a token bucket, so short bursts are allowed). The others
+ wait in the host's queue in the order they came in. How long they wait is in hostStats().
+
+ Requests can be spread over equivalent mirrors of a server (e.g. the a/b/c subdomains of a tile
+ server): queueGet() sends each request to the next mirror in turn.
+
+ Every request that has been sent is aborted after timeout() msecs. Requests that fail in a way that may
+ go away (timeouts, connection errors, HTTP 5xx, 408 and 429) are retried up to maxRetries() times after a
+ jittered, exponentially growing delay, on the next mirror if there are any. A host that fails
+ failureThreshold() times in a row gets its circuit breaker opened: for circuitCooldown() msecs its
+ requests fail right away (mirrors that are open are skipped), then a single request finds out whether
+ it's back. Whatever happens, the receiver of a request is told exactly once unless it cancels.
+
+ Requests with several mirrors can be hedged: if one hasn't been answered within the hedgePercentile() of
+ the mirrors' recent latencies, a duplicate goes to another mirror. The first good answer wins and the
+ other request is aborted. Hedges wait in their host's queue like any other request, but one isn't sent
+ at all if its host is busy.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsNetwork : public QObject
 {
+    Q_OBJECT
+public:
+    struct HostStats
+    {
+        int inFlight;
+        int queued;
+        quint64 started;
+        quint64 finished;
+
+        //Time requests spent in the host's queue before they were sent, in msecs
+        qint64 totalQueueMsecs;
+        qint64 maxQueueMsecs;
+
+        quint64 retries;
+        quint64 timeouts;
+
+        //Requests that failed for good, retries included, and how often the circuit breaker opened
+        quint64 failures;
+        quint64 circuitOpens;
+        bool circuitOpen;
+
+        //Hedges sent to this host, and how many of them answered before the request they hedged
+        quint64 hedgesSent;
+        quint64 hedgesWon;
+    };
+
 public:
     static MapGraphicsNetwork * getInstance();
 
     ~MapGraphicsNetwork();
 
-    QNetworkReply * get(QNetworkRequest& request);
+    /*!
+     \brief Queues a GET. When it's done, member of receiver is invoked (queued) with the arguments
+     (quint64 ticket, NetworkResponse response). If mirrors isn't empty, the host of the request's URL is
+     replaced by the next one of mirrors. Returns the ticket, which is never 0. Safe to call from any thread.
+    */
+    quint64 queueGet(const QNetworkRequest& request,
+                     QObject * receiver,
+                     const char * member,
+                     const QStringList& mirrors = QStringList());
+
+    /*!
+     \brief Withdraws a request. If it has been sent already, it's aborted. Once this returns, its receiver
+     won't be invoked for it anymore unless the invocation was already queued.
+    */
+    void cancel(quint64 ticket);
+
+    //Withdraws every request of receiver. Call it before receiver is destroyed.
+    void cancelAll(QObject * receiver);
 
     void setUserAgent(const QByteArray& agent);
     QByteArray userAgent() const;
 
+    //How many requests may be in flight to a host at once. Hosts that weren't configured get the default.
+    int maxInFlight(const QString& host) const;
+    void setMaxInFlight(const QString& host, int requests);
+    int defaultMaxInFlight() const;
+    void setDefaultMaxInFlight(int requests);
+
+    /*!
+     \brief Limits how many requests per second are sent to a host, allowing bursts of up to burst
+     requests. A rate of 0 means no limit, which is the default.
+    */
+    qreal rateLimit(const QString& host) const;
+    void setRateLimit(const QString& host, qreal requestsPerSecond, int burst = 1);
+
+    bool isHttp2Enabled() const;
+    void setHttp2Enabled(bool enabled);
+
+    //How long a request that has been sent may take before it's aborted (and maybe retried), in msecs
+    int timeout() const;
+    void setTimeout(int msecs);
+
+    /*!
+     \brief How often a request that failed transiently is tried again, and the delay before the first retry
+     in msecs. Each further retry waits about twice as long, with some random jitter.
+    */
+    int maxRetries() const;
+    void setMaxRetries(int retries);
+    int retryBaseDelay() const;
+    void setRetryBaseDelay(int msecs);
+
+    /*!
+     \brief How many failures in a row open the circuit breaker of a host and how long it stays open, in
+     msecs. A threshold of 0 disables the breaker.
+    */
+    int failureThreshold() const;
+    int circuitCooldown() const;
+    void setCircuitBreaker(int failureThreshold, int cooldownMsecs);
+    bool isCircuitOpen(const QString& host) const;
+
+    /*!
+     \brief The percentile (e.g. 0.95) of recent latencies after which a request with mirrors is hedged.
+     0 disables hedging, which is the default.
+    */
+    qreal hedgePercentile() const;
+    void setHedgePercentile(qreal percentile);
+
+    //The hosts that have been used so far, and how they're doing
+    QStringList hosts() const;
+    MapGraphicsNetwork::HostStats hostStats(const QString& host) const;
+
 protected:
     MapGraphicsNetwork();
 
+private slots:
+    void initialize();
+    void destroyManager();
+    void pump();
+    void refill();
+    void abortTicket(quint64 ticket);
+    void retryDue();
+    void handleReplyTimeout();
+    void handleHedgeTimeout();
+    void handleReplyFinished();
+
 private:
-    static QHash<QThread *, MapGraphicsNetwork *> _instances;
-    static QMutex _mutex;
+    static void shutdown();
+
+    struct PendingGet
+    {
+        QNetworkRequest request;
+        QString host;
+        QObject * receiver;
+        QByteArray member;
+        QStringList mirrors;
+        QElapsedTimer queued;
+        qint64 queueMsecs;
+        int attempts;
+        bool sent;
+
+        //Where latencies are sampled: the mirrors joined, or the host if there are none
+        QString group;
+
+        /*
+          A hedge and the request it hedges know each other as partners (0 if none). The request's receiver
+          is told, under the request's ticket, of whichever answers first. A request that has failed for good
+          while its hedge is still out waits for the hedge.
+        */
+        quint64 partner;
+        bool isHedge;
+        bool awaitingHedge;
+    };
+
+    //The most recent latencies of a group of mirrors, in msecs
+    struct LatencyWindow
+    {
+        LatencyWindow();
+
+        QVector<qint64> samples;
+        int next;
+    };
+
+    struct HostState
+    {
+        HostState();
+
+        int maxInFlight;
+        qreal rate;
+        qreal burst;
+        qreal tokens;
+        QElapsedTimer sinceRefill;
+
+        //Circuit breaker. openUntil is on _clock, -1 while closed. Probing while a half-open host is tried.
+        int consecutiveFailures;
+        qint64 openUntil;
+        bool probing;
+
+        QQueue<quint64> queue;
+        MapGraphicsNetwork::HostStats stats;
+    };
+
+    //Call with _mutex held
+    HostState& hostState(const QString& host);
+
+    //Call with _mutex held. Sees that pump() runs soon on the network thread.
+    void schedulePump();
+
+    //Call with _mutex held. Takes the request (and its partner) out of its host's queue or aborts it.
+    void withdraw(quint64 ticket);
+
+    //Call with _mutex held. Stops a request that has been forgotten already, wherever it is.
+    void stop(quint64 ticket, const PendingGet& get);
+
+    //Call with _mutex held. The hedge is dropped. If its request was waiting for it, that fails now.
+    void hedgeFailed(quint64 hedgeTicket, NetworkResponse& response);
+
+    //Call with _mutex held. The hedge answered first, so it answers for its request.
+    void hedgeWon(quint64 hedgeTicket, NetworkResponse& response);
+
+    //Call with _mutex held. How long requests of the group may take before they're hedged, or -1.
+    qint64 hedgeDelay(const QString& group) const;
+
+    //Call on the network thread with _mutex held. Sends the request with the given ticket.
+    void send(quint64 ticket, PendingGet& get);
+
+    //Call with _mutex held. Hands the response to the request's receiver and forgets the request.
+    void finish(quint64 ticket, NetworkResponse& response);
+
+    //Call on the network thread with _mutex held. Queues the request again after a backoff delay.
+    void scheduleRetry(quint64 ticket, PendingGet& get, qint64 notBefore);
+
+    //Call on the network thread with _mutex held
+    void startRetryTimer();
+
+    //Call with _mutex held. Feeds the outcome of a request to the host's circuit breaker.
+    void recordOutcome(HostState& host, bool failed);
+
+    //Call with _mutex held. The next of mirrors whose circuit breaker isn't open, if any.
+    QString nextMirror(const QStringList& mirrors);
+
+    bool isOpen(const HostState& host) const;
+
+    static MapGraphicsNetwork * _instance;
+    static QMutex _instanceMutex;
+
+    mutable QMutex _mutex;
+    QThread * _thread;
     QNetworkAccessManager * _manager;
 
     QByteArray _userAgent;
+    int _defaultMaxInFlight;
+    bool _http2Enabled;
+    int _timeout;
+    int _maxRetries;
+    int _retryBaseDelay;
+    int _failureThreshold;
+    int _circuitCooldown;
+    qreal _hedgePercentile;
+    QHash<QString, LatencyWindow> _latencies;
+
+    //Monotonic clock for backoff and circuit breaker deadlines
+    QElapsedTimer _clock;
+
+    quint64 _nextTicket;
+    QHash<quint64, PendingGet> _gets;
+    QHash<QString, HostState> _hosts;
+
+    //Where each group of mirrors continues
+    QHash<QString, int> _nextMirror;
+
+    bool _pumpScheduled;
+    bool _refillScheduled;
+
+    //Requests waiting out their backoff, by when they may go again (on _clock)
+    QMultiMap<qint64, quint64> _retrying;
+
+    //Only touched on the network thread
+    QHash<QNetworkReply *, quint64> _replies;
+    QTimer * _retryTimer;
 };
 
 #endif // MAPGRAPHICSNETWORK_H
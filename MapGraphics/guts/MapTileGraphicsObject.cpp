@@ -1,8 +1,16 @@
 #include "MapTileGraphicsObject.h"
 
 #include <QPainter>
+#include <QTimer>
 #include <QtDebug>
 
+//How many zoom levels up we look for a tile to stand in for one that's loading
+const int MAX_FALLBACK_ANCESTOR_LEVELS = 4;
+
+//How long we wait before asking again for a tile that failed, doubled for every failure in a row
+const int FAILED_TILE_RETRY_MSECS = 5000;
+const int MAX_FAILED_TILE_RETRY_DOUBLINGS = 4;
+
 MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
 {
     this->setTileSize(tileSize);
@@ -12,6 +20,9 @@ MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
     _tileZoom = 0;
     _initialized = false;
     _havePendingRequest = false;
+    _failed = false;
+    _failures = 0;
+    _pixmapCache = 0;
 
     //Default z-value is important --- used in MapGraphicsView
     this->setZValue(-1.0);
@@ -19,6 +30,8 @@ MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
 
 MapTileGraphicsObject::~MapTileGraphicsObject()
 {
+    this->cancelRequest();
+
     if (_tile != 0)
     {
         delete _tile;
@@ -40,15 +53,17 @@ void MapTileGraphicsObject::paint(QPainter *painter, const QStyleOptionGraphicsI
     Q_UNUSED(option)
     Q_UNUSED(widget)
 
-    //If we've got a tile, draw it. Otherwise, show a loading or "No tile source" message
+    //If we've got a tile, draw it. Otherwise, show what we have of it or a loading or "No tile source" message
     if (_tile != 0)
         painter->drawPixmap(this->boundingRect().toRect(),
                             *_tile);
-    else
+    else if (!this->paintFallback(painter))
     {
         QString string;
         if (_tileSource.isNull())
             string = " No tile source defined";
+        else if (_failed)
+            string = " Tile unavailable";
         else
             string = " Loading...";
         painter->drawText(this->boundingRect(),
@@ -71,10 +86,18 @@ void MapTileGraphicsObject::setTileSize(quint16 tileSize)
 
 void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
 {
-    //Don't re-request the same tile we're already displaying unless force=true or _initialized=false
-    if (_tileX == x && _tileY == y && _tileZoom == z && !force && _initialized)
+    //Don't re-request the same tile we're already displaying (or waiting for) unless force=true or _initialized=false
+    if (_tileX == x && _tileY == y && _tileZoom == z && !force && _initialized
+            && (_tile != 0 || _havePendingRequest))
         return;
 
+    /*
+      We're being recycled for a different tile, so the one we were waiting for isn't needed anymore.
+      A forced refresh comes from an invalidation, which has already dropped the old request.
+    */
+    if (!force)
+        this->cancelRequest();
+
     //Get rid of the old tile
     if (_tile != 0)
     {
@@ -82,6 +105,11 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
         _tile = 0;
     }
 
+    //A different tile gets a clean slate
+    if (_tileX != x || _tileY != y || _tileZoom != z)
+        _failures = 0;
+    _failed = false;
+
     //Store information for the tile we're requesting
     _tileX = x;
     _tileY = y;
@@ -92,18 +120,29 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
     if (_tileSource.isNull())
         return;
 
-    //If our tile source is good, connect to the signal we'll need to get the result after requesting
-    connect(_tileSource.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-            this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
-
     //Make sure we know that we're requesting a tile
     _havePendingRequest = true;
 
-    //Request the tile from tileSource, which will emit tileRetrieved when finished
+    //Request the tile from tileSource, which will hand it to handleTileRetrieved when finished
     //qDebug() << this << "requests" << x << y << z;
-    _tileSource->requestTile(x,y,z);
+    _tileSource->requestTile(x,y,z,this,"handleTileRetrieved");
+}
+
+void MapTileGraphicsObject::cancelRequest()
+{
+    if (!_havePendingRequest)
+        return;
+    _havePendingRequest = false;
+
+    if (_tileSource.isNull())
+        return;
+
+    _tileSource->cancelTile(_tileX,_tileY,_tileZoom,this);
+}
+
+void MapTileGraphicsObject::setPixmapCache(TilePixmapCache *cache)
+{
+    _pixmapCache = cache;
 }
 
 QSharedPointer<MapTileSource> MapTileGraphicsObject::tileSource() const
@@ -113,13 +152,12 @@ QSharedPointer<MapTileSource> MapTileGraphicsObject::tileSource() const
 
 void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
 {
+    //The old source can stop working on our tile
+    this->cancelRequest();
+
     //Disconnect from the old source, if applicable
     if (!_tileSource.isNull())
     {
-        QObject::disconnect(_tileSource.data(),
-                            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-                            this,
-                            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
         QObject::disconnect(_tileSource.data(),
                             SIGNAL(allTilesInvalidated()),
                             this,
@@ -137,7 +175,6 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
                 SIGNAL(allTilesInvalidated()),
                 this,
                 SLOT(handleTileInvalidation()));
-        //We connect/disconnect the "tileRetrieved" signal as needed and don't do it here!
     }
 
     //Force a refresh from the new source
@@ -145,41 +182,41 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
 }
 
 //private slot
-void MapTileGraphicsObject::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+void MapTileGraphicsObject::handleTileRetrieved(TileKey key, TileImage image)
 {
     //If we don't care about retrieved tiles (i.e., we haven't requested a tile), return
-    //This shouldn't actually happen as the signal/slot should get disconnected
+    //This can happen if the tile was already on its way when we cancelled the request
     if (!_havePendingRequest)
         return;
 
-    //If this isn't the tile we're looking for, return
-    else if (_tileX != x || _tileY != y || _tileZoom != z)
+    //If this isn't the tile we're looking for (anymore), return
+    else if (_tileX != key.x() || _tileY != key.y() || _tileZoom != key.z())
         return;
 
-    //Now we know that our tile has been retrieved by the MapTileSource. We just need to get it.
+    //Now we know that our tile has been retrieved by the MapTileSource
     _havePendingRequest = false;
 
     //Make sure some mischevious person hasn't set our MapTileSource to null while we weren't looking...
     if (_tileSource.isNull())
         return;
 
-    QImage * image = _tileSource->getFinishedTile(x,y,z);
-
-    //Make sure someone didn't snake us to grabbing our tile
-    if (image == 0)
+    //The source gave up on our tile. Show what we have of it and ask again later.
+    if (image.isNull())
     {
-        qWarning() << "Failed to get tile" << x << y << z << "from MapTileSource";
+        _failed = true;
+        _failures++;
+        this->update();
+
+        const int doublings = qMin(_failures - 1, MAX_FAILED_TILE_RETRY_DOUBLINGS);
+        QTimer::singleShot(FAILED_TILE_RETRY_MSECS << doublings, this, SLOT(retryFailedTile()));
         return;
     }
+    _failures = 0;
 
     //Convert the QImage to a QPixmap
     //We have to do this here since we can't use QPixmaps in non-GUI threads (i.e., MapTileSource)
-    QPixmap * tile = new QPixmap();
-    *tile = QPixmap::fromImage(*image);
-
-    //Delete the QImage
-    delete image;
-    image = 0;
+    //Sources hand out RGB32 or ARGB32_Premultiplied tiles, so this is just a copy of the pixels
+    QPixmap * tile = new QPixmap(QPixmap::fromImage(*image));
 
     //Make sure that the old tile has been disposed of. If it hasn't, do it
     //In reality, it should have been, so display a warning
@@ -194,12 +231,75 @@ void MapTileGraphicsObject::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
     _tile = tile;
     this->update();
 
-    //Disconnect our signal/slot connection with MapTileSource until we need to do another request
-    //It remains to be seen if it's better to continually connect/reconnect or just to filter events
-    QObject::disconnect(_tileSource.data(),
-                        SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-                        this,
-                        SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    //Let other tile objects use it while their own tiles load
+    if (_pixmapCache != 0)
+        _pixmapCache->insert(key,
+                             new QPixmap(*tile),
+                             tile->width() * tile->height() * tile->depth() / 8);
+}
+
+//private
+bool MapTileGraphicsObject::paintFallback(QPainter *painter)
+{
+    if (_pixmapCache == 0 || _tileSource.isNull() || !_initialized)
+        return false;
+
+    const QRectF target = this->boundingRect();
+
+    //If we're being refreshed (e.g. after an invalidation), the old version of our tile is the best we can do
+    const QPixmap * exact = _pixmapCache->object(TileKey(_tileX,_tileY,_tileZoom));
+    if (exact != 0)
+    {
+        painter->drawPixmap(target, *exact, exact->rect());
+        return true;
+    }
+
+    bool painted = false;
+
+    //Blow up our part of the nearest ancestor we have
+    for (int levels = 1; levels <= MAX_FALLBACK_ANCESTOR_LEVELS && levels <= _tileZoom; levels++)
+    {
+        const QPixmap * ancestor = _pixmapCache->object(TileKey(_tileX >> levels,
+                                                                _tileY >> levels,
+                                                                _tileZoom - levels));
+        if (ancestor == 0)
+            continue;
+
+        const quint32 span = 1 << levels;
+        const qreal width = ancestor->width() / (qreal) span;
+        const qreal height = ancestor->height() / (qreal) span;
+        const QRectF source((_tileX % span) * width,
+                            (_tileY % span) * height,
+                            width,
+                            height);
+        painter->drawPixmap(target, *ancestor, source);
+        painted = true;
+        break;
+    }
+
+    //Shrink whichever of our children we have on top of that (e.g. right after zooming out)
+    if (_tileZoom < TileKey::MAX_ZOOM)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            const quint32 dx = i % 2;
+            const quint32 dy = i / 2;
+            const QPixmap * child = _pixmapCache->object(TileKey(_tileX * 2 + dx,
+                                                                 _tileY * 2 + dy,
+                                                                 _tileZoom + 1));
+            if (child == 0)
+                continue;
+
+            const QRectF quadrant(target.x() + dx * target.width() / 2.0,
+                                  target.y() + dy * target.height() / 2.0,
+                                  target.width() / 2.0,
+                                  target.height() / 2.0);
+            painter->drawPixmap(quadrant, *child, child->rect());
+            painted = true;
+        }
+    }
+
+    return painted;
 }
 
 //private slot
@@ -212,3 +312,13 @@ void MapTileGraphicsObject::handleTileInvalidation()
     //Call setTile with force=true so that it forces a refresh
     this->setTile(_tileX,_tileY,_tileZoom,true);
 }
+
+//private slot
+void MapTileGraphicsObject::retryFailedTile()
+{
+    //We may have been given another tile, or a fresh request, in the meantime
+    if (!_failed || _havePendingRequest || _tileSource.isNull())
+        return;
+
+    this->setTile(_tileX,_tileY,_tileZoom,true);
+}
@@ -3,9 +3,14 @@
 
 #include <QGraphicsObject>
 #include <QPointer>
+#include <QPixmap>
+#include <QCache>
 
 #include "MapTileSource.h"
 
+//Tiles that have been converted for display, shared by all the tile objects of a view
+typedef QCache<TileKey, QPixmap> TilePixmapCache;
+
 class MapTileGraphicsObject : public QGraphicsObject
 {
     Q_OBJECT
@@ -22,13 +27,23 @@ public:
 
     void setTile(quint32 x, quint32 y, quint8 z, bool force = false);
 
+    //Withdraws the request for our tile, if it hasn't arrived yet. We show nothing until the next setTile().
+    void cancelRequest();
+
     QSharedPointer<MapTileSource> tileSource() const;
     void setTileSource(QSharedPointer<MapTileSource>);
 
+    /*
+      Tiles we receive are put into cache. While our own tile is loading, we draw what the cache has of it:
+      an older version of the tile, a scaled crop of its nearest ancestor and/or its children.
+    */
+    void setPixmapCache(TilePixmapCache * cache);
+
 
 private slots:
-    void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
+    void handleTileRetrieved(TileKey key, TileImage image);
     void handleTileInvalidation();
+    void retryFailedTile();
     
 signals:
     void tileRequested(quint32 x, quint32 y, quint8 z);
@@ -36,6 +51,9 @@ signals:
 public slots:
 
 private:
+    //Returns false if the cache has nothing to stand in for our tile
+    bool paintFallback(QPainter * painter);
+
     quint16 _tileSize;
     QPixmap * _tile;
     quint32 _tileX;
@@ -46,7 +64,13 @@ private:
 
     bool _havePendingRequest;
 
+    //Our tile couldn't be retrieved. We ask again later, waiting longer after each failure in a row.
+    bool _failed;
+    int _failures;
+
     QSharedPointer<MapTileSource> _tileSource;
+
+    TilePixmapCache * _pixmapCache;
     
 };
 
@@ -0,0 +1,17 @@
+#include "NetworkResponse.h"
+
+NetworkResponse::NetworkResponse() :
+    error(0), httpStatus(0), queueMsecs(0), elapsedMsecs(0), attempts(0), circuitOpen(false)
+{
+}
+
+QByteArray NetworkResponse::header(const QByteArray &name) const
+{
+    const QByteArray lower = name.toLower();
+    for (int i = 0; i < headers.size(); i++)
+    {
+        if (headers.at(i).first.toLower() == lower)
+            return headers.at(i).second;
+    }
+    return QByteArray();
+}
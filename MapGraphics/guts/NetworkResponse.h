@@ -0,0 +1,48 @@
+#ifndef NETWORKRESPONSE_H
+#define NETWORKRESPONSE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QList>
+#include <QPair>
+#include <QMetaType>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief The outcome of a request made through MapGraphicsNetwork::queueGet(). It's a plain value that is
+ handed to the receiver across threads, so users don't need QtNetwork (or a QNetworkReply) to read it.
+*/
+struct MAPGRAPHICSSHARED_EXPORT NetworkResponse
+{
+    NetworkResponse();
+
+    //QNetworkReply::NetworkError, so 0 (NoError) on success
+    int error;
+    QString errorString;
+
+    //The HTTP status code, or 0 if the server never answered
+    int httpStatus;
+
+    QByteArray body;
+    QList<QPair<QByteArray, QByteArray> > headers;
+
+    //The host that actually served the request (see the mirrors of MapGraphicsNetwork::queueGet())
+    QString host;
+
+    //How long the request waited for its host and how long the host took to answer, in msecs
+    qint64 queueMsecs;
+    qint64 elapsedMsecs;
+
+    //How many times the request was sent, retries included. 0 if it was refused without being sent.
+    int attempts;
+
+    //The request was refused without being sent because its host's circuit breaker is open
+    bool circuitOpen;
+
+    //Returns the value of a response header, ignoring case. Empty if the server didn't send it.
+    QByteArray header(const QByteArray& name) const;
+};
+Q_DECLARE_METATYPE(NetworkResponse)
+
+#endif // NETWORKRESPONSE_H
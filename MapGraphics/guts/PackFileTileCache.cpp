@@ -0,0 +1,768 @@
+#include "PackFileTileCache.h"
+
+#include <QStringBuilder>
+#include <QDir>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QStringList>
+#include <QRegExp>
+#include <QtAlgorithms>
+#include <QMutexLocker>
+#include <QFileInfo>
+#include <QtDebug>
+
+//Start a new pack once the current one gets this big
+const qint64 MAX_PACK_BYTES = 256 * 1024 * 1024;
+
+const quint32 PACK_RECORD_MAGIC = 0x4D47504B; //"MGPK"
+const int PACK_RECORD_HEADER_BYTES = 4 + 8 + 8 + 4;
+
+const quint32 INDEX_MAGIC = 0x4D474958; //"MGIX"
+const quint32 INDEX_VERSION = 2;
+
+//Version 1 indexes had no validators
+const quint32 INDEX_VERSION_WITHOUT_VALIDATORS = 1;
+
+//Index records with this pack number are tombstones for removed tiles
+const quint32 REMOVED_PACK = 0xFFFFFFFF;
+
+//When more than this fraction of the packs is garbage, the janitor compacts them
+const qreal MAX_GARBAGE_FRACTION = 0.5;
+
+//The index log is checkpointed when it has more than this many records and twice as many records as tiles
+const int MIN_CHECKPOINT_RECORDS = 4096;
+
+//A tile considered by the janitor for LRU eviction
+struct PackedTile
+{
+    TileKey key;
+    qint64 accessed;
+    quint32 pack;
+    quint64 offset;
+    qint64 bytes;
+};
+
+static bool lessRecentlyUsed(const PackedTile& a, const PackedTile& b)
+{
+    //Tiles that haven't been used since startup all have the same access time. Older writes go first.
+    if (a.accessed != b.accessed)
+        return a.accessed < b.accessed;
+    if (a.pack != b.pack)
+        return a.pack < b.pack;
+    return a.offset < b.offset;
+}
+
+PackFileTileCache::PackFileTileCache(const QString &directory) :
+    _directory(directory), _opened(false), _generation(0), _writePack(0), _indexRecords(0)
+{
+}
+
+PackFileTileCache::~PackFileTileCache()
+{
+    this->close();
+}
+
+//virtual from DiskTileCache
+void PackFileTileCache::open()
+{
+    this->ensureOpen();
+}
+
+//virtual from DiskTileCache
+bool PackFileTileCache::mightContain(const TileKey &key) const
+{
+    //While the index is being loaded we can't tell, and we don't want to wait for it
+    if (!_indexLock.tryLock())
+        return true;
+
+    const bool toRet = !_opened || _index.contains(key);
+    _indexLock.unlock();
+    return toRet;
+}
+
+//virtual from DiskTileCache
+bool PackFileTileCache::read(const TileKey &key, QByteArray *data, QDateTime *expireTime, QByteArray *validators)
+{
+    if (!this->ensureOpen())
+        return false;
+
+    QHash<TileKey, IndexEntry>::iterator it = _index.find(key);
+    if (it == _index.end())
+        return false;
+    const IndexEntry entry = it.value();
+    if (!this->readEntry(key, entry, data))
+        return false;
+
+    QMutexLocker lock(&_indexLock);
+    it.value().accessed = QDateTime::currentMSecsSinceEpoch();
+    lock.unlock();
+
+    *expireTime = QDateTime::fromMSecsSinceEpoch(entry.expires, Qt::UTC);
+    *validators = entry.validators;
+    return true;
+}
+
+//virtual from DiskTileCache
+bool PackFileTileCache::write(const TileKey &key,
+                              const QByteArray &data,
+                              const QDateTime &expireTime,
+                              const QByteArray &validators)
+{
+    if (!this->ensureOpen())
+        return false;
+
+    IndexEntry entry;
+    if (!this->appendToPack(key, data, expireTime.toMSecsSinceEpoch(), &entry))
+        return false;
+    entry.validators = validators;
+    entry.accessed = QDateTime::currentMSecsSinceEpoch();
+    this->adjustBytesUsed(PACK_RECORD_HEADER_BYTES + data.size());
+
+    QMutexLocker lock(&_indexLock);
+    _index.insert(key, entry);
+    lock.unlock();
+
+    return this->appendIndexRecord(key, entry);
+}
+
+//virtual from DiskTileCache
+bool PackFileTileCache::contains(const TileKey &key)
+{
+    if (!this->ensureOpen())
+        return false;
+    return _index.contains(key);
+}
+
+//virtual from DiskTileCache
+void PackFileTileCache::remove(const TileKey &key)
+{
+    if (!this->ensureOpen() || !_index.contains(key))
+        return;
+
+    //The bytes stay in the pack until the next compaction
+    QMutexLocker lock(&_indexLock);
+    _index.remove(key);
+    lock.unlock();
+
+    IndexEntry tombstone;
+    tombstone.pack = REMOVED_PACK;
+    tombstone.length = 0;
+    tombstone.offset = 0;
+    tombstone.expires = 0;
+    this->appendIndexRecord(key, tombstone);
+}
+
+//virtual from DiskTileCache
+QDateTime PackFileTileCache::expirationTime(const TileKey &key)
+{
+    if (!this->ensureOpen() || !_index.contains(key))
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(_index.value(key).expires, Qt::UTC);
+}
+
+//virtual from DiskTileCache
+void PackFileTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    if (!this->ensureOpen())
+        return;
+
+    QMutexLocker lock(&_indexLock);
+    QHash<TileKey, IndexEntry>::iterator it = _index.find(key);
+    if (it == _index.end())
+        return;
+
+    it.value().expires = expireTime.toMSecsSinceEpoch();
+    const IndexEntry entry = it.value();
+    lock.unlock();
+
+    this->appendIndexRecord(key, entry);
+}
+
+//virtual from DiskTileCache
+void PackFileTileCache::flush()
+{
+    //Tiles go out before the index records that point at them
+    foreach(QFile * pack, _packFiles)
+        pack->flush();
+    if (!_indexFile.isOpen())
+        return;
+
+    if (_indexRecords > MIN_CHECKPOINT_RECORDS && _indexRecords > 2 * _index.size())
+        this->checkpointIndex();
+    else
+        _indexFile.flush();
+}
+
+//virtual from DiskTileCache
+void PackFileTileCache::compact()
+{
+    if (!this->ensureOpen())
+        return;
+    this->flush();
+
+    const quint32 oldGeneration = _generation;
+    const quint32 newGeneration = _generation + 1;
+
+    //Copy the live tiles into the new generation sorted by key, which keeps neighbouring tiles together
+    QList<TileKey> keys = _index.keys();
+    qSort(keys);
+
+    QHash<TileKey, IndexEntry> newIndex;
+    newIndex.reserve(keys.size());
+    QFile * newPack = 0;
+    quint32 newPackNumber = 0;
+    bool ok = true;
+
+    foreach(const TileKey& key, keys)
+    {
+        //Not read(), which would make every tile look like it was just used
+        QByteArray data;
+        const IndexEntry oldEntry = _index.value(key);
+        if (!this->readEntry(key, oldEntry, &data))
+            continue;
+
+        if (newPack == 0 || newPack->size() + PACK_RECORD_HEADER_BYTES + data.size() > MAX_PACK_BYTES)
+        {
+            if (newPack != 0)
+            {
+                newPack->close();
+                delete newPack;
+                newPackNumber++;
+            }
+            newPack = new QFile(this->packPath(newGeneration, newPackNumber));
+            if (!newPack->open(QIODevice::WriteOnly | QIODevice::Truncate))
+            {
+                qWarning() << "Failed to create" << newPack->fileName() << "for compaction:" << newPack->errorString();
+                ok = false;
+                break;
+            }
+        }
+
+        IndexEntry entry;
+        entry.pack = newPackNumber;
+        entry.length = data.size();
+        entry.offset = newPack->pos() + PACK_RECORD_HEADER_BYTES;
+        entry.expires = oldEntry.expires;
+        entry.validators = oldEntry.validators;
+        entry.accessed = oldEntry.accessed;
+
+        QDataStream stream(newPack);
+        stream << PACK_RECORD_MAGIC << key.packed() << entry.expires << entry.length;
+        if (newPack->write(data) != data.size())
+        {
+            qWarning() << "Failed to write" << newPack->fileName() << "during compaction:" << newPack->errorString();
+            ok = false;
+            break;
+        }
+        newIndex.insert(key, entry);
+    }
+
+    if (newPack != 0)
+    {
+        newPack->close();
+        delete newPack;
+    }
+
+    //The new index is written last. Until it exists the old generation is still the current one.
+    if (ok)
+        ok = this->writeIndexSnapshot(this->indexPath(newGeneration), newIndex);
+
+    if (!ok)
+    {
+        for (quint32 i = 0; i <= newPackNumber; i++)
+            QFile::remove(this->packPath(newGeneration, i));
+        return;
+    }
+
+    //Switch over and throw away the old generation
+    this->close();
+    QDir dir(_directory);
+    const QStringList oldFiles = dir.entryList(QStringList() << QString("pack-%1-*.dat").arg(oldGeneration)
+                                               << QString("index-%1.log").arg(oldGeneration),
+                                               QDir::Files);
+    foreach(const QString& file, oldFiles)
+        dir.remove(file);
+
+    //Access times aren't in the index on disk, so carry them over by hand
+    if (this->ensureOpen())
+    {
+        QMutexLocker lock(&_indexLock);
+        QHash<TileKey, IndexEntry>::iterator it;
+        for (it = _index.begin(); it != _index.end(); ++it)
+            it.value().accessed = newIndex.value(it.key()).accessed;
+    }
+}
+
+//protected
+//virtual from DiskTileCache
+qint64 PackFileTileCache::trim(qint64 maxBytes, qint64 targetBytes, quint64 *expiredEvictions, quint64 *lruEvictions)
+{
+    if (!this->ensureOpen())
+        return 0;
+
+    //Tiles past retention go first. Everything else is a candidate for LRU eviction.
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<TileKey> expired;
+    QList<PackedTile> candidates;
+    candidates.reserve(_index.size());
+    qint64 live = 0;
+
+    QHash<TileKey, IndexEntry>::const_iterator it;
+    for (it = _index.constBegin(); it != _index.constEnd(); ++it)
+    {
+        const IndexEntry& entry = it.value();
+        if (isPastRetention(entry.expires, now))
+        {
+            expired.append(it.key());
+            continue;
+        }
+
+        PackedTile tile;
+        tile.key = it.key();
+        tile.accessed = entry.accessed;
+        tile.pack = entry.pack;
+        tile.offset = entry.offset;
+        tile.bytes = PACK_RECORD_HEADER_BYTES + entry.length;
+        candidates.append(tile);
+        live += tile.bytes;
+    }
+
+    foreach(const TileKey& key, expired)
+    {
+        this->remove(key);
+        (*expiredEvictions)++;
+    }
+
+    if (maxBytes >= 0 && live > maxBytes)
+    {
+        qSort(candidates.begin(), candidates.end(), lessRecentlyUsed);
+        foreach(const PackedTile& tile, candidates)
+        {
+            if (live <= targetBytes)
+                break;
+            this->remove(tile.key);
+            live -= tile.bytes;
+            (*lruEvictions)++;
+        }
+    }
+
+    //Removed tiles only give their space back once the packs are compacted
+    const qint64 onDisk = this->packBytes();
+    const bool tooMuchGarbage = onDisk - live > onDisk * MAX_GARBAGE_FRACTION;
+    const bool overBudget = maxBytes >= 0 && onDisk > maxBytes;
+    if (onDisk > live && (tooMuchGarbage || overBudget))
+    {
+        this->compact();
+        return this->packBytes();
+    }
+
+    this->flush();
+    return onDisk;
+}
+
+//private
+bool PackFileTileCache::ensureOpen()
+{
+    if (_opened)
+        return true;
+
+    //Held while the index is loaded, so mightContain() doesn't see half of it
+    QMutexLocker lock(&_indexLock);
+
+    QDir dir(_directory);
+    if (!dir.exists() && !dir.mkpath(dir.absolutePath()))
+    {
+        qWarning() << "Failed to create cache directory" << dir.absolutePath();
+        return false;
+    }
+
+    //The current generation is the newest one that has an index. Anything else is a leftover.
+    QRegExp indexName("index-(\\d+)\\.log");
+    QRegExp packName("pack-(\\d+)-(\\d+)\\.dat");
+    bool haveIndex = false;
+    bool havePacks = false;
+    _generation = 0;
+    foreach(const QString& file, dir.entryList(QStringList() << "index-*.log", QDir::Files))
+    {
+        if (!indexName.exactMatch(file))
+            continue;
+        const quint32 generation = indexName.cap(1).toUInt();
+        if (!haveIndex || generation > _generation)
+            _generation = generation;
+        haveIndex = true;
+    }
+    if (!haveIndex)
+    {
+        foreach(const QString& file, dir.entryList(QStringList() << "pack-*.dat", QDir::Files))
+        {
+            if (!packName.exactMatch(file))
+                continue;
+            const quint32 generation = packName.cap(1).toUInt();
+            if (!havePacks || generation > _generation)
+                _generation = generation;
+            havePacks = true;
+        }
+    }
+
+    foreach(const QString& file, dir.entryList(QStringList() << "pack-*.dat" << "index-*.log", QDir::Files))
+    {
+        quint32 generation;
+        if (packName.exactMatch(file))
+            generation = packName.cap(1).toUInt();
+        else if (indexName.exactMatch(file))
+            generation = indexName.cap(1).toUInt();
+        else
+            continue;
+
+        if (generation != _generation)
+            dir.remove(file);
+    }
+
+    _index.clear();
+    _writePack = 0;
+    _indexRecords = 0;
+
+    if (haveIndex)
+        this->loadIndex(this->indexPath(_generation));
+    else if (havePacks)
+    {
+        qWarning() << "Tile index of" << _directory << "is missing. Rebuilding it.";
+        this->rebuildIndexFromPacks();
+    }
+
+    //New tiles always go to the newest pack
+    foreach(const QString& file, dir.entryList(QStringList() << QString("pack-%1-*.dat").arg(_generation), QDir::Files))
+    {
+        if (packName.exactMatch(file))
+            _writePack = qMax(_writePack, packName.cap(2).toUInt());
+    }
+
+    _indexFile.setFileName(this->indexPath(_generation));
+    const bool isNew = !_indexFile.exists();
+    if (!_indexFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        qWarning() << "Failed to open tile index" << _indexFile.fileName() << ":" << _indexFile.errorString();
+        return false;
+    }
+    if (isNew)
+    {
+        QDataStream stream(&_indexFile);
+        stream << INDEX_MAGIC << INDEX_VERSION;
+    }
+
+    _opened = true;
+    lock.unlock();
+
+    this->setBytesUsed(this->packBytes());
+    return true;
+}
+
+//private
+void PackFileTileCache::close()
+{
+    this->flush();
+    _indexFile.close();
+    qDeleteAll(_packFiles);
+    _packFiles.clear();
+
+    QMutexLocker lock(&_indexLock);
+    _index.clear();
+    _opened = false;
+}
+
+//private
+bool PackFileTileCache::loadIndex(const QString &path)
+{
+    QFile fp(path);
+    if (!fp.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Failed to open tile index" << path << ":" << fp.errorString();
+        return false;
+    }
+
+    QDataStream stream(&fp);
+    quint32 magic;
+    quint32 version;
+    stream >> magic >> version;
+    if (stream.status() != QDataStream::Ok
+            || magic != INDEX_MAGIC
+            || (version != INDEX_VERSION && version != INDEX_VERSION_WITHOUT_VALIDATORS))
+    {
+        qWarning() << "Tile index" << path << "is not readable. Rebuilding it.";
+        fp.close();
+        QFile::remove(path);
+        return this->rebuildIndexFromPacks();
+    }
+
+    //Later records win. A torn record at the end (e.g., after a crash) is ignored.
+    qint64 goodEnd = fp.pos();
+    while (!stream.atEnd())
+    {
+        quint64 packed;
+        IndexEntry entry;
+        stream >> packed >> entry.pack >> entry.offset >> entry.length >> entry.expires;
+        if (version != INDEX_VERSION_WITHOUT_VALIDATORS)
+            stream >> entry.validators;
+        if (stream.status() != QDataStream::Ok)
+            break;
+
+        const TileKey key = TileKey::fromPacked(packed);
+        if (entry.pack == REMOVED_PACK)
+            _index.remove(key);
+        else
+            _index.insert(key, entry);
+        _indexRecords++;
+        goodEnd = fp.pos();
+    }
+
+    //...and cut off, so the records we append don't end up out of step behind it
+    if (version == INDEX_VERSION && goodEnd < fp.size())
+    {
+        qWarning() << "Tile index" << path << "has a torn record at the end. Dropping it.";
+        fp.close();
+        if (!QFile::resize(path, goodEnd) && !this->writeIndexSnapshot(path, _index))
+        {
+            QFile::remove(path);
+            return false;
+        }
+    }
+
+    //New records can't be appended to a log in the old format, so replace it with a current snapshot
+    if (version != INDEX_VERSION)
+    {
+        fp.close();
+        if (!this->writeIndexSnapshot(path, _index))
+        {
+            //Start a fresh log. The tiles we know about make it in with the next checkpoint.
+            QFile::remove(path);
+            return false;
+        }
+        _indexRecords = _index.size();
+    }
+
+    return true;
+}
+
+//private
+bool PackFileTileCache::rebuildIndexFromPacks()
+{
+    QRegExp packName("pack-(\\d+)-(\\d+)\\.dat");
+    QList<quint32> packs;
+    QDir dir(_directory);
+    foreach(const QString& file, dir.entryList(QStringList() << QString("pack-%1-*.dat").arg(_generation), QDir::Files))
+    {
+        if (packName.exactMatch(file))
+            packs.append(packName.cap(2).toUInt());
+    }
+    qSort(packs);
+
+    //Walk the record headers of every pack in the order they were written
+    foreach(quint32 packNumber, packs)
+    {
+        QFile fp(this->packPath(_generation, packNumber));
+        if (!fp.open(QIODevice::ReadOnly))
+            continue;
+
+        QDataStream stream(&fp);
+        while (fp.pos() + PACK_RECORD_HEADER_BYTES <= fp.size())
+        {
+            quint32 magic;
+            quint64 packed;
+            IndexEntry entry;
+            stream >> magic >> packed >> entry.expires >> entry.length;
+            if (stream.status() != QDataStream::Ok || magic != PACK_RECORD_MAGIC)
+                break;
+
+            entry.pack = packNumber;
+            entry.offset = fp.pos();
+            if ((qint64) (entry.offset + entry.length) > fp.size())
+                break;
+            _index.insert(TileKey::fromPacked(packed), entry);
+
+            if (!fp.seek(entry.offset + entry.length))
+                break;
+        }
+    }
+
+    if (!this->writeIndexSnapshot(this->indexPath(_generation), _index))
+        return false;
+    _indexRecords = _index.size();
+    return true;
+}
+
+//private
+bool PackFileTileCache::writeIndexSnapshot(const QString &path, const QHash<TileKey, IndexEntry> &index) const
+{
+    QSaveFile fp(path);
+    if (!fp.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Failed to write tile index" << path << ":" << fp.errorString();
+        return false;
+    }
+
+    QDataStream stream(&fp);
+    stream << INDEX_MAGIC << INDEX_VERSION;
+
+    QHash<TileKey, IndexEntry>::const_iterator it;
+    for (it = index.constBegin(); it != index.constEnd(); ++it)
+    {
+        const IndexEntry& entry = it.value();
+        stream << it.key().packed() << entry.pack << entry.offset << entry.length << entry.expires << entry.validators;
+    }
+
+    if (!fp.commit())
+    {
+        qWarning() << "Failed to write tile index" << path << ":" << fp.errorString();
+        return false;
+    }
+    return true;
+}
+
+//private
+bool PackFileTileCache::appendIndexRecord(const TileKey &key, const IndexEntry &entry)
+{
+    QDataStream stream(&_indexFile);
+    stream << key.packed() << entry.pack << entry.offset << entry.length << entry.expires << entry.validators;
+    if (stream.status() != QDataStream::Ok)
+    {
+        qWarning() << "Failed to append to tile index" << _indexFile.fileName() << ":" << _indexFile.errorString();
+        return false;
+    }
+    _indexRecords++;
+    return true;
+}
+
+//private
+void PackFileTileCache::checkpointIndex()
+{
+    //Tiles past retention would be thrown out by the next janitor run anyway. Their bytes go away on the next compaction.
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker lock(&_indexLock);
+    QHash<TileKey, IndexEntry>::iterator it = _index.begin();
+    while (it != _index.end())
+    {
+        if (isPastRetention(it.value().expires, now))
+            it = _index.erase(it);
+        else
+            ++it;
+    }
+    lock.unlock();
+
+    //The snapshot replaces the log atomically. If writing it fails, the old log is still good.
+    _indexFile.close();
+    if (this->writeIndexSnapshot(this->indexPath(_generation), _index))
+        _indexRecords = _index.size();
+
+    if (!_indexFile.open(QIODevice::WriteOnly | QIODevice::Append))
+        qWarning() << "Failed to reopen tile index" << _indexFile.fileName() << ":" << _indexFile.errorString();
+}
+
+//private
+bool PackFileTileCache::readEntry(const TileKey &key, const PackFileTileCache::IndexEntry &entry, QByteArray *data)
+{
+    QFile * pack = this->packFile(entry.pack);
+    if (!pack || entry.offset < (quint64) PACK_RECORD_HEADER_BYTES
+            || !pack->seek(entry.offset - PACK_RECORD_HEADER_BYTES))
+        return false;
+
+    //The record header has to agree with the index, or the index points at some other tile's bytes
+    QDataStream stream(pack);
+    quint32 magic;
+    quint64 packed;
+    qint64 expires;
+    quint32 length;
+    stream >> magic >> packed >> expires >> length;
+    bool ok = stream.status() == QDataStream::Ok
+            && magic == PACK_RECORD_MAGIC
+            && packed == key.packed()
+            && length == entry.length;
+    if (ok)
+    {
+        *data = pack->read(entry.length);
+        ok = (quint32) data->size() == entry.length;
+    }
+
+    if (!ok)
+    {
+        qWarning() << "Bad record for" << key << "in" << pack->fileName() << ". Forgetting it.";
+        data->clear();
+        QMutexLocker lock(&_indexLock);
+        _index.remove(key);
+        return false;
+    }
+    return true;
+}
+
+//private
+QFile *PackFileTileCache::packFile(quint32 pack)
+{
+    QFile * toRet = _packFiles.value(pack, 0);
+    if (toRet)
+        return toRet;
+
+    toRet = new QFile(this->packPath(_generation, pack));
+    if (!toRet->open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Failed to open tile pack" << toRet->fileName() << ":" << toRet->errorString();
+        delete toRet;
+        return 0;
+    }
+    _packFiles.insert(pack, toRet);
+    return toRet;
+}
+
+//private
+bool PackFileTileCache::appendToPack(const TileKey &key, const QByteArray &data, qint64 expires, IndexEntry *entry)
+{
+    QFile * pack = this->packFile(_writePack);
+    if (pack && pack->size() > 0 && pack->size() + PACK_RECORD_HEADER_BYTES + data.size() > MAX_PACK_BYTES)
+        pack = this->packFile(++_writePack);
+    if (!pack)
+        return false;
+
+    const qint64 recordStart = pack->size();
+    if (!pack->seek(recordStart))
+        return false;
+
+    QDataStream stream(pack);
+    stream << PACK_RECORD_MAGIC << key.packed() << expires << (quint32) data.size();
+    if (stream.status() != QDataStream::Ok || pack->write(data) != data.size())
+    {
+        qWarning() << "Failed to append" << key << "to" << pack->fileName() << ":" << pack->errorString();
+
+        //Don't leave a torn record in front of the next one
+        pack->resize(recordStart);
+        return false;
+    }
+
+    entry->pack = _writePack;
+    entry->length = data.size();
+    entry->offset = recordStart + PACK_RECORD_HEADER_BYTES;
+    entry->expires = expires;
+    return true;
+}
+
+//private
+qint64 PackFileTileCache::packBytes() const
+{
+    qint64 toRet = 0;
+    for (quint32 i = 0; i <= _writePack; i++)
+    {
+        QFileInfo info(this->packPath(_generation, i));
+        if (info.exists())
+            toRet += info.size();
+    }
+    return toRet;
+}
+
+//private
+QString PackFileTileCache::packPath(quint32 generation, quint32 pack) const
+{
+    return _directory % "/" % QString("pack-%1-%2.dat").arg(generation).arg(pack);
+}
+
+//private
+QString PackFileTileCache::indexPath(quint32 generation) const
+{
+    return _directory % "/" % QString("index-%1.log").arg(generation);
+}
@@ -0,0 +1,121 @@
+#ifndef PACKFILETILECACHE_H
+#define PACKFILETILECACHE_H
+
+#include <QString>
+#include <QHash>
+#include <QFile>
+#include <QMutex>
+
+#include "DiskTileCache.h"
+
+/*!
+ \brief A log-structured disk cache backend. Instead of one file per tile, tiles are appended to a small
+ number of large pack files (pack-<generation>-<n>.dat). An in-memory index maps each TileKey to the pack,
+ offset, length and expiration time of its newest copy, so lookups never touch the filesystem.
+
+ The index is persisted as an append-only log (index-<generation>.log) that is read once when the cache
+ is first used. If it's missing it is rebuilt by scanning the record headers in the packs. Expiration
+ times and validators live in the index too (validators only there, so a rebuilt index has none and its
+ tiles are downloaded again when they expire). Once the log has grown well beyond the number of tiles,
+ flush() replaces it with a snapshot that leaves out tiles past retention.
+
+ Tiles that are replaced or removed stay in the packs as garbage until compact() copies the live tiles
+ into a new generation of packs and deletes the old one.
+*/
+class PackFileTileCache : public DiskTileCache
+{
+public:
+    explicit PackFileTileCache(const QString& directory);
+    virtual ~PackFileTileCache();
+
+    //virtual from DiskTileCache
+    virtual void open();
+
+    //virtual from DiskTileCache
+    virtual bool mightContain(const TileKey& key) const;
+
+    //virtual from DiskTileCache
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime, QByteArray * validators);
+
+    //virtual from DiskTileCache
+    virtual bool write(const TileKey& key,
+                       const QByteArray& data,
+                       const QDateTime& expireTime,
+                       const QByteArray& validators);
+
+    //virtual from DiskTileCache
+    virtual bool contains(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual void remove(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    //virtual from DiskTileCache
+    virtual void flush();
+
+    //virtual from DiskTileCache
+    virtual void compact();
+
+protected:
+    //virtual from DiskTileCache
+    virtual qint64 trim(qint64 maxBytes, qint64 targetBytes, quint64 * expiredEvictions, quint64 * lruEvictions);
+
+private:
+    struct IndexEntry
+    {
+        IndexEntry() : pack(0), length(0), offset(0), expires(0), accessed(0) {}
+
+        quint32 pack;
+        quint32 length;
+        quint64 offset;
+        qint64 expires;
+        QByteArray validators;
+
+        //When the tile was last read or written, for LRU eviction. Only kept in memory.
+        qint64 accessed;
+    };
+
+    bool ensureOpen();
+    void close();
+
+    bool loadIndex(const QString& path);
+    bool rebuildIndexFromPacks();
+    bool writeIndexSnapshot(const QString& path, const QHash<TileKey, IndexEntry>& index) const;
+    bool appendIndexRecord(const TileKey& key, const IndexEntry& entry);
+
+    //Replaces the index log with a snapshot of the live tiles that aren't past retention
+    void checkpointIndex();
+
+    //Reads a tile's bytes from its pack. Drops the tile from the index if its record is broken.
+    bool readEntry(const TileKey& key, const IndexEntry& entry, QByteArray * data);
+
+    QFile * packFile(quint32 pack);
+    bool appendToPack(const TileKey& key, const QByteArray& data, qint64 expires, IndexEntry * entry);
+
+    //The size of all packs of the current generation, garbage included
+    qint64 packBytes() const;
+
+    QString packPath(quint32 generation, quint32 pack) const;
+    QString indexPath(quint32 generation) const;
+
+    QString _directory;
+    bool _opened;
+    quint32 _generation;
+    quint32 _writePack;
+
+    //How many records the current index log holds
+    int _indexRecords;
+
+    //Changes to the index are made with _indexLock held so mightContain() can look at it from other threads
+    QHash<TileKey, IndexEntry> _index;
+    mutable QMutex _indexLock;
+    QHash<quint32, QFile *> _packFiles;
+    QFile _indexFile;
+};
+
+#endif // PACKFILETILECACHE_H
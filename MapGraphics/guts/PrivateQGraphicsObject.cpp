@@ -42,14 +42,11 @@ QRectF PrivateQGraphicsObject::boundingRect() const
     //Convert from ENU to lat/lon
     QPointF latLonCenter = _mgObj->pos();
     Position latLonCenterPos(latLonCenter, 0.0);
-    QPointF leftLatLon = Conversions::enu2lla(enuRect.left(),
-                                              0.0,
-                                              0.0,
-                                              latLonCenterPos).lonLat();
-    QPointF upLatLon = Conversions::enu2lla(0.0,
-                                            enuRect.top(),
-                                            0.0,
-                                            latLonCenterPos).lonLat();
+    QPolygonF enuPoints;
+    enuPoints << QPointF(enuRect.left(), 0.0) << QPointF(0.0, enuRect.top());
+    const QPolygonF latLonPoints = Conversions::enu2lla(enuPoints, latLonCenterPos);
+    const QPointF leftLatLon = latLonPoints.at(0);
+    const QPointF upLatLon = latLonPoints.at(1);
 
     qreal lonWidth = 2.0*(latLonCenter.x() - leftLatLon.x());
     qreal latHeight = 2.0*(upLatLon.y() - latLonCenter.y());
@@ -66,10 +63,10 @@ QRectF PrivateQGraphicsObject::boundingRect() const
     }
 
     int zoomLevel = _infoSource->zoomLevel();
-    QPointF topLeft = tileSource->ll2qgs(latLonRect.topLeft(),zoomLevel);
-    QPointF bottomRight = tileSource->ll2qgs(latLonRect.bottomRight(),zoomLevel);
+    QPointF corners[2] = {latLonRect.topLeft(), latLonRect.bottomRight()};
+    tileSource->ll2qgsPoints(corners, corners, 2, zoomLevel);
 
-    toRet = QRectF(topLeft,bottomRight);
+    toRet = QRectF(corners[0],corners[1]);
     toRet.moveCenter(QPointF(0,0));
     return toRet;
 }
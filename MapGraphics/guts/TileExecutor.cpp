@@ -0,0 +1,280 @@
+#include "TileExecutor.h"
+
+#include <QThread>
+#include <QMutexLocker>
+#include <QCoreApplication>
+
+TileJob::~TileJob()
+{
+}
+
+//Runs jobs for the executor
+class TileExecutor::Worker : public QThread
+{
+public:
+    explicit Worker(TileExecutor * executor) : _executor(executor) {}
+
+protected:
+    //virtual from QThread
+    virtual void run()
+    {
+        _executor->work();
+    }
+
+private:
+    TileExecutor * _executor;
+};
+
+TileExecutor::OwnerState::OwnerState() :
+    running(0), maxConcurrency(1)
+{
+}
+
+//static
+TileExecutor * TileExecutor::_instance = 0;
+QMutex TileExecutor::_instanceMutex;
+
+//static
+TileExecutor *TileExecutor::getInstance()
+{
+    QMutexLocker lock(&_instanceMutex);
+    if (!TileExecutor::_instance)
+    {
+        TileExecutor::_instance = new TileExecutor();
+
+        //Make sure the threads are stopped before the application goes away
+        qAddPostRoutine(TileExecutor::shutdown);
+    }
+    return TileExecutor::_instance;
+}
+
+TileExecutor::~TileExecutor()
+{
+    QList<QThread *> workers;
+    {
+        QMutexLocker lock(&_mutex);
+        _stopping = true;
+        _wakeUp.wakeAll();
+        workers = _workers;
+    }
+
+    //Workers finish the job they're on first
+    foreach(QThread * worker, workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+
+    //Jobs that never got to run
+    foreach(const OwnerState& state, _owners)
+        qDeleteAll(state.queue);
+    _owners.clear();
+    _turns.clear();
+
+    foreach(QThread * home, _homes)
+    {
+        home->quit();
+        home->wait();
+        delete home;
+    }
+}
+
+int TileExecutor::workerCount() const
+{
+    QMutexLocker lock(&_mutex);
+    return _workerCount;
+}
+
+void TileExecutor::setWorkerCount(int count)
+{
+    QMutexLocker lock(&_mutex);
+    _workerCount = qMax(1, count);
+
+    //Jobs that were held back may run now. Missing workers are started by the next submit().
+    _wakeUp.wakeAll();
+}
+
+void TileExecutor::adopt(QObject *source)
+{
+    if (source == 0)
+        return;
+
+    QMutexLocker lock(&_mutex);
+    if (_stopping || _adopted.contains(source))
+        return;
+
+    QThread * home = 0;
+    foreach(QThread * thread, _homes)
+    {
+        if (home == 0 || _homeLoads.value(thread) < _homeLoads.value(home))
+            home = thread;
+    }
+
+    //Sources only share a home thread once there are as many as we're allowed
+    if (home == 0 || (_homeLoads.value(home) > 0 && _homes.size() < _workerCount))
+    {
+        home = new QThread();
+        home->start();
+        _homes.append(home);
+        _homeLoads.insert(home, 0);
+    }
+    _homeLoads[home]++;
+    _adopted.insert(source, home);
+    lock.unlock();
+
+    source->moveToThread(home);
+
+    //Sources usually die on another thread, and we want to know right away
+    connect(source,
+            SIGNAL(destroyed(QObject*)),
+            this,
+            SLOT(handleSourceDestroyed(QObject*)),
+            Qt::DirectConnection);
+}
+
+void TileExecutor::submit(const QObject *owner, TileJob *job, int maxConcurrency)
+{
+    if (job == 0)
+        return;
+
+    QMutexLocker lock(&_mutex);
+    if (_stopping)
+    {
+        delete job;
+        return;
+    }
+
+    OwnerState& state = _owners[owner];
+    state.maxConcurrency = qMax(1, maxConcurrency);
+    if (state.queue.isEmpty())
+        _turns.append(owner);
+    state.queue.enqueue(job);
+
+    if (_idleWorkers == 0 && _workers.size() < _workerCount)
+    {
+        Worker * worker = new Worker(this);
+        _workers.append(worker);
+        worker->start();
+    }
+    else
+        _wakeUp.wakeOne();
+}
+
+void TileExecutor::cancelAll(const QObject *owner)
+{
+    QMutexLocker lock(&_mutex);
+    QHash<const QObject *, OwnerState>::iterator it = _owners.find(owner);
+    if (it == _owners.end())
+        return;
+
+    qDeleteAll(it.value().queue);
+    it.value().queue.clear();
+    _turns.removeAll(owner);
+
+    if (it.value().running == 0)
+    {
+        _owners.erase(it);
+        return;
+    }
+
+    //The owner is forgotten when its last running job is done
+    while (_owners.contains(owner))
+        _jobFinished.wait(&_mutex);
+}
+
+int TileExecutor::pendingJobs() const
+{
+    QMutexLocker lock(&_mutex);
+    int toRet = 0;
+    foreach(const OwnerState& state, _owners)
+        toRet += state.queue.size() + state.running;
+    return toRet;
+}
+
+//protected
+TileExecutor::TileExecutor() :
+    QObject(), _workerCount(qMax(1, QThread::idealThreadCount())), _stopping(false),
+    _idleWorkers(0), _runningJobs(0)
+{
+}
+
+//private slot
+void TileExecutor::handleSourceDestroyed(QObject *source)
+{
+    QMutexLocker lock(&_mutex);
+    QThread * home = _adopted.take(source);
+    if (home != 0)
+        _homeLoads[home]--;
+}
+
+//private static
+void TileExecutor::shutdown()
+{
+    QMutexLocker lock(&_instanceMutex);
+    delete TileExecutor::_instance;
+    TileExecutor::_instance = 0;
+}
+
+//private
+void TileExecutor::work()
+{
+    QMutexLocker lock(&_mutex);
+    forever
+    {
+        if (_stopping)
+            return;
+
+        const QObject * owner = 0;
+        TileJob * job = this->takeJob(&owner);
+        if (job == 0)
+        {
+            _idleWorkers++;
+            _wakeUp.wait(&_mutex);
+            _idleWorkers--;
+            continue;
+        }
+
+        lock.unlock();
+        job->run();
+        delete job;
+        lock.relock();
+
+        _runningJobs--;
+        QHash<const QObject *, OwnerState>::iterator it = _owners.find(owner);
+        if (it != _owners.end())
+        {
+            it.value().running--;
+            if (it.value().running == 0 && it.value().queue.isEmpty())
+                _owners.erase(it);
+        }
+        _jobFinished.wakeAll();
+    }
+}
+
+//private
+TileJob *TileExecutor::takeJob(const QObject **owner)
+{
+    if (_runningJobs >= _workerCount)
+        return 0;
+
+    //The first owner in line that may run another job goes, then to the back of the line
+    for (int i = 0; i < _turns.size(); i++)
+    {
+        const QObject * candidate = _turns.at(i);
+        OwnerState& state = _owners[candidate];
+        if (state.running >= state.maxConcurrency)
+            continue;
+
+        TileJob * job = state.queue.dequeue();
+        state.running++;
+        _runningJobs++;
+
+        _turns.removeAt(i);
+        if (!state.queue.isEmpty())
+            _turns.append(candidate);
+
+        *owner = candidate;
+        return job;
+    }
+    return 0;
+}
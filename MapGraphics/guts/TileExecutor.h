@@ -0,0 +1,122 @@
+#ifndef TILEEXECUTOR_H
+#define TILEEXECUTOR_H
+
+#include <QObject>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QHash>
+#include <QList>
+
+#include "MapGraphics_global.h"
+
+class QThread;
+
+//A piece of tile work handed to TileExecutor::submit(). It's deleted once it has run (or been dropped).
+class MAPGRAPHICSSHARED_EXPORT TileJob
+{
+public:
+    virtual ~TileJob();
+
+    //Called on one of the executor's worker threads
+    virtual void run()=0;
+};
+
+/*!
+ \brief The threads shared by all tile sources, so the number of threads follows the number of cores
+ instead of the number of sources and layers.
+
+ Every source lives on one of workerCount() home threads, where its slots (dispatching requests, network
+ replies, disk cache reads) run. adopt() puts a source on the home thread with the fewest sources.
+
+ Work that doesn't have to happen on the source's thread, e.g. drawing or loading and decoding a tile, can
+ be submitted as jobs. Up to workerCount() jobs run at once. Every owner has its own queue and the owners
+ take turns, so a source with a long queue doesn't starve the others. Any idle worker takes the next job
+ of whichever source has one, so a busy source gets the workers the others aren't using. At most
+ maxConcurrency jobs of an owner run at once: 1 for a source that isn't thread-safe, more for one that is.
+*/
+class MAPGRAPHICSSHARED_EXPORT TileExecutor : public QObject
+{
+    Q_OBJECT
+public:
+    static TileExecutor * getInstance();
+
+    ~TileExecutor();
+
+    //How many jobs may run at once and how many home threads sources are spread over. Defaults to the cores.
+    int workerCount() const;
+    void setWorkerCount(int count);
+
+    /*!
+     \brief Moves source to the home thread with the fewest sources. Like QObject::moveToThread(), this must
+     be called on source's current thread. A source that has been adopted already stays where it is.
+    */
+    void adopt(QObject * source);
+
+    /*!
+     \brief Queues job to be run on a worker thread on behalf of owner. At most maxConcurrency jobs of owner
+     run at once. Takes ownership of job. Safe to call from any thread.
+    */
+    void submit(const QObject * owner, TileJob * job, int maxConcurrency = 1);
+
+    /*!
+     \brief Drops the queued jobs of owner and waits for its running ones to finish. Call it before owner is
+     destroyed, but never from one of owner's jobs.
+    */
+    void cancelAll(const QObject * owner);
+
+    //Jobs that are queued or running, over all owners
+    int pendingJobs() const;
+
+protected:
+    TileExecutor();
+
+private slots:
+    void handleSourceDestroyed(QObject * source);
+
+private:
+    static void shutdown();
+
+    class Worker;
+
+    struct OwnerState
+    {
+        OwnerState();
+
+        QQueue<TileJob *> queue;
+        int running;
+        int maxConcurrency;
+    };
+
+    //What every worker thread does until shutdown
+    void work();
+
+    //Call with _mutex held. Takes the next job that may run, or returns 0.
+    TileJob * takeJob(const QObject ** owner);
+
+    static TileExecutor * _instance;
+    static QMutex _instanceMutex;
+
+    mutable QMutex _mutex;
+    QWaitCondition _wakeUp;
+    QWaitCondition _jobFinished;
+    int _workerCount;
+    bool _stopping;
+
+    //Worker threads are started as they're needed, up to _workerCount
+    QList<QThread *> _workers;
+    int _idleWorkers;
+    int _runningJobs;
+
+    QHash<const QObject *, OwnerState> _owners;
+
+    //The owners with queued jobs, in the order they get their turn
+    QList<const QObject *> _turns;
+
+    //The home threads, how many sources each has, and where each source lives
+    QList<QThread *> _homes;
+    QHash<QThread *, int> _homeLoads;
+    QHash<QObject *, QThread *> _adopted;
+};
+
+#endif // TILEEXECUTOR_H
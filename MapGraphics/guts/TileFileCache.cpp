@@ -0,0 +1,542 @@
+#include "TileFileCache.h"
+
+#include <QStringBuilder>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QDirIterator>
+#include <QtAlgorithms>
+#include <QtDebug>
+
+const quint32 DEFAULT_CACHE_DAYS = 7;
+const quint64 MAX_DISK_CACHE_READ_ATTEMPTS = 100000;
+
+//Each <z>/<x> directory has a journal of the expiration times of its tiles
+const QString EXPIRATION_JOURNAL_FILE_NAME = "expirations.journal";
+const quint32 JOURNAL_MAGIC = 0x4D47454A; //"MGEJ"
+const quint32 JOURNAL_VERSION = 2;
+
+//Version 1 journals had no validators
+const quint32 JOURNAL_VERSION_WITHOUT_VALIDATORS = 1;
+
+//A journal record with this expiration time says the tile was removed
+const qint64 REMOVED_EXPIRATION = 0;
+
+//Journals are rewritten when they have more than this many records and twice as many records as tiles
+const int MIN_CHECKPOINT_RECORDS = 64;
+
+//Journals of columns that haven't been used for a while are dropped from memory on flush() beyond this
+const int MAX_LOADED_JOURNALS = 1024;
+
+//The single expiration database used by earlier versions. It was kept with tile 0/0/0.
+const QString OLD_CACHE_EXPIRATIONS_FILE_NAME = "0/0/cacheExpirations.db";
+
+//Tiles with the same z and x share a directory
+static quint64 columnOf(const TileKey& key)
+{
+    return ((quint64) key.z() << 32) | key.x();
+}
+
+//A tile file found by the janitor
+struct CachedTileFile
+{
+    TileKey key;
+    qint64 size;
+    qint64 lastUsed;
+};
+
+static bool lessRecentlyUsed(const CachedTileFile& a, const CachedTileFile& b)
+{
+    return a.lastUsed < b.lastUsed;
+}
+
+TileFileCache::TileFileCache(const QString &directory, const QString &extension) :
+    _directory(directory), _extension(extension)
+{
+    _extension.remove('.');
+}
+
+TileFileCache::~TileFileCache()
+{
+    this->flush();
+    qDeleteAll(_journals);
+}
+
+//virtual from DiskTileCache
+void TileFileCache::open()
+{
+    //The expiration times now live in the journals. The 0/0 directory stays, it holds a tile.
+    const QString oldDatabase = _directory % "/" % OLD_CACHE_EXPIRATIONS_FILE_NAME;
+    if (!QFile::exists(oldDatabase))
+        return;
+
+    this->migrateOldExpirations(oldDatabase);
+    QFile::remove(oldDatabase);
+}
+
+//virtual from DiskTileCache
+bool TileFileCache::mightContain(const TileKey &key) const
+{
+    //The only thing we know without asking the disk is which directories are missing
+    QMutexLocker lock(&_columnsLock);
+    return _columns.value(columnOf(key), true);
+}
+
+//virtual from DiskTileCache
+bool TileFileCache::read(const TileKey &key, QByteArray *data, QDateTime *expireTime, QByteArray *validators)
+{
+    //See if we've got it in the cache
+    QFile fp(this->getDiskCacheFile(key, false));
+    if (!fp.exists())
+        return false;
+
+    if (!fp.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to open" << QFileInfo(fp.fileName()).baseName() << "from cache";
+        return false;
+    }
+
+    data->clear();
+    quint64 counter = 0;
+    while (data->length() < fp.size())
+    {
+        data->append(fp.read(20480));
+        if (++counter >= MAX_DISK_CACHE_READ_ATTEMPTS)
+        {
+            qWarning() << "Reading cache file" << fp.fileName() << "took too long. Aborting.";
+            return false;
+        }
+    }
+
+    *expireTime = this->expirationTime(key);
+    *validators = this->getJournal(key)->validators.value(key.y());
+    return true;
+}
+
+//virtual from DiskTileCache
+bool TileFileCache::write(const TileKey &key,
+                          const QByteArray &data,
+                          const QDateTime &expireTime,
+                          const QByteArray &validators)
+{
+    //Note when the tile will expire and how to revalidate it then
+    ExpirationJournal * journal = this->getJournal(key);
+    if (validators.isEmpty())
+        journal->validators.remove(key.y());
+    else
+        journal->validators.insert(key.y(), validators);
+    this->setExpirationTime(key, expireTime);
+
+    //Plain write of the bytes we were given. QSaveFile makes sure a half-written tile is never left behind.
+    const QString path = this->getDiskCacheFile(key, true);
+    const qint64 oldSize = QFileInfo(path).size();
+    QSaveFile fp(path);
+    if (!fp.open(QIODevice::WriteOnly)
+            || fp.write(data) != data.size()
+            || !fp.commit())
+    {
+        qWarning() << "Failed to write" << key << "to" << fp.fileName() << ":" << fp.errorString();
+        return false;
+    }
+
+    this->adjustBytesUsed(data.size() - oldSize);
+    return true;
+}
+
+//virtual from DiskTileCache
+bool TileFileCache::contains(const TileKey &key)
+{
+    return QFile::exists(this->getDiskCacheFile(key, false));
+}
+
+//virtual from DiskTileCache
+void TileFileCache::remove(const TileKey &key)
+{
+    const QString path = this->getDiskCacheFile(key, false);
+    const QFileInfo info(path);
+    if (info.exists())
+    {
+        if (QFile::remove(path))
+            this->adjustBytesUsed(-info.size());
+        else
+            qWarning() << "Failed to remove old cache file" << path;
+    }
+
+    ExpirationJournal * journal = this->getJournal(key);
+    journal->validators.remove(key.y());
+    if (journal->expirations.remove(key.y()) > 0)
+        this->appendJournalRecord(journal, key.y(), REMOVED_EXPIRATION);
+}
+
+//virtual from DiskTileCache
+QDateTime TileFileCache::expirationTime(const TileKey &key)
+{
+    ExpirationJournal * journal = this->getJournal(key);
+
+    QDateTime expireTime;
+    if (journal->expirations.contains(key.y()))
+        expireTime = QDateTime::fromMSecsSinceEpoch(journal->expirations.value(key.y()), Qt::UTC);
+    else
+    {
+        qWarning() << "Tile" << key << "has unknown expire time. Resetting to default of" << DEFAULT_CACHE_DAYS << "days.";
+        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+        this->setExpirationTime(key, expireTime);
+    }
+
+    return expireTime;
+}
+
+//virtual from DiskTileCache
+void TileFileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    ExpirationJournal * journal = this->getJournal(key);
+
+    const qint64 expires = expireTime.toMSecsSinceEpoch();
+    journal->expirations.insert(key.y(), expires);
+    this->appendJournalRecord(journal, key.y(), expires);
+}
+
+//virtual from DiskTileCache
+void TileFileCache::flush()
+{
+    foreach(ExpirationJournal * journal, _journals)
+        this->flushJournal(journal);
+
+    //Everything is on disk now, so if we're holding on to too many journals we can forget them
+    if (_journals.size() > MAX_LOADED_JOURNALS)
+    {
+        qDeleteAll(_journals);
+        _journals.clear();
+    }
+}
+
+//protected
+//virtual from DiskTileCache
+qint64 TileFileCache::trim(qint64 maxBytes, qint64 targetBytes, quint64 *expiredEvictions, quint64 *lruEvictions)
+{
+    //Walk every tile file. Those past retention go right away, the others are candidates for LRU eviction.
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<CachedTileFile> files;
+    qint64 total = 0;
+
+    QDirIterator it(_directory,
+                    QStringList() << QString("*.%1").arg(_extension),
+                    QDir::Files,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+
+        //<directory>/<z>/<x>/<y>.<extension>
+        const QString xDirectory = info.absolutePath();
+        bool okZ, okX, okY;
+        const quint32 z = QFileInfo(QFileInfo(xDirectory).absolutePath()).fileName().toUInt(&okZ);
+        const quint32 x = QFileInfo(xDirectory).fileName().toUInt(&okX);
+        const quint32 y = info.completeBaseName().toUInt(&okY);
+        if (!okZ || !okX || !okY || z > 255)
+            continue;
+        const TileKey key(x, y, (quint8) z);
+
+        ExpirationJournal * journal = this->getJournal(key);
+        if (journal->expirations.contains(y) && isPastRetention(journal->expirations.value(y), now))
+        {
+            if (QFile::remove(info.absoluteFilePath()))
+            {
+                journal->expirations.remove(y);
+                journal->validators.remove(y);
+                this->appendJournalRecord(journal, y, REMOVED_EXPIRATION);
+                (*expiredEvictions)++;
+            }
+            continue;
+        }
+
+        //Access times may not be kept up to date (or at all), in which case this degrades to oldest-first
+        QDateTime lastUsed = info.lastRead();
+        if (!lastUsed.isValid() || lastUsed < info.lastModified())
+            lastUsed = info.lastModified();
+
+        CachedTileFile file;
+        file.key = key;
+        file.size = info.size();
+        file.lastUsed = lastUsed.toMSecsSinceEpoch();
+        files.append(file);
+        total += file.size;
+
+        //Don't hold on to the journals of the whole cache
+        if (_journals.size() > MAX_LOADED_JOURNALS)
+            this->flush();
+    }
+
+    if (maxBytes >= 0 && total > maxBytes)
+    {
+        qSort(files.begin(), files.end(), lessRecentlyUsed);
+        foreach(const CachedTileFile& file, files)
+        {
+            if (total <= targetBytes)
+                break;
+            this->remove(file.key);
+            total -= file.size;
+            (*lruEvictions)++;
+        }
+    }
+
+    this->flush();
+    return total;
+}
+
+//private
+QString TileFileCache::getDiskCacheDirectory(const TileKey &key, bool create)
+{
+    const QString toRet = _directory % "/" % QString::number(key.z()) % "/" % QString::number(key.x());
+    const quint64 column = columnOf(key);
+
+    QMutexLocker lock(&_columnsLock);
+    const bool known = _columns.contains(column);
+    bool exists = _columns.value(column, false);
+    lock.unlock();
+
+    if (exists || (known && !create))
+        return toRet;
+
+    if (!known)
+        exists = QDir(toRet).exists();
+    if (!exists && create)
+    {
+        exists = QDir().mkpath(toRet);
+        if (!exists)
+            qWarning() << "Failed to create cache directory" << toRet;
+    }
+
+    lock.relock();
+    _columns.insert(column, exists);
+    return toRet;
+}
+
+//private
+QString TileFileCache::getDiskCacheFile(const TileKey &key, bool create)
+{
+    QString toRet = this->getDiskCacheDirectory(key, create) % "/" % QString::number(key.y()) % "." % _extension;
+    return toRet;
+}
+
+//private
+TileFileCache::ExpirationJournal *TileFileCache::getJournal(const TileKey &key)
+{
+    const quint64 column = columnOf(key);
+    ExpirationJournal * toRet = _journals.value(column, 0);
+    if (toRet)
+        return toRet;
+
+    toRet = new ExpirationJournal();
+    toRet->path = this->getDiskCacheDirectory(key, false) % "/" % EXPIRATION_JOURNAL_FILE_NAME;
+    toRet->pendingRecords = 0;
+    toRet->records = 0;
+    toRet->outdated = false;
+    _journals.insert(column, toRet);
+
+    QFile fp(toRet->path);
+    if (!fp.exists())
+        return toRet;
+
+    if (!fp.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Failed to open expiration journal" << fp.fileName() << ":" << fp.errorString();
+        return toRet;
+    }
+
+    QDataStream stream(&fp);
+    quint32 magic;
+    quint32 version;
+    stream >> magic >> version;
+    if (stream.status() != QDataStream::Ok
+            || magic != JOURNAL_MAGIC
+            || (version != JOURNAL_VERSION && version != JOURNAL_VERSION_WITHOUT_VALIDATORS))
+    {
+        qWarning() << "Expiration journal" << fp.fileName() << "is not readable. Starting over.";
+
+        //Appending to it would keep it unreadable, so the next flush writes a fresh one
+        toRet->outdated = true;
+        return toRet;
+    }
+    const bool withValidators = (version == JOURNAL_VERSION);
+    toRet->outdated = !withValidators;
+
+    //Later records win. A torn record at the end (e.g., after a crash) is ignored.
+    qint64 goodEnd = fp.pos();
+    while (!stream.atEnd())
+    {
+        quint32 y;
+        qint64 expires;
+        QByteArray validators;
+        stream >> y >> expires;
+        if (withValidators)
+            stream >> validators;
+        if (stream.status() != QDataStream::Ok)
+            break;
+
+        if (expires == REMOVED_EXPIRATION)
+            toRet->expirations.remove(y);
+        else
+            toRet->expirations.insert(y, expires);
+
+        if (validators.isEmpty())
+            toRet->validators.remove(y);
+        else
+            toRet->validators.insert(y, validators);
+        toRet->records++;
+        goodEnd = fp.pos();
+    }
+
+    //Records appended behind a torn one would be read out of step, so the next flush rewrites the journal
+    if (goodEnd < fp.size())
+    {
+        qWarning() << "Expiration journal" << fp.fileName() << "has a torn record at the end. Dropping it.";
+        toRet->outdated = true;
+    }
+
+    return toRet;
+}
+
+//private
+void TileFileCache::migrateOldExpirations(const QString &path)
+{
+    QFile fp(path);
+    if (!fp.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Failed to open old cache expiration file" << path << ":" << fp.errorString();
+        return;
+    }
+
+    //Earlier versions kept the expiration times of all the tiles in one hash keyed by "x,y,z"
+    QHash<QString, QDateTime> oldExpirations;
+    QDataStream stream(&fp);
+    stream >> oldExpirations;
+    if (stream.status() != QDataStream::Ok)
+    {
+        qWarning() << "Old cache expiration file" << path << "is unreadable. Cached tiles get the default expiration.";
+        return;
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QHash<QString, QDateTime>::const_iterator it;
+    for (it = oldExpirations.constBegin(); it != oldExpirations.constEnd(); ++it)
+    {
+        const QStringList parts = it.key().split(',');
+        if (parts.size() != 3 || !it.value().isValid())
+            continue;
+
+        bool okX = false, okY = false, okZ = false;
+        const quint32 x = parts.at(0).toUInt(&okX);
+        const quint32 y = parts.at(1).toUInt(&okY);
+        const quint32 z = parts.at(2).toUInt(&okZ);
+        if (!okX || !okY || !okZ || z > TileKey::MAX_ZOOM || x >= (1u << z) || y >= (1u << z))
+            continue;
+
+        //Tiles that are gone, or that expired so long ago that they'll be thrown out anyway
+        const qint64 expires = it.value().toMSecsSinceEpoch();
+        if (DiskTileCache::isPastRetention(expires, now))
+            continue;
+        const TileKey key(x, y, (quint8) z);
+        if (!QFile::exists(this->getDiskCacheFile(key, false)))
+            continue;
+
+        //A journal only has records for tiles that were cached after the old database stopped being used
+        ExpirationJournal * journal = this->getJournal(key);
+        if (journal->expirations.contains(y))
+            continue;
+        journal->expirations.insert(y, expires);
+        this->appendJournalRecord(journal, y, expires);
+    }
+
+    this->flush();
+}
+
+//private
+void TileFileCache::appendJournalRecord(TileFileCache::ExpirationJournal *journal, quint32 y, qint64 expires)
+{
+    QDataStream stream(&journal->pending, QIODevice::WriteOnly | QIODevice::Append);
+    stream << y << expires << journal->validators.value(y);
+    journal->pendingRecords++;
+}
+
+//private
+void TileFileCache::flushJournal(TileFileCache::ExpirationJournal *journal)
+{
+    if (journal->pending.isEmpty())
+        return;
+
+    //If the journal has a lot more records than tiles, write a fresh one without the dead weight.
+    //Journals in the old format can't be appended to, so they're always rewritten.
+    const int records = journal->records + journal->pendingRecords;
+    if (journal->outdated || (records > MIN_CHECKPOINT_RECORDS && records > 2 * journal->expirations.size()))
+    {
+        //Tiles past retention would be thrown out by the next janitor run anyway
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        const QString directory = QFileInfo(journal->path).absolutePath();
+        QHash<quint32, qint64>::iterator it = journal->expirations.begin();
+        while (it != journal->expirations.end())
+        {
+            if (isPastRetention(it.value(), now))
+            {
+                QFile::remove(directory % "/" % QString::number(it.key()) % "." % _extension);
+                journal->validators.remove(it.key());
+                it = journal->expirations.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        QSaveFile fp(journal->path);
+        if (fp.open(QIODevice::WriteOnly))
+        {
+            QDataStream stream(&fp);
+            stream << JOURNAL_MAGIC << JOURNAL_VERSION;
+            for (it = journal->expirations.begin(); it != journal->expirations.end(); ++it)
+                stream << it.key() << it.value() << journal->validators.value(it.key());
+            if (fp.commit())
+            {
+                journal->records = journal->expirations.size();
+                journal->pending.clear();
+                journal->pendingRecords = 0;
+                journal->outdated = false;
+                return;
+            }
+        }
+        qWarning() << "Failed to checkpoint expiration journal" << journal->path << ":" << fp.errorString();
+
+        if (journal->outdated)
+        {
+            //Our records can't go behind what's on disk, so keep them in memory only
+            journal->pending.clear();
+            journal->pendingRecords = 0;
+            return;
+        }
+    }
+
+    //Otherwise just tack the new records onto the end
+    QFile fp(journal->path);
+    const bool isNew = !fp.exists();
+    if (!fp.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        //Most likely the tiles never made it to disk, so there's nothing to describe
+        qWarning() << "Dropping expiration journal changes for" << journal->path << ":" << fp.errorString();
+        journal->pending.clear();
+        journal->pendingRecords = 0;
+        return;
+    }
+    if (isNew)
+    {
+        QDataStream stream(&fp);
+        stream << JOURNAL_MAGIC << JOURNAL_VERSION;
+    }
+    if (fp.write(journal->pending) != journal->pending.size())
+        qWarning() << "Failed to append to expiration journal" << journal->path << ":" << fp.errorString();
+
+    journal->records = records;
+    journal->pending.clear();
+    journal->pendingRecords = 0;
+}
@@ -0,0 +1,111 @@
+#ifndef TILEFILECACHE_H
+#define TILEFILECACHE_H
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+
+#include "DiskTileCache.h"
+
+/*!
+ \brief The classic disk cache layout: one file per tile at <directory>/<z>/<x>/<y>.<extension>.
+
+ The expiration times and validators of the tiles in a <z>/<x> directory are kept in a small append-only journal in
+ that directory. A journal is only read when a tile of its column is first used, so opening the cache
+ costs nothing however big it is. Changes are appended on flush() and the journal is rewritten (without
+ the tiles that are past retention or were removed) once it has grown well beyond the number of tiles it describes.
+*/
+class TileFileCache : public DiskTileCache
+{
+public:
+    TileFileCache(const QString& directory, const QString& extension);
+    virtual ~TileFileCache();
+
+    //virtual from DiskTileCache
+    virtual void open();
+
+    //virtual from DiskTileCache
+    virtual bool mightContain(const TileKey& key) const;
+
+    //virtual from DiskTileCache
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime, QByteArray * validators);
+
+    //virtual from DiskTileCache
+    virtual bool write(const TileKey& key,
+                       const QByteArray& data,
+                       const QDateTime& expireTime,
+                       const QByteArray& validators);
+
+    //virtual from DiskTileCache
+    virtual bool contains(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual void remove(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //virtual from DiskTileCache
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    //virtual from DiskTileCache
+    virtual void flush();
+
+protected:
+    //virtual from DiskTileCache
+    virtual qint64 trim(qint64 maxBytes, qint64 targetBytes, quint64 * expiredEvictions, quint64 * lruEvictions);
+
+private:
+    /*!
+     \brief Given the key of a tile, returns the directory where it should be cached on disk. If create is
+     true the directory is created when it doesn't exist yet. Directories are only checked once.
+    */
+    QString getDiskCacheDirectory(const TileKey& key, bool create);
+
+    /*!
+     \brief Given the key of a tile, returns the full path to the file where it should be cached on disk.
+     This is the only place where a tile's coordinates are formatted as text.
+    */
+    QString getDiskCacheFile(const TileKey& key, bool create);
+
+    //The expiration times (in msecs since the epoch) and validators of one <z>/<x> column of tiles, keyed by y
+    struct ExpirationJournal
+    {
+        QString path;
+        QHash<quint32, qint64> expirations;
+        QHash<quint32, QByteArray> validators;
+
+        //Records that haven't been appended to the file yet, how many there are and how many the file holds
+        QByteArray pending;
+        int pendingRecords;
+        int records;
+
+        //The file is in an older format, unreadable or torn, so it has to be rewritten rather than appended to
+        bool outdated;
+    };
+
+    /*!
+     \brief Returns the expiration journal of the key's column, loading it from disk if necessary
+    */
+    ExpirationJournal * getJournal(const TileKey& key);
+
+    void appendJournalRecord(ExpirationJournal * journal, quint32 y, qint64 expires);
+
+    //Moves the expiration times of the tiles we still have from the database earlier versions used to the journals
+    void migrateOldExpirations(const QString& path);
+
+    //Appends pending records to the journal or, if it has grown too much, rewrites it
+    void flushJournal(ExpirationJournal * journal);
+
+    QString _directory;
+    QString _extension;
+
+    //Whether the <z>/<x> directory of a column of tiles exists, for the columns we've looked at
+    QHash<quint64, bool> _columns;
+    mutable QMutex _columnsLock;
+
+    //Journals of the columns that have been used recently
+    QHash<quint64, ExpirationJournal *> _journals;
+};
+
+#endif // TILEFILECACHE_H
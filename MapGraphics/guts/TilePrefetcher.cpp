@@ -0,0 +1,385 @@
+#include "TilePrefetcher.h"
+
+#include "tileSources/CompositeTileSource.h"
+
+#include <QtDebug>
+#include <cmath>
+
+const int DEFAULT_RING_WIDTH = 1;
+const qreal DEFAULT_LOOKAHEAD_SECONDS = 1.0;
+const int DEFAULT_MAX_TILES_PER_SECOND = 20;
+const int DEFAULT_MAX_OUTSTANDING = 8;
+
+//Adds the tiles of rect (or only those on its border) that aren't in exclude and haven't been added yet
+static void appendTiles(QList<TileKey> * tiles,
+                        QSet<TileKey> * seen,
+                        const QRect& rect,
+                        quint8 z,
+                        bool borderOnly = false,
+                        const QRect& exclude = QRect())
+{
+    for (int y = rect.top(); y <= rect.bottom(); y++)
+    {
+        for (int x = rect.left(); x <= rect.right(); x++)
+        {
+            const bool onBorder = (x == rect.left() || x == rect.right() || y == rect.top() || y == rect.bottom());
+            if (borderOnly && !onBorder)
+                continue;
+            if (exclude.contains(x, y))
+                continue;
+
+            const TileKey key(x, y, z);
+            if (seen->contains(key))
+                continue;
+            seen->insert(key);
+            tiles->append(key);
+        }
+    }
+}
+
+TilePrefetcher::TilePrefetcher(QObject *parent) :
+    QObject(parent), _enabled(true), _ringWidth(DEFAULT_RING_WIDTH), _lookahead(DEFAULT_LOOKAHEAD_SECONDS),
+    _maxTilesPerSecond(DEFAULT_MAX_TILES_PER_SECOND), _maxOutstanding(DEFAULT_MAX_OUTSTANDING), _memoryBudget(-1),
+    _tokens(0.0), _haveLastCenter(false), _lastZoom(0)
+{
+    this->resetStats();
+    _stats.bytesHeld = 0;
+}
+
+TilePrefetcher::~TilePrefetcher()
+{
+    this->cancelAll();
+}
+
+QSharedPointer<MapTileSource> TilePrefetcher::tileSource() const
+{
+    return _tileSource;
+}
+
+void TilePrefetcher::setTileSource(QSharedPointer<MapTileSource> tileSource)
+{
+    //What we've requested from the old source is of no use anymore
+    this->cancelAll();
+    _tileSource = tileSource;
+    _haveLastCenter = false;
+}
+
+bool TilePrefetcher::isEnabled() const
+{
+    return _enabled;
+}
+
+void TilePrefetcher::setEnabled(bool enabled)
+{
+    if (enabled == _enabled)
+        return;
+    _enabled = enabled;
+
+    if (!_enabled)
+        this->cancelAll();
+}
+
+int TilePrefetcher::ringWidth() const
+{
+    return _ringWidth;
+}
+
+void TilePrefetcher::setRingWidth(int tiles)
+{
+    _ringWidth = qMax(0, tiles);
+}
+
+qreal TilePrefetcher::lookahead() const
+{
+    return _lookahead;
+}
+
+void TilePrefetcher::setLookahead(qreal seconds)
+{
+    _lookahead = qMax<qreal>(0.0, seconds);
+}
+
+int TilePrefetcher::maxTilesPerSecond() const
+{
+    return _maxTilesPerSecond;
+}
+
+void TilePrefetcher::setMaxTilesPerSecond(int tiles)
+{
+    _maxTilesPerSecond = qMax(0, tiles);
+}
+
+int TilePrefetcher::maxOutstanding() const
+{
+    return _maxOutstanding;
+}
+
+void TilePrefetcher::setMaxOutstanding(int tiles)
+{
+    _maxOutstanding = qMax(0, tiles);
+}
+
+qint64 TilePrefetcher::memoryBudget() const
+{
+    return _memoryBudget;
+}
+
+void TilePrefetcher::setMemoryBudget(qint64 bytes)
+{
+    _memoryBudget = bytes;
+}
+
+void TilePrefetcher::viewChanged(const QPointF &centerQGS, const QRect &shownTiles, quint8 zoomLevel)
+{
+    if (!_enabled || _tileSource.isNull())
+        return;
+
+    //Prefetching from a source that doesn't cache would just fetch every tile twice
+    if (!this->sourceKeepsTiles())
+    {
+        this->cancelAll();
+        return;
+    }
+
+    this->updateVelocity(centerQGS, zoomLevel);
+
+    const QList<TileKey> wanted = this->wantedTiles(shownTiles, zoomLevel);
+    const QSet<TileKey> wantedSet = wanted.toSet();
+
+    //Withdraw requests for tiles that aren't worth it anymore
+    QSet<TileKey>::iterator outstanding = _outstanding.begin();
+    while (outstanding != _outstanding.end())
+    {
+        const TileKey key = *outstanding;
+        if (wantedSet.contains(key))
+        {
+            ++outstanding;
+            continue;
+        }
+        _tileSource->cancelTile(key.x(), key.y(), key.z(), this);
+        outstanding = _outstanding.erase(outstanding);
+    }
+
+    //Forget prefetched tiles the view has moved away from. They stay in the source's memory cache for a while.
+    QHash<TileKey, qint64>::iterator prefetched = _prefetched.begin();
+    while (prefetched != _prefetched.end())
+    {
+        if (wantedSet.contains(prefetched.key()))
+        {
+            ++prefetched;
+            continue;
+        }
+        _stats.wasted++;
+        _stats.bytesHeld -= prefetched.value();
+        prefetched = _prefetched.erase(prefetched);
+    }
+
+    //Refill the rate budget. We allow bursts of up to one second's worth.
+    if (_sinceRefill.isValid())
+        _tokens += _sinceRefill.restart() / 1000.0 * _maxTilesPerSecond;
+    else
+        _sinceRefill.start();
+    _tokens = qMin<qreal>(_tokens, _maxTilesPerSecond);
+
+    //If the source has tiles queued that aren't ours, those are needed right now
+    if (_tileSource->queuedRequests() > _outstanding.size())
+        return;
+
+    const quint16 tileSize = _tileSource->tileSize();
+    const qint64 tileBytes = (qint64) tileSize * tileSize * 4;
+    const qint64 budget = this->effectiveMemoryBudget();
+
+    foreach(const TileKey& key, wanted)
+    {
+        if (_outstanding.size() >= _maxOutstanding || _tokens < 1.0)
+            break;
+
+        //Count the outstanding tiles as if they were already here
+        if (_stats.bytesHeld + (_outstanding.size() + 1) * tileBytes > budget)
+            break;
+
+        if (_outstanding.contains(key) || _prefetched.contains(key))
+            continue;
+
+        _tileSource->requestTile(key.x(), key.y(), key.z(),
+                                 this, "handleTilePrefetched",
+                                 MapTileSource::PrefetchTile);
+        _outstanding.insert(key);
+        _stats.requested++;
+        _tokens -= 1.0;
+    }
+}
+
+void TilePrefetcher::tileNeeded(quint32 x, quint32 y, quint8 z)
+{
+    if (!_enabled || _tileSource.isNull())
+        return;
+
+    const TileKey key(x,y,z);
+    QHash<TileKey, qint64>::iterator it = _prefetched.find(key);
+    if (it != _prefetched.end())
+    {
+        _stats.hits++;
+        _stats.bytesHeld -= it.value();
+        _prefetched.erase(it);
+    }
+    else if (_outstanding.remove(key))
+    {
+        //The view's own request keeps the tile coming, ours isn't needed anymore
+        _stats.lateHits++;
+        _tileSource->cancelTile(x, y, z, this);
+    }
+    else
+        _stats.misses++;
+}
+
+TilePrefetcher::Stats TilePrefetcher::stats() const
+{
+    return _stats;
+}
+
+void TilePrefetcher::resetStats()
+{
+    _stats.requested = 0;
+    _stats.completed = 0;
+    _stats.hits = 0;
+    _stats.lateHits = 0;
+    _stats.misses = 0;
+    _stats.wasted = 0;
+}
+
+qreal TilePrefetcher::hitRate() const
+{
+    const quint64 needed = _stats.hits + _stats.lateHits + _stats.misses;
+    if (needed == 0)
+        return 0.0;
+    return (qreal) _stats.hits / needed;
+}
+
+//private slot
+void TilePrefetcher::handleTilePrefetched(TileKey key, TileImage image)
+{
+    //Cancelled, or the view got to it first
+    if (!_outstanding.remove(key))
+        return;
+    _stats.completed++;
+
+    if (image.isNull())
+        return;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5,10,0)
+    const qint64 bytes = image->sizeInBytes();
+#else
+    const qint64 bytes = image->byteCount();
+#endif
+    _prefetched.insert(key, bytes);
+    _stats.bytesHeld += bytes;
+}
+
+//private
+QList<TileKey> TilePrefetcher::wantedTiles(const QRect &shownTiles, quint8 zoomLevel)
+{
+    QList<TileKey> toRet;
+    QSet<TileKey> seen;
+
+    const quint32 tilesPerSide = sqrt((long double)_tileSource->tilesOnZoomLevel(zoomLevel));
+    if (tilesPerSide == 0 || shownTiles.isEmpty())
+        return toRet;
+    const QRect world(0, 0, tilesPerSide, tilesPerSide);
+
+    //Where the view is headed, if it's moving at all
+    const QPointF ahead = _velocity * _lookahead;
+    if (qAbs(ahead.x()) >= 1.0 || qAbs(ahead.y()) >= 1.0)
+    {
+        const QRect aheadTiles = shownTiles.translated(qRound(ahead.x()), qRound(ahead.y())) & world;
+        appendTiles(&toRet, &seen, aheadTiles, zoomLevel, false, shownTiles);
+    }
+
+    //Around the view, nearest first
+    for (int r = 1; r <= _ringWidth; r++)
+        appendTiles(&toRet, &seen, shownTiles.adjusted(-r, -r, r, r) & world, zoomLevel, true, shownTiles);
+
+    //One level out
+    if (zoomLevel > _tileSource->minZoomLevel())
+    {
+        const QRect parents(QPoint(shownTiles.left() / 2, shownTiles.top() / 2),
+                            QPoint(shownTiles.right() / 2, shownTiles.bottom() / 2));
+        appendTiles(&toRet, &seen, parents, zoomLevel - 1);
+    }
+
+    //One level in, but only under the middle of the view since that's where zooming in takes us
+    if (zoomLevel < qMin(_tileSource->maxZoomLevel(), TileKey::MAX_ZOOM))
+    {
+        const int marginX = shownTiles.width() / 4;
+        const int marginY = shownTiles.height() / 4;
+        const QRect middle = shownTiles.adjusted(marginX, marginY, -marginX, -marginY);
+        const QRect children(QPoint(middle.left() * 2, middle.top() * 2),
+                             QPoint(middle.right() * 2 + 1, middle.bottom() * 2 + 1));
+        appendTiles(&toRet, &seen, children, zoomLevel + 1);
+    }
+
+    return toRet;
+}
+
+//private
+void TilePrefetcher::updateVelocity(const QPointF &centerQGS, quint8 zoomLevel)
+{
+    const quint16 tileSize = _tileSource->tileSize();
+    if (tileSize == 0)
+        return;
+    const QPointF center = centerQGS / tileSize;
+
+    //Zooming isn't panning, so start over
+    if (!_haveLastCenter || zoomLevel != _lastZoom)
+    {
+        _haveLastCenter = true;
+        _lastCenter = center;
+        _lastZoom = zoomLevel;
+        _velocity = QPointF();
+        _sinceLastCenter.start();
+        return;
+    }
+
+    const qint64 elapsed = _sinceLastCenter.restart();
+    if (elapsed <= 0)
+        return;
+
+    //Smooth it out a bit; the view's layout passes don't come at exact intervals
+    const QPointF current = (center - _lastCenter) * (1000.0 / elapsed);
+    _velocity = (_velocity + current) / 2.0;
+    _lastCenter = center;
+}
+
+//private
+void TilePrefetcher::cancelAll()
+{
+    if (!_tileSource.isNull())
+    {
+        foreach(const TileKey& key, _outstanding)
+            _tileSource->cancelTile(key.x(), key.y(), key.z(), this);
+    }
+    _outstanding.clear();
+
+    _prefetched.clear();
+    _stats.bytesHeld = 0;
+}
+
+//private
+qint64 TilePrefetcher::effectiveMemoryBudget() const
+{
+    if (_memoryBudget >= 0)
+        return _memoryBudget;
+    if (_tileSource.isNull())
+        return 0;
+    return _tileSource->memoryCacheCapacity() / 2;
+}
+
+//private
+bool TilePrefetcher::sourceKeepsTiles() const
+{
+    if (_tileSource->cacheMode() != MapTileSource::NoCaching)
+        return true;
+
+    //A composite doesn't cache its combined tiles, but its layers cache theirs
+    return qobject_cast<CompositeTileSource *>(_tileSource.data()) != 0;
+}
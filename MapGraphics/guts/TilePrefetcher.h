@@ -0,0 +1,146 @@
+#ifndef TILEPREFETCHER_H
+#define TILEPREFETCHER_H
+
+#include <QObject>
+#include <QSharedPointer>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QRect>
+#include <QPointF>
+#include <QElapsedTimer>
+
+#include "MapGraphics_global.h"
+#include "MapTileSource.h"
+
+/*!
+ \brief Loads tiles a MapGraphicsView is likely to need soon, so panning and zooming don't start from an
+ empty screen. Owned by the view, which tells it after every layout pass which tiles are shown.
+
+ Prefetched tiles are, in order: the tiles ahead of the view if it's being panned, a ring around the tiles
+ the view shows, the tiles of the next zoom level out, and the tiles of the next zoom level in under the
+ middle of the view. They're requested as MapTileSource::PrefetchTile, so the source serves them after
+ anything that's visible, and new ones are only requested while the source has nothing else queued.
+
+ The amount of prefetching is bounded by a rate (tiles per second), a number of outstanding requests and
+ a memory budget for prefetched tiles that haven't been shown yet. Tiles that aren't wanted anymore are
+ cancelled or forgotten. Sources with MapTileSource::NoCaching aren't prefetched from, except for a
+ CompositeTileSource, whose layers cache.
+*/
+class MAPGRAPHICSSHARED_EXPORT TilePrefetcher : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats
+    {
+        //Tiles requested and received by the prefetcher
+        quint64 requested;
+        quint64 completed;
+
+        //Tiles the view needed that had been prefetched, were still on their way, or hadn't been prefetched
+        quint64 hits;
+        quint64 lateHits;
+        quint64 misses;
+
+        //Prefetched tiles that were given up on before the view needed them
+        quint64 wasted;
+
+        //Memory taken up by prefetched tiles the view hasn't needed yet
+        qint64 bytesHeld;
+    };
+
+public:
+    explicit TilePrefetcher(QObject * parent = 0);
+    ~TilePrefetcher();
+
+    QSharedPointer<MapTileSource> tileSource() const;
+    void setTileSource(QSharedPointer<MapTileSource> tileSource);
+
+    bool isEnabled() const;
+    void setEnabled(bool enabled);
+
+    //How many tiles around the shown ones are prefetched
+    int ringWidth() const;
+    void setRingWidth(int tiles);
+
+    //How far ahead (in seconds of the current pan velocity) tiles are prefetched
+    qreal lookahead() const;
+    void setLookahead(qreal seconds);
+
+    //The bandwidth budget, in tiles per second
+    int maxTilesPerSecond() const;
+    void setMaxTilesPerSecond(int tiles);
+
+    int maxOutstanding() const;
+    void setMaxOutstanding(int tiles);
+
+    /*!
+     \brief The number of bytes of decoded, not yet shown tiles the prefetcher may pull into the source's
+     memory cache. -1 (the default) means half of the source's memory cache capacity.
+    */
+    qint64 memoryBudget() const;
+    void setMemoryBudget(qint64 bytes);
+
+    /*!
+     \brief Called by the view after each layout pass. centerQGS is the center of the view in
+     QGraphicsScene coordinates, shownTiles the tiles the view has requested itself.
+    */
+    void viewChanged(const QPointF& centerQGS, const QRect& shownTiles, quint8 zoomLevel);
+
+    //Called by the view for every tile it requests to show it
+    void tileNeeded(quint32 x, quint32 y, quint8 z);
+
+    TilePrefetcher::Stats stats() const;
+    void resetStats();
+
+    //The fraction of the tiles the view needed that were already prefetched
+    qreal hitRate() const;
+
+private slots:
+    void handleTilePrefetched(TileKey key, TileImage image);
+
+private:
+    //The tiles we'd like to have, most useful first
+    QList<TileKey> wantedTiles(const QRect& shownTiles, quint8 zoomLevel);
+
+    //Tracks the pan velocity, in tiles of zoomLevel per second
+    void updateVelocity(const QPointF& centerQGS, quint8 zoomLevel);
+
+    //Withdraws everything we've requested and forgets what we've prefetched
+    void cancelAll();
+
+    qint64 effectiveMemoryBudget() const;
+
+    //Whether a tile we prefetch is still around when the view needs it
+    bool sourceKeepsTiles() const;
+
+    QSharedPointer<MapTileSource> _tileSource;
+    bool _enabled;
+
+    int _ringWidth;
+    qreal _lookahead;
+    int _maxTilesPerSecond;
+    int _maxOutstanding;
+    qint64 _memoryBudget;
+
+    //Requested but not delivered yet
+    QSet<TileKey> _outstanding;
+
+    //Delivered but not needed by the view yet, with their size in bytes
+    QHash<TileKey, qint64> _prefetched;
+
+    //Rate limiting: tiles we may still request, refilled as time passes
+    qreal _tokens;
+    QElapsedTimer _sinceRefill;
+
+    //Pan tracking
+    bool _haveLastCenter;
+    QPointF _lastCenter;
+    quint8 _lastZoom;
+    QPointF _velocity;
+    QElapsedTimer _sinceLastCenter;
+
+    TilePrefetcher::Stats _stats;
+};
+
+#endif // TILEPREFETCHER_H
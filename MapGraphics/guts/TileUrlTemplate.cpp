@@ -0,0 +1,229 @@
+#include "TileUrlTemplate.h"
+
+//Enough for the digits of any quint64
+const int MAX_DIGITS = 20;
+
+//Quadkeys have one digit per zoom level. TileKey doesn't go beyond 28 levels, this leaves room to spare.
+const int MAX_QUADKEY_DIGITS = 32;
+
+//No allocation
+static void appendNumber(quint64 value, QByteArray * out)
+{
+    char digits[MAX_DIGITS];
+    int count = 0;
+    do
+    {
+        digits[MAX_DIGITS - 1 - count] = char('0' + value % 10);
+        value /= 10;
+        count++;
+    } while (value != 0);
+
+    out->append(digits + MAX_DIGITS - count, count);
+}
+
+TileUrlTemplate::TileUrlTemplate() :
+    _flipY(false)
+{
+}
+
+TileUrlTemplate::TileUrlTemplate(const QString &pattern, const QStringList &shards) :
+    _pattern(pattern), _shardNames(shards), _flipY(false)
+{
+    foreach(const QString& shard, shards)
+        _shards.append(shard.toUtf8());
+
+    this->parse();
+}
+
+QString TileUrlTemplate::pattern() const
+{
+    return _pattern;
+}
+
+QStringList TileUrlTemplate::shards() const
+{
+    return _shardNames;
+}
+
+bool TileUrlTemplate::isValid() const
+{
+    if (_segments.isEmpty())
+        return false;
+
+    //{s} needs something to be replaced by
+    foreach(const Segment& segment, _segments)
+    {
+        if (segment.type == ShardToken && _shards.isEmpty())
+            return false;
+    }
+    return true;
+}
+
+bool TileUrlTemplate::flipY() const
+{
+    return _flipY;
+}
+
+void TileUrlTemplate::setFlipY(bool flip)
+{
+    _flipY = flip;
+}
+
+void TileUrlTemplate::format(quint32 x, quint32 y, quint8 z, QByteArray *out) const
+{
+    //Shard by tile, so the URL of a tile is always the same. When the shard hosts are used as mirrors,
+    //MapGraphicsNetwork replaces the host and picks the shard itself.
+    const int shard = _shards.isEmpty() ? 0 : int((quint64(x) + y) % _shards.size());
+
+    //resize() keeps the capacity of buffers that have been reserve()d, clear() wouldn't
+    out->reserve(qMax(out->capacity(), _pattern.size() * 2 + MAX_QUADKEY_DIGITS));
+    out->resize(0);
+
+    this->append(x, y, z, shard, out);
+}
+
+QUrl TileUrlTemplate::url(quint32 x, quint32 y, quint8 z) const
+{
+    QByteArray buffer;
+    this->format(x, y, z, &buffer);
+    return QUrl::fromEncoded(buffer);
+}
+
+QStringList TileUrlTemplate::shardHosts() const
+{
+    QStringList toRet;
+    if (_shards.size() < 2)
+        return toRet;
+
+    QByteArray buffer;
+    foreach(const QByteArray& shard, _shards)
+    {
+        Q_UNUSED(shard)
+        buffer.resize(0);
+        this->append(0, 0, 0, toRet.size(), &buffer);
+        toRet.append(QUrl::fromEncoded(buffer).host());
+    }
+
+    //{s} is somewhere else (or nowhere), so the shards don't change the host
+    if (toRet.at(0) == toRet.at(1))
+        toRet.clear();
+
+    return toRet;
+}
+
+//private
+void TileUrlTemplate::parse()
+{
+    _segments.clear();
+
+    const QByteArray pattern = _pattern.toUtf8();
+    QByteArray literal;
+
+    int i = 0;
+    while (i < pattern.size())
+    {
+        Segment token;
+        token.type = Literal;
+
+        if (pattern.at(i) == '{')
+        {
+            const int close = pattern.indexOf('}', i);
+            const QByteArray name = (close == -1) ? QByteArray() : pattern.mid(i + 1, close - i - 1);
+
+            if (name == "x")
+                token.type = XToken;
+            else if (name == "y")
+                token.type = YToken;
+            else if (name == "-y")
+                token.type = FlippedYToken;
+            else if (name == "z")
+                token.type = ZToken;
+            else if (name == "s")
+                token.type = ShardToken;
+            else if (name == "quadkey")
+                token.type = QuadkeyToken;
+
+            if (token.type != Literal)
+            {
+                if (!literal.isEmpty())
+                {
+                    Segment text;
+                    text.type = Literal;
+                    text.literal = literal;
+                    _segments.append(text);
+                    literal.clear();
+                }
+                _segments.append(token);
+                i = close + 1;
+                continue;
+            }
+        }
+
+        literal.append(pattern.at(i));
+        i++;
+    }
+
+    if (!literal.isEmpty())
+    {
+        Segment text;
+        text.type = Literal;
+        text.literal = literal;
+        _segments.append(text);
+    }
+}
+
+//private
+void TileUrlTemplate::append(quint32 x, quint32 y, quint8 z, int shard, QByteArray *out) const
+{
+    //The y of TMS tiles is counted from the bottom of the map
+    const quint64 flippedY = (z < 64) ? ((quint64(1) << z) - 1 - y) : y;
+
+    foreach(const Segment& segment, _segments)
+    {
+        switch (segment.type)
+        {
+        case Literal:
+            out->append(segment.literal);
+            break;
+
+        case XToken:
+            appendNumber(x, out);
+            break;
+
+        case YToken:
+            appendNumber(_flipY ? flippedY : y, out);
+            break;
+
+        case FlippedYToken:
+            appendNumber(flippedY, out);
+            break;
+
+        case ZToken:
+            appendNumber(z, out);
+            break;
+
+        case ShardToken:
+            if (!_shards.isEmpty())
+                out->append(_shards.at(shard));
+            break;
+
+        case QuadkeyToken:
+        {
+            char digits[MAX_QUADKEY_DIGITS];
+            const int count = qMin<int>(z, MAX_QUADKEY_DIGITS);
+            for (int level = count; level > 0; level--)
+            {
+                const quint32 mask = 1u << (level - 1);
+                char digit = '0';
+                if (x & mask)
+                    digit += 1;
+                if (y & mask)
+                    digit += 2;
+                digits[count - level] = digit;
+            }
+            out->append(digits, count);
+            break;
+        }
+        }
+    }
+}
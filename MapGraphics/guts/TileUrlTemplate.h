@@ -0,0 +1,83 @@
+#ifndef TILEURLTEMPLATE_H
+#define TILEURLTEMPLATE_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QUrl>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief A tile URL pattern such as "http://{s}.tile.example.org/{z}/{x}/{y}.png", parsed once so that URLs
+ can be produced for many tiles cheaply. Supported placeholders:
+
+ {x}, {y}, {z}  the tile coordinates (XYZ/"slippy map" numbering, y growing southwards)
+ {-y}           y numbered from the south (TMS)
+ {quadkey}      the Bing-style quadkey of the tile
+ {s}            one of the shards, picked by the tile so a tile always maps to the same shard. A source
+                that hands shardHosts() to MapGraphicsNetwork as mirrors lets the network pick instead.
+
+ With flipY set, {y} is numbered from the south as well. Any other text, braces included, is copied as is.
+*/
+class MAPGRAPHICSSHARED_EXPORT TileUrlTemplate
+{
+public:
+    TileUrlTemplate();
+    TileUrlTemplate(const QString& pattern, const QStringList& shards = QStringList());
+
+    QString pattern() const;
+    QStringList shards() const;
+
+    bool isValid() const;
+
+    bool flipY() const;
+    void setFlipY(bool flip);
+
+    /*!
+     \brief Writes the URL of the tile into out, replacing what was there. Reuse the same buffer for many
+     tiles: once it's large enough, no memory is allocated.
+    */
+    void format(quint32 x, quint32 y, quint8 z, QByteArray * out) const;
+
+    QUrl url(quint32 x, quint32 y, quint8 z) const;
+
+    /*!
+     \brief If {s} is part of the host, the host of each shard. The hosts are interchangeable, so they can
+     be handed to MapGraphicsNetwork as mirrors, which then decides the shard of every request (in turn, on
+     retries and when hedging) rather than format(). Empty otherwise.
+    */
+    QStringList shardHosts() const;
+
+private:
+    enum SegmentType
+    {
+        Literal,
+        XToken,
+        YToken,
+        FlippedYToken,
+        ZToken,
+        ShardToken,
+        QuadkeyToken
+    };
+
+    struct Segment
+    {
+        SegmentType type;
+        QByteArray literal;
+    };
+
+    void parse();
+
+    //Appends the URL of the tile to out, using the given shard for {s}
+    void append(quint32 x, quint32 y, quint8 z, int shard, QByteArray * out) const;
+
+    QString _pattern;
+    QStringList _shardNames;
+    QVector<QByteArray> _shards;
+    QVector<Segment> _segments;
+    bool _flipY;
+};
+
+#endif // TILEURLTEMPLATE_H
@@ -0,0 +1,143 @@
+#include "WebMercator.h"
+
+#include <cmath>
+#include <limits>
+
+const qreal PI = 3.14159265358979323846;
+const qreal deg2rad = PI / 180.0;
+const qreal rad2deg = 180.0 / PI;
+
+const qreal WebMercator::MAX_LATITUDE = 85.051128779806592;
+
+namespace
+{
+    //2^z for every zoom level a quint8 can hold, filled in before main() runs
+    struct ZoomScaleTable
+    {
+        ZoomScaleTable()
+        {
+            for (int z = 0; z < 256; z++)
+                scales[z] = std::ldexp(1.0, z);
+        }
+
+        qreal scales[256];
+    };
+
+    const ZoomScaleTable zoomScales;
+
+    /*
+      y = worldSize * (1/2 - atanh(sin(lat)) / 2pi), which is the textbook (1 - ln(tan(pi/4 + lat/2)) / pi) / 2
+      rewritten to need one sin and one log
+    */
+    inline void forward(qreal lon, qreal lat, qreal worldSize, qreal * x, qreal * y)
+    {
+        lat = qBound(-WebMercator::MAX_LATITUDE, lat, WebMercator::MAX_LATITUDE);
+        const qreal s = std::sin(lat * deg2rad);
+
+        *x = (lon + 180.0) * (worldSize / 360.0);
+        *y = worldSize * (0.5 - std::log((1.0 + s) / (1.0 - s)) / (4.0 * PI));
+    }
+
+    //lat = atan(sinh(t)), written as 2 atan(e^t) - pi/2 to need one exp and one atan
+    inline void inverse(qreal x, qreal y, qreal worldSize, qreal * lon, qreal * lat)
+    {
+        const qreal t = PI * (1.0 - 2.0 * y / worldSize);
+
+        *lon = x * (360.0 / worldSize) - 180.0;
+        *lat = rad2deg * (2.0 * std::atan(std::exp(t)) - PI / 2.0);
+    }
+}
+
+//static
+qreal WebMercator::zoomScale(quint8 zoomLevel)
+{
+    return zoomScales.scales[zoomLevel];
+}
+
+//static
+qreal WebMercator::worldSize(quint8 zoomLevel, quint16 tileSize)
+{
+    return zoomScales.scales[zoomLevel] * tileSize;
+}
+
+//static
+quint64 WebMercator::tilesOnZoomLevel(quint8 zoomLevel)
+{
+    if (zoomLevel >= 32)
+        return std::numeric_limits<quint64>::max();
+    return quint64(1) << (2 * zoomLevel);
+}
+
+//static
+QPointF WebMercator::ll2px(const QPointF &ll, quint8 zoomLevel, quint16 tileSize)
+{
+    qreal x, y;
+    forward(ll.x(), ll.y(), WebMercator::worldSize(zoomLevel, tileSize), &x, &y);
+    return QPointF(x, y);
+}
+
+//static
+QPointF WebMercator::px2ll(const QPointF &px, quint8 zoomLevel, quint16 tileSize)
+{
+    qreal lon, lat;
+    inverse(px.x(), px.y(), WebMercator::worldSize(zoomLevel, tileSize), &lon, &lat);
+    return QPointF(lon, lat);
+}
+
+//static
+void WebMercator::ll2px(const qreal *lon, const qreal *lat, qreal *x, qreal *y, int count,
+                        quint8 zoomLevel, quint16 tileSize)
+{
+    const qreal worldSize = WebMercator::worldSize(zoomLevel, tileSize);
+    for (int i = 0; i < count; i++)
+        forward(lon[i], lat[i], worldSize, x + i, y + i);
+}
+
+//static
+void WebMercator::px2ll(const qreal *x, const qreal *y, qreal *lon, qreal *lat, int count,
+                        quint8 zoomLevel, quint16 tileSize)
+{
+    const qreal worldSize = WebMercator::worldSize(zoomLevel, tileSize);
+    for (int i = 0; i < count; i++)
+        inverse(x[i], y[i], worldSize, lon + i, lat + i);
+}
+
+//static
+void WebMercator::ll2px(const QPointF *ll, QPointF *px, int count, quint8 zoomLevel, quint16 tileSize)
+{
+    const qreal worldSize = WebMercator::worldSize(zoomLevel, tileSize);
+    for (int i = 0; i < count; i++)
+    {
+        qreal x, y;
+        forward(ll[i].x(), ll[i].y(), worldSize, &x, &y);
+        px[i] = QPointF(x, y);
+    }
+}
+
+//static
+void WebMercator::px2ll(const QPointF *px, QPointF *ll, int count, quint8 zoomLevel, quint16 tileSize)
+{
+    const qreal worldSize = WebMercator::worldSize(zoomLevel, tileSize);
+    for (int i = 0; i < count; i++)
+    {
+        qreal lon, lat;
+        inverse(px[i].x(), px[i].y(), worldSize, &lon, &lat);
+        ll[i] = QPointF(lon, lat);
+    }
+}
+
+//static
+QPolygonF WebMercator::ll2px(const QPolygonF &ll, quint8 zoomLevel, quint16 tileSize)
+{
+    QPolygonF toRet(ll.size());
+    WebMercator::ll2px(ll.constData(), toRet.data(), ll.size(), zoomLevel, tileSize);
+    return toRet;
+}
+
+//static
+QPolygonF WebMercator::px2ll(const QPolygonF &px, quint8 zoomLevel, quint16 tileSize)
+{
+    QPolygonF toRet(px.size());
+    WebMercator::px2ll(px.constData(), toRet.data(), px.size(), zoomLevel, tileSize);
+    return toRet;
+}
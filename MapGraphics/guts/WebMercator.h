@@ -0,0 +1,50 @@
+#ifndef WEBMERCATOR_H
+#define WEBMERCATOR_H
+
+#include <QPointF>
+#include <QPolygonF>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief The spherical ("Web") Mercator projection used by slippy map tile servers. On zoom level z, the world
+ is a square of tileSize * 2^z pixels with (-180, 85.05) at its top left corner. Longitude is x and latitude is
+ y, both in degrees, as everywhere else in MapGraphics. Latitudes beyond +-MAX_LATITUDE are clamped to it.
+
+ Everything is done in double precision, without rounding to whole pixels. The batch methods take
+ structure-of-arrays input and run the same branch-free loop over every point, with a single sin and log
+ (forward) or exp and atan (inverse) per point. Those are libm calls, so the loops stay scalar unless the
+ compiler has vector math routines to call instead (e.g. GCC with -ffast-math and glibc's libmvec).
+*/
+class MAPGRAPHICSSHARED_EXPORT WebMercator
+{
+public:
+    static const qreal MAX_LATITUDE;
+
+    //2^zoomLevel, from a table
+    static qreal zoomScale(quint8 zoomLevel);
+
+    //The width and height of the world in pixels
+    static qreal worldSize(quint8 zoomLevel, quint16 tileSize);
+
+    //4^zoomLevel, or the largest quint64 if that doesn't fit
+    static quint64 tilesOnZoomLevel(quint8 zoomLevel);
+
+    static QPointF ll2px(const QPointF& ll, quint8 zoomLevel, quint16 tileSize);
+    static QPointF px2ll(const QPointF& px, quint8 zoomLevel, quint16 tileSize);
+
+    //Structure-of-arrays batches. Input and output arrays may be the same (in place), but mustn't overlap otherwise.
+    static void ll2px(const qreal * lon, const qreal * lat, qreal * x, qreal * y, int count,
+                      quint8 zoomLevel, quint16 tileSize);
+    static void px2ll(const qreal * x, const qreal * y, qreal * lon, qreal * lat, int count,
+                      quint8 zoomLevel, quint16 tileSize);
+
+    //Batches of points. ll and px may be the same array.
+    static void ll2px(const QPointF * ll, QPointF * px, int count, quint8 zoomLevel, quint16 tileSize);
+    static void px2ll(const QPointF * px, QPointF * ll, int count, quint8 zoomLevel, quint16 tileSize);
+
+    static QPolygonF ll2px(const QPolygonF& ll, quint8 zoomLevel, quint16 tileSize);
+    static QPolygonF px2ll(const QPolygonF& px, quint8 zoomLevel, quint16 tileSize);
+};
+
+#endif // WEBMERCATOR_H
@@ -0,0 +1,62 @@
+#ifndef WGS84_H
+#define WGS84_H
+
+#include <QtGlobal>
+#include <cmath>
+
+/*
+  The WGS84 ellipsoid and conversions between geodetic (lat/lon in degrees, altitude in meters) and ECEF
+  coordinates. Inline, so the batch loops of Conversions and EnuFrame make no calls per point other than
+  libm's. Those loops don't branch per point, but the sin/cos/sqrt/cbrt/atan2 calls keep them scalar unless
+  the compiler has vector math routines to call instead (e.g. GCC with -ffast-math and glibc's libmvec).
+*/
+namespace Wgs84
+{
+    const qreal PI = 3.141592653589793238462643383;
+    const qreal A_EARTH = 6378137;
+    const qreal FLATTENING = 1.0/298.257223563;
+    const qreal E2 = (2.0-FLATTENING)*FLATTENING;
+    const qreal E4 = E2*E2;
+    const qreal DEG2RAD = PI/180.0;
+    const qreal RAD2DEG = 180.0/PI;
+
+    inline void lla2ecef(qreal lat, qreal lon, qreal alt, qreal * x, qreal * y, qreal * z)
+    {
+        const qreal slat = std::sin(lat*DEG2RAD);
+        const qreal clat = std::cos(lat*DEG2RAD);
+        const qreal r_n = A_EARTH/std::sqrt(1.0 - E2*slat*slat);
+
+        *x = (r_n + alt)*clat*std::cos(lon*DEG2RAD);
+        *y = (r_n + alt)*clat*std::sin(lon*DEG2RAD);
+        *z = (r_n*(1.0 - E2) + alt)*slat;
+    }
+
+    /*
+      Closed-form ECEF -> geodetic conversion (Vermeille, "Direct transformation from geocentric coordinates
+      to geodetic coordinates", 2002). No iteration, so every point costs the same: one cbrt, two atan2 and
+      a few sqrts. Against a converged Newton iteration it's within 1e-13 degrees and 20 nanometers from the
+      equator to the poles and from 10 km below the ellipsoid up to 40000 km above it, which
+      Conversions::test() checks. It breaks down only within ~40 km of the center of the earth.
+    */
+    inline void ecef2lla(qreal x, qreal y, qreal z, qreal * lat, qreal * lon, qreal * alt)
+    {
+        const qreal rhosqrd = x*x + y*y;
+        const qreal p = rhosqrd / (A_EARTH*A_EARTH);
+        const qreal q = (1.0 - E2) / (A_EARTH*A_EARTH) * z*z;
+        const qreal r = (p + q - E4) / 6.0;
+        const qreal s = E4*p*q / (4.0*r*r*r);
+        const qreal t = std::cbrt(1.0 + s + std::sqrt(s*(2.0 + s)));
+        const qreal u = r*(1.0 + t + 1.0/t);
+        const qreal v = std::sqrt(u*u + E4*q);
+        const qreal w = E2*(u + v - q) / (2.0*v);
+        const qreal k = std::sqrt(u + v + w*w) - w;
+        const qreal d = k*std::sqrt(rhosqrd) / (k + E2);
+        const qreal dz = std::sqrt(d*d + z*z);
+
+        *lat = RAD2DEG*2.0*std::atan2(z, d + dz);
+        *lon = RAD2DEG*std::atan2(y, x);
+        *alt = (k + E2 - 1.0) / k * dz;
+    }
+}
+
+#endif // WGS84_H
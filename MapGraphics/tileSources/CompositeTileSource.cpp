@@ -1,17 +1,28 @@
 #include "CompositeTileSource.h"
 
+#include "guts/TileExecutor.h"
+
 #include <QtDebug>
 #include <QPainter>
 #include <QMutexLocker>
-#include <QThread>
-#include <QPointer>
 #include <QTimer>
 
+const int COMPOSITE_MAX_CONCURRENT_REQUESTS = 64;
+
 CompositeTileSource::CompositeTileSource() :
     MapTileSource()
 {
     _globalMutex = new QMutex(QMutex::Recursive);
     this->setCacheMode(MapTileSource::NoCaching);
+
+    //The layers bound how much is loaded at once; we just need to keep enough of them busy
+    this->setMaxConcurrentRequests(COMPOSITE_MAX_CONCURRENT_REQUESTS);
+
+    //Half-composited tiles are useless once the layers change
+    connect(this,
+            SIGNAL(allTilesInvalidated()),
+            this,
+            SLOT(clearPendingTiles()));
 }
 
 CompositeTileSource::~CompositeTileSource()
@@ -22,24 +33,9 @@ CompositeTileSource::~CompositeTileSource()
     //Clean up all data related to pending tiles
     this->clearPendingTiles();
 
-    //Clear the sources
-    //We first find all the sources' threads and put them in a list
-    QList<QPointer<QThread> > tileSourceThreads;
-    foreach(QSharedPointer<MapTileSource> source, _childSources)
-        tileSourceThreads.append(QPointer<QThread>(source->thread()));
-
-    //Then we clear the sources
+    //Clear the sources. Their threads are shared, so there's nothing to wait for.
     _childSources.clear();
 
-    int numThreads = tileSourceThreads.size();
-    //Then we wait for all of those threads to shut down
-    for (int i = 0; i < numThreads; i++)
-    {
-        QPointer<QThread> thread = tileSourceThreads[i];
-        if (!thread.isNull() && thread != this->thread())
-            thread->wait(10000);
-    }
-
     delete this->_globalMutex;
 }
 
@@ -69,6 +65,30 @@ QPointF CompositeTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
     return _childSources.at(0)->qgs2ll(qgs,zoomLevel);
 }
 
+void CompositeTileSource::ll2qgsPoints(const QPointF *ll, QPointF *qgs, int count, quint8 zoomLevel) const
+{
+    QMutexLocker lock(_globalMutex);
+    if (_childSources.isEmpty())
+    {
+        MapTileSource::ll2qgsPoints(ll, qgs, count, zoomLevel);
+        return;
+    }
+
+    _childSources.at(0)->ll2qgsPoints(ll, qgs, count, zoomLevel);
+}
+
+void CompositeTileSource::qgs2llPoints(const QPointF *qgs, QPointF *ll, int count, quint8 zoomLevel) const
+{
+    QMutexLocker lock(_globalMutex);
+    if (_childSources.isEmpty())
+    {
+        MapTileSource::qgs2llPoints(qgs, ll, count, zoomLevel);
+        return;
+    }
+
+    _childSources.at(0)->qgs2llPoints(qgs, ll, count, zoomLevel);
+}
+
 quint64 CompositeTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
 {
     QMutexLocker lock(_globalMutex);
@@ -133,18 +153,16 @@ void CompositeTileSource::addSourceTop(QSharedPointer<MapTileSource> source, qre
     if (source.isNull())
         return;
 
-    //Put the child in its own thread
+    //Put the child on a shared thread
     this->doChildThreading(source);
 
+    //The layers below move up an index, which the tiles we're waiting for are tagged with
+    this->clearPendingTiles();
+
     _childSources.insert(0, source);
     _childOpacities.insert(0,opacity);
     _childEnabledFlags.insert(0,true);
 
-    connect(source.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-            this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
-
     this->sourceAdded(0);
     this->sourcesChanged();
     this->allTilesInvalidated();
@@ -156,18 +174,13 @@ void CompositeTileSource::addSourceBottom(QSharedPointer<MapTileSource> source,
     if (source.isNull())
         return;
 
-    //Put the child in its own thread
+    //Put the child on a shared thread
     this->doChildThreading(source);
 
     _childSources.append(source);
     _childOpacities.append(opacity);
     _childEnabledFlags.append(true);
 
-    connect(source.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-            this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
-
     this->sourceAdded(_childSources.size()-1);
     this->sourcesChanged();
     this->allTilesInvalidated();
@@ -184,6 +197,8 @@ void CompositeTileSource::moveSource(int from, int to)
     if (from >= size || to >= size)
         return;
 
+    this->clearPendingTiles();
+
     _childSources.move(from,to);
     _childOpacities.move(from,to);
     _childEnabledFlags.move(from,to);
@@ -199,10 +214,10 @@ void CompositeTileSource::removeSource(int index)
     if (index < 0 || index >= _childSources.size())
         return;
 
+    this->clearPendingTiles();
     _childSources.removeAt(index);
     _childOpacities.removeAt(index);
     _childEnabledFlags.removeAt(index);
-    this->clearPendingTiles();
 
     this->sourceRemoved(index);
     this->sourcesChanged();
@@ -280,13 +295,13 @@ void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
     //If we have no child sources, just print a message about that
     if (_childSources.isEmpty())
     {
-        QImage * toRet = new QImage(this->tileSize(),
-                                    this->tileSize(),
-                                    QImage::Format_ARGB32_Premultiplied);
-        QPainter painter(toRet);
-        painter.fillRect(toRet->rect(),
+        QImage toRet(this->tileSize(),
+                     this->tileSize(),
+                     QImage::Format_ARGB32_Premultiplied);
+        QPainter painter(&toRet);
+        painter.fillRect(toRet.rect(),
                          Qt::white);
-        painter.drawText(toRet->rect(),
+        painter.drawText(toRet.rect(),
                          QString("Composite Source Empty"),
                          QTextOption(Qt::AlignCenter));
         painter.end();
@@ -295,104 +310,104 @@ void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
     }
 
     //Allocate space in memory to store the tiles as they come before we composite them.
-    //If we already have a space allocated from a previous un-finished request, clear it and start over
-    QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (_pendingTiles.contains(cacheID))
-    {
-        QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-        foreach(QImage * tile, *tiles)
-            delete tile;
-        tiles->clear();
-    }
-    //Otherwise, create a new space
-    else
-        _pendingTiles.insert(cacheID,new QMap<quint32,QImage *>());
+    //MapTileSource doesn't call us again for a tile that's still pending, so the children's tiles collected
+    //so far are never thrown away. Anything left over from before an invalidation is stale, though.
+    _pendingTiles.insert(TileKey(x,y,z), QMap<quint32, TileImage>());
 
-    //Request tiles from all of our beautiful children
+    //Request tiles from all of our beautiful children. Each one is tagged with the index of its layer.
     for (int i = 0; i < _childSources.size(); i++)
     {
         QSharedPointer<MapTileSource> child = _childSources.at(i);
-        child->requestTile(x,y,z);
+        child->requestTile(x,y,z,this,"handleChildTile",i);
     }
 }
 
-//private slot
-void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+void CompositeTileSource::setPriorityCenter(const QPointF &qgs, quint8 zoomLevel)
 {
+    MapTileSource::setPriorityCenter(qgs, zoomLevel);
+
     QMutexLocker lock(_globalMutex);
-    QObject * sender = QObject::sender();
-    MapTileSource * tileSource = qobject_cast<MapTileSource *>(sender);
+    foreach(QSharedPointer<MapTileSource> source, _childSources)
+        source->setPriorityCenter(qgs, zoomLevel);
+}
 
-    //Make sure this slot was called from a signal off a MapTileSource
-    if (!tileSource)
-    {
-        qWarning() << this << "failed MapTileSource cast";
+//protected
+void CompositeTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    QMutexLocker lock(_globalMutex);
+    const TileKey key(x,y,z);
+    if (!_pendingTiles.contains(key))
         return;
-    }
 
-    //Make sure this is a notification from a MapTileSource that we care about
-    int tileSourceIndex = -1;
+    //Withdraw our requests for the layers we haven't received yet and forget what we have
+    const QMap<quint32, TileImage> tiles = _pendingTiles.take(key);
     for (int i = 0; i < _childSources.size(); i++)
     {
-        if (_childSources[i].data() != tileSource)
+        if (tiles.contains(i))
             continue;
-        tileSourceIndex = i;
-        break;
-    }
-
-    if (tileSourceIndex == -1)
-    {
-        qWarning() << this << "received tile from unknown source...";
-        return;
+        _childSources.at(i)->cancelTile(x,y,z,this);
     }
+}
 
+//private slot
+void CompositeTileSource::handleChildTile(TileKey key, TileImage tile, int tileSourceIndex)
+{
+    QMutexLocker lock(_globalMutex);
 
     //Make sure that this is a tile we're interested in
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (!_pendingTiles.contains(cacheID))
-    {
-        qWarning() << this << "received unknown tile" << x << y << z << "from" << tileSource;
+    //(If we aren't, it has probably been cancelled. The child keeps it cached anyway.)
+    if (!_pendingTiles.contains(key) || tileSourceIndex < 0 || tileSourceIndex >= _childSources.size())
         return;
-    }
 
-    //Make sure the tile is non-null
-    QImage * tile = tileSource->getFinishedTile(x,y,z);
-    if (!tile)
-    {
-        qWarning() << this << "received null tile" << x << y << z << "from" << tileSource;
-        return;
-    }
+    //A null tile means the layer has nothing for us, so the composite is built from the others
+    this->collectChildTile(key, tileSourceIndex, tile);
+}
 
-    //qDebug() << this << "Retrieved tile" << x << y << z << "from" << tileSource;
+//private
+void CompositeTileSource::collectChildTile(const TileKey &key, int tileSourceIndex, const TileImage &tile)
+{
+    const quint32 x = key.x();
+    const quint32 y = key.y();
+    const quint8 z = key.z();
 
     /*
-      Put the tile into our pendingTiles structure. If it was the last tile we wanted, build
-      our finishied product and notify our client. If we've already received this tile because
-      it was requested twice for some reason (e.g. crazy zooming in/out) then let's just go ahead
-      and delete the new version and go about our day.
+      Put the tile (null if the layer failed) into our pendingTiles structure. If it was the last tile
+      we wanted, build our finishied product and notify our client. If we've already received this tile
+      because it was requested twice for some reason (e.g. crazy zooming in/out) then let's just go ahead
+      and drop the new version and go about our day.
     */
-    QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-    if (tiles->contains(tileSourceIndex))
-    {
-        delete tile;
+    QMap<quint32, TileImage> & tiles = _pendingTiles[key];
+    if (tiles.contains(tileSourceIndex))
         return;
-    }
-    tiles->insert(tileSourceIndex,tile);
+    tiles.insert(tileSourceIndex,tile);
 
     //Still waiting for a tile or two?
-    if (tiles->size() < _childSources.size())
+    if (tiles.size() < _childSources.size())
         return;
 
+    //If every layer failed, so did we. Our client can ask again later.
+    bool anyTile = false;
+    foreach(const TileImage& childTile, tiles)
+        anyTile = anyTile || !childTile.isNull();
+    if (!anyTile)
+    {
+        _pendingTiles.remove(key);
+        this->prepareFailedTile(x,y,z);
+        return;
+    }
+
     //Time to build the finished composite tile
-    QImage * toRet = new QImage(this->tileSize(),
-                                this->tileSize(),
-                                QImage::Format_ARGB32_Premultiplied);
-    QPainter painter(toRet);
+    QImage toRet(this->tileSize(),
+                 this->tileSize(),
+                 QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&toRet);
     painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     painter.setOpacity(1.0);
-    for (int i = tiles->size()-1; i >= 0; i--)
+    for (int i = tiles.size()-1; i >= 0; i--)
     {
-        QImage * childTile = tiles->value(i);
+        const TileImage childTile = tiles.value(i);
+        if (childTile.isNull())
+            continue;
         qreal opacity = _childOpacities[i];
 
         //If there are no other layers, we need to be opaque no matter what
@@ -403,10 +418,8 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
             opacity = 0.0;
         painter.setOpacity(opacity);
         painter.drawImage(0,0,*childTile);
-        delete childTile;
     }
-    delete tiles;
-    _pendingTiles.remove(cacheID);
+    _pendingTiles.remove(key);
     painter.end();
 
     this->prepareNewlyReceivedTile(x,y,z,toRet);
@@ -415,13 +428,19 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
 //private slot
 void CompositeTileSource::clearPendingTiles()
 {
-    QList<QMap<quint32, QImage *> * > pendingTiles = _pendingTiles.values();
-    for (int i = 0; i < pendingTiles.size(); i++)
+    QMutexLocker lock(_globalMutex);
+
+    //Withdraw what we're still waiting for, so no layer answers under an index that has changed meanwhile
+    QHash<TileKey, QMap<quint32, TileImage> >::const_iterator it;
+    for (it = _pendingTiles.constBegin(); it != _pendingTiles.constEnd(); ++it)
     {
-        QMap<quint32, QImage *> * tiles = pendingTiles.at(i);
-        foreach(QImage * tile, tiles->values())
-            delete tile;
-        delete tiles;
+        const TileKey& key = it.key();
+        for (int i = 0; i < _childSources.size(); i++)
+        {
+            if (it.value().contains(i))
+                continue;
+            _childSources.at(i)->cancelTile(key.x(), key.y(), key.z(), this);
+        }
     }
     _pendingTiles.clear();
 }
@@ -432,18 +451,6 @@ void CompositeTileSource::doChildThreading(QSharedPointer<MapTileSource> source)
     if (source.isNull())
         return;
 
-    //We create a new thread for each child source in our care.
-    QThread * sourceThread = new QThread();
-    sourceThread->start();
-    source->moveToThread(sourceThread);
-
-    //Set the thread up so that it will shutdown and be destroyed when the tilesource is dead
-    connect(source.data(),
-            SIGNAL(destroyed()),
-            sourceThread,
-            SLOT(quit()));
-    connect(sourceThread,
-            SIGNAL(finished()),
-            sourceThread,
-            SLOT(deleteLater()));
+    //Children get a home on the threads all tile sources share, not a thread of their own
+    TileExecutor::getInstance()->adopt(source.data());
 }
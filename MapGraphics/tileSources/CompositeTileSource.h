@@ -23,6 +23,10 @@ public:
     //pure-virtual from MapTileSource
     virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
 
+    virtual void ll2qgsPoints(const QPointF * ll, QPointF * qgs, int count, quint8 zoomLevel) const;
+
+    virtual void qgs2llPoints(const QPointF * qgs, QPointF * ll, int count, quint8 zoomLevel) const;
+
     //pure-virtual from MapTileSource
     virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
 
@@ -53,12 +57,19 @@ public:
     bool getEnabledFlag(int index) const;
     void setEnabledFlag(int index, bool isEnabled);
 
+    //virtual from MapTileSource. The layers get the same priority center.
+    virtual void setPriorityCenter(const QPointF& qgs, quint8 zoomLevel);
+
 
 
 protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
+
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
     
 signals:
     /*!
@@ -76,18 +87,23 @@ signals:
 public slots:
 
 private slots:
-    void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
+    //A layer's tile (null if it failed), tagged with the index of the layer
+    void handleChildTile(TileKey key, TileImage tile, int tileSourceIndex);
     void clearPendingTiles();
 
 private:
     void doChildThreading(QSharedPointer<MapTileSource>);
+
+    //Files a child's tile (null if it failed) and builds the composite once every child has answered
+    void collectChildTile(const TileKey& key, int tileSourceIndex, const TileImage& tile);
+
     QMutex * _globalMutex;
     QList<QSharedPointer<MapTileSource> > _childSources;
     QList<qreal> _childOpacities;
     QList<bool> _childEnabledFlags;
 
-    //A hash of QString:QMap pointer to quint32:QImage pointer
-    QHash<QString, QMap<quint32, QImage *> * > _pendingTiles;
+    //Child tiles received so far for each pending composite tile, keyed by child index
+    QHash<TileKey, QMap<quint32, TileImage> > _pendingTiles;
     
 };
 
@@ -1,5 +1,7 @@
 ﻿#include "FileSystemTileSource.h"
 
+#include "guts/WebMercator.h"
+
 #include "guts/MapGraphicsNetwork.h"
 
 #include <cmath>
@@ -11,10 +13,6 @@
 #include <QDir>
 #include <QFileInfo>
 
-const qreal PI = 3.14159265358979323846;
-const qreal deg2rad = PI / 180.0;
-const qreal rad2deg = 180.0 / PI;
-
 FileSystemTileSource::FileSystemTileSource(const QString &path,
                                              const QString &tile_file_extension,
                                              const QString &tile_pattern)
@@ -25,6 +23,9 @@ FileSystemTileSource::FileSystemTileSource(const QString &path,
 {
     this->setCacheMode(MapTileSource::NoCaching);
 
+    //Holes in the directory have always been shown in white
+    this->setMissingTileColor(Qt::white);
+
     QDir dir(m_path);
     if (!dir.exists())
         qDebug() << "Dir" << m_path << "does not exist.";
@@ -41,31 +42,34 @@ FileSystemTileSource::FileSystemTileSource(const QString &path,
 FileSystemTileSource::~FileSystemTileSource()
 {
     qDebug() << this << this->name() << "Destructing";
+
+    //Tiles that are being loaded still use us
+    this->cancelProducedTiles();
 }
 
 QPointF FileSystemTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
 {
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal x = (ll.x()+180) * (tilesOnOneEdge*tileSize)/360; // coord to pixel!
-    qreal y = (1-(log(tan(PI/4+(ll.y()*deg2rad)/2)) /PI)) /2  * (tilesOnOneEdge*tileSize);
-
-    return QPoint(int(x), int(y));
+    return WebMercator::ll2px(ll, zoomLevel, this->tileSize());
 }
 
 QPointF FileSystemTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
 {
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal longitude = (qgs.x()*(360/(tilesOnOneEdge*tileSize)))-180;
-    qreal latitude = rad2deg*(atan(sinh((1-qgs.y()*(2/(tilesOnOneEdge*tileSize)))*PI)));
+    return WebMercator::px2ll(qgs, zoomLevel, this->tileSize());
+}
+
+void FileSystemTileSource::ll2qgsPoints(const QPointF *ll, QPointF *qgs, int count, quint8 zoomLevel) const
+{
+    WebMercator::ll2px(ll, qgs, count, zoomLevel, this->tileSize());
+}
 
-    return QPointF(longitude, latitude);
+void FileSystemTileSource::qgs2llPoints(const QPointF *qgs, QPointF *ll, int count, quint8 zoomLevel) const
+{
+    WebMercator::px2ll(qgs, ll, count, zoomLevel, this->tileSize());
 }
 
 quint64 FileSystemTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
 {
-    return pow(4.0, zoomLevel);
+    return WebMercator::tilesOnZoomLevel(zoomLevel);
 }
 
 quint16 FileSystemTileSource::tileSize() const
@@ -97,6 +101,13 @@ QString FileSystemTileSource::tileFileExtension() const
 
 //protected
 void FileSystemTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    //Loading and decoding files is thread-safe, so we load as many at once as we're allowed to fetch
+    this->produceTileOnWorker(x,y,z,this->maxConcurrentRequests());
+}
+
+//protected
+void FileSystemTileSource::produceTile(quint32 x, quint32 y, quint8 z)
 {
     QString url = m_tile_pattern;
 
@@ -107,26 +118,7 @@ void FileSystemTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
 
     QString path = m_path + fetchURL + "." + m_tile_file_extension;
 
-    QFileInfo file_info(path);
-    if (file_info.exists())
-    {
-        QImage *image = new QImage(path);
-
-        //Notify client of tile retrieval
-        this->prepareNewlyReceivedTile(x, y, z, image);
-    }
-    else
-    {
-        QImage * image = new QImage(this->tileSize(),
-                                    this->tileSize(),
-                                    QImage::Format_ARGB32_Premultiplied);
-        //It is important to fill with transparent first!
-        image->fill(qRgba(255, 255, 255, 255));
-
-        //Notify client of tile retrieval
-        this->prepareNewlyReceivedTile(x, y, z, image);
-    }
-
+    this->loadTile(x, y, z, path);
 }
 
 void FileSystemTileSource::onLoadImage(quint32 x,
@@ -134,23 +126,31 @@ void FileSystemTileSource::onLoadImage(quint32 x,
                                        quint8 z,
                                        const QString &path)
 {
+    this->loadTile(x, y, z, path);
+}
+
+//private
+void FileSystemTileSource::loadTile(quint32 x, quint32 y, quint8 z, const QString &path)
+{
+    /*
+      Directories with holes in them are common. A missing file is remembered by the negative cache,
+      so we don't look for it again every time the user pans by.
+    */
     QFileInfo file_info(path);
-    if (file_info.exists())
+    if (!file_info.exists())
     {
-        QImage *image = new QImage(path);
-
-        //Notify client of tile retrieval
-        this->prepareNewlyReceivedTile(x, y, z, image);
+        this->prepareMissingTile(x, y, z);
+        return;
     }
-    else
+
+    QImage image;
+    if (!image.load(path))
     {
-        QImage * image = new QImage(this->tileSize(),
-                                    this->tileSize(),
-                                    QImage::Format_ARGB32_Premultiplied);
-        //It is important to fill with transparent first!
-        image->fill(qRgba(255, 255, 255, 255));
-
-        //Notify client of tile retrieval
-        this->prepareNewlyReceivedTile(x, y, z, image);
+        qWarning() << "Failed to load tile" << path;
+        this->prepareFailedTile(x, y, z);
+        return;
     }
+
+    //Notify client of tile retrieval
+    this->prepareNewlyReceivedTile(x, y, z, image);
 }
@@ -22,6 +22,10 @@ public:
 
     virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
 
+    virtual void ll2qgsPoints(const QPointF * ll, QPointF * qgs, int count, quint8 zoomLevel) const;
+
+    virtual void qgs2llPoints(const QPointF * qgs, QPointF * ll, int count, quint8 zoomLevel) const;
+
     virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
 
     virtual quint16 tileSize() const;
@@ -38,6 +42,10 @@ protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
+
+    virtual void produceTile(quint32 x,
+                             quint32 y,
+                             quint8 z);
 signals:
     void loadImage(quint32 x,
                    quint32 y,
@@ -51,6 +59,9 @@ private slots:
                      const QString &path);
 
 private:
+    //Loads the tile from path and hands it over, or reports it missing or failed
+    void loadTile(quint32 x, quint32 y, quint8 z, const QString& path);
+
     QString m_path;
     QString m_tile_pattern;
     QString m_tile_file_extension;
@@ -1,14 +1,12 @@
 ﻿#include "GridTileSource.h"
 
+#include "guts/WebMercator.h"
+
 #include <cmath>
 #include <QPainter>
 #include <QStringBuilder>
 #include <QtDebug>
 
-const qreal PI = 3.14159265358979323846;
-const qreal deg2rad = PI / 180.0;
-const qreal rad2deg = 180.0 / PI;
-
 GridTileSource::GridTileSource() :
     MapTileSource()
 {
@@ -18,31 +16,34 @@ GridTileSource::GridTileSource() :
 GridTileSource::~GridTileSource()
 {
     qDebug() << this << "destructing";
+
+    //Tiles that are being drawn still use us
+    this->cancelProducedTiles();
 }
 
 QPointF GridTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
 {
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal x = (ll.x()+180.0) * (tilesOnOneEdge*tileSize)/360.0; // coord to pixel!
-    qreal y = (1-(log(tan(PI/4.0+(ll.y()*deg2rad)/2)) /PI)) /2.0  * (tilesOnOneEdge*tileSize);
-
-    return QPoint(int(x), int(y));
+    return WebMercator::ll2px(ll, zoomLevel, this->tileSize());
 }
 
 QPointF GridTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
 {
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal longitude = (qgs.x()*(360.0/(tilesOnOneEdge*tileSize)))-180.0;
-    qreal latitude = rad2deg*(atan(sinh((1.0-qgs.y()*(2.0/(tilesOnOneEdge*tileSize)))*PI)));
+    return WebMercator::px2ll(qgs, zoomLevel, this->tileSize());
+}
+
+void GridTileSource::ll2qgsPoints(const QPointF *ll, QPointF *qgs, int count, quint8 zoomLevel) const
+{
+    WebMercator::ll2px(ll, qgs, count, zoomLevel, this->tileSize());
+}
 
-    return QPointF(longitude, latitude);
+void GridTileSource::qgs2llPoints(const QPointF *qgs, QPointF *ll, int count, quint8 zoomLevel) const
+{
+    WebMercator::px2ll(qgs, ll, count, zoomLevel, this->tileSize());
 }
 
 quint64 GridTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
 {
-    return pow(4.0, zoomLevel);
+    return WebMercator::tilesOnZoomLevel(zoomLevel);
 }
 
 quint16 GridTileSource::tileSize() const
@@ -59,7 +60,7 @@ quint8 GridTileSource::minZoomLevel(QPointF ll)
 quint8 GridTileSource::maxZoomLevel(QPointF ll)
 {
     Q_UNUSED(ll)
-    return 50;
+    return TileKey::MAX_ZOOM;
 }
 
 QString GridTileSource::name() const
@@ -73,19 +74,26 @@ QString GridTileSource::tileFileExtension() const
 }
 
 void GridTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    //Drawing a tile is thread-safe, so we draw as many at once as we're allowed to fetch
+    this->produceTileOnWorker(x,y,z,this->maxConcurrentRequests());
+}
+
+//protected
+void GridTileSource::produceTile(quint32 x, quint32 y, quint8 z)
 {
     quint64 leftScenePixel = x*this->tileSize();
     quint64 topScenePixel = y*this->tileSize();
     quint64 rightScenePixel = leftScenePixel + this->tileSize();
     quint64 bottomScenePixel = topScenePixel + this->tileSize();
 
-    QImage * toRet = new QImage(this->tileSize(),
-                                this->tileSize(),
-                                QImage::Format_ARGB32_Premultiplied);
+    QImage toRet(this->tileSize(),
+                 this->tileSize(),
+                 QImage::Format_ARGB32_Premultiplied);
     //It is important to fill with transparent first!
-    toRet->fill(qRgba(0,0,0,0));
+    toRet.fill(qRgba(0,0,0,0));
 
-    QPainter painter(toRet);
+    QPainter painter(&toRet);
     painter.setPen(Qt::black);
     // painter.fillRect(toRet->rect(),QColor(0,0,0,0));
 
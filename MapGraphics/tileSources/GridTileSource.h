@@ -16,6 +16,10 @@ public:
 
     virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
 
+    virtual void ll2qgsPoints(const QPointF * ll, QPointF * qgs, int count, quint8 zoomLevel) const;
+
+    virtual void qgs2llPoints(const QPointF * qgs, QPointF * ll, int count, quint8 zoomLevel) const;
+
     virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
 
     virtual quint16 tileSize() const;
@@ -32,6 +36,10 @@ protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
+
+    virtual void produceTile(quint32 x,
+                             quint32 y,
+                             quint8 z);
     
 signals:
     
@@ -1,73 +1,21 @@
 ﻿#include "OSMTileSource.h"
 
-#include "guts/MapGraphicsNetwork.h"
-
-#include <cmath>
-#include <QPainter>
-#include <QStringBuilder>
-#include <QtDebug>
-#include <QNetworkReply>
-
-const qreal PI = 3.14159265358979323846;
-const qreal deg2rad = PI / 180.0;
-const qreal rad2deg = 180.0 / PI;
-
 OSMTileSource::OSMTileSource(OSMTileType tileType) :
-    MapTileSource(), _tileType(tileType)
+    UrlTemplateTileSource(OSMTileSource::typeName(tileType),
+                          OSMTileSource::urlTemplate(tileType),
+                          OSMTileSource::shards(tileType),
+                          OSMTileSource::fileExtension(tileType))
 {
-    this->setCacheMode(MapTileSource::DiskAndMemCaching);
 }
 
 OSMTileSource::~OSMTileSource()
 {
-    qDebug() << this << this->name() << "Destructing";
-}
-
-QPointF OSMTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
-{
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal x = (ll.x()+180) * (tilesOnOneEdge*tileSize)/360; // coord to pixel!
-    qreal y = (1-(log(tan(PI/4+(ll.y()*deg2rad)/2)) /PI)) /2  * (tilesOnOneEdge*tileSize);
-
-    return QPoint(int(x), int(y));
-}
-
-QPointF OSMTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
-{
-    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
-    const quint16 tileSize = this->tileSize();
-    qreal longitude = (qgs.x()*(360/(tilesOnOneEdge*tileSize)))-180;
-    qreal latitude = rad2deg*(atan(sinh((1-qgs.y()*(2/(tilesOnOneEdge*tileSize)))*PI)));
-
-    return QPointF(longitude, latitude);
-}
-
-quint64 OSMTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
-{
-    return pow(4.0,zoomLevel);
-}
-
-quint16 OSMTileSource::tileSize() const
-{
-    return 256;
-}
-
-quint8 OSMTileSource::minZoomLevel(QPointF ll)
-{
-    Q_UNUSED(ll)
-    return 0;
 }
 
-quint8 OSMTileSource::maxZoomLevel(QPointF ll)
+//static
+QString OSMTileSource::typeName(OSMTileType tileType)
 {
-    Q_UNUSED(ll)
-    return 18;
-}
-
-QString OSMTileSource::name() const
-{
-    switch(_tileType)
+    switch(tileType)
     {
     case OSMTiles:
         return "OpenStreetMap Tiles";
@@ -87,132 +35,42 @@ QString OSMTileSource::name() const
     }
 }
 
-QString OSMTileSource::tileFileExtension() const
-{
-    if (_tileType == OSMTiles || _tileType == MapQuestOSMTiles)
-        return "png";
-    else
-        return "jpg";
-}
-
-//protected
-void OSMTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+//static
+QString OSMTileSource::urlTemplate(OSMTileType tileType)
 {
-    MapGraphicsNetwork * network = MapGraphicsNetwork::getInstance();
-
-    QString host;
-    QString url;
-
-    //Figure out which server to request from based on our desired tile type
-    if (_tileType == OSMTiles)
+    switch(tileType)
     {
-        host = "http://b.tile.openstreetmap.org";
-        url = "/%1/%2/%3.png";
-    }
-    else if (_tileType == MapQuestOSMTiles)
-    {
-        host = "http://otile1.mqcdn.com";
-        url = "/tiles/1.0.0/osm/%1/%2/%3.jpg";
-    }
-    else
-    {
-        host = "http://otile1.mqcdn.com";
-        url = "/tiles/1.0.0/sat/%1/%2/%3.jpg";
-    }
-
-
-    //Use the unique cacheID to see if this tile has already been requested
-    const QString cacheID = this->createCacheID(x,y,z);
-    if (_pendingRequests.contains(cacheID))
-        return;
-    _pendingRequests.insert(cacheID);
-
-    //Build the request
-    const QString fetchURL = url.arg(QString::number(z),
-                                     QString::number(x),
-                                     QString::number(y));
-    QNetworkRequest request(QUrl(host + fetchURL));
+    case OSMTiles:
+        return "http://{s}.tile.openstreetmap.org/{z}/{x}/{y}.png";
+        break;
 
-    //Send the request and setupd a signal to ensure we're notified when it finishes
-    QNetworkReply * reply = network->get(request);
-    _pendingReplies.insert(reply,cacheID);
+    case MapQuestOSMTiles:
+        return "http://{s}.mqcdn.com/tiles/1.0.0/osm/{z}/{x}/{y}.jpg";
+        break;
 
-    connect(reply,
-            SIGNAL(finished()),
-            this,
-            SLOT(handleNetworkRequestFinished()));
+    case MapQuestAerialTiles:
+    default:
+        return "http://{s}.mqcdn.com/tiles/1.0.0/sat/{z}/{x}/{y}.jpg";
+        break;
+    }
 }
 
-//private slot
-void OSMTileSource::handleNetworkRequestFinished()
+//static
+QStringList OSMTileSource::shards(OSMTileType tileType)
 {
-    QObject * sender = QObject::sender();
-    QNetworkReply * reply = qobject_cast<QNetworkReply *>(sender);
-
-    if (reply == 0)
-    {
-        qWarning() << "QNetworkReply cast failure";
-        return;
-    }
-
-    /*
-      We can do this here and use reply later in the function because the reply
-      won't be deleted until execution returns to the event loop.
-    */
-    reply->deleteLater();
-
-    if (!_pendingReplies.contains(reply))
-    {
-        qWarning() << "Unknown QNetworkReply";
-        return;
-    }
-
-    //get the cacheID
-    const QString cacheID = _pendingReplies.take(reply);
-    _pendingRequests.remove(cacheID);
-
-    //If there was a network error, ignore the reply
-    if (reply->error() != QNetworkReply::NoError)
-    {
-        qDebug() << "Network Error:" << reply->errorString();
-        return;
-    }
-
-    //Convert the cacheID back into x,y,z tile coordinates
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
-    {
-        qWarning() << "Failed to convert cacheID" << cacheID << "back to xyz";
-        return;
-    }
-
-    QByteArray bytes = reply->readAll();
-    QImage * image = new QImage();
-
-    if (!image->loadFromData(bytes))
-    {
-        delete image;
-        qWarning() << "Failed to make QImage from network bytes";
-        return;
-    }
-
-    //Figure out how long the tile should be cached
-    QDateTime expireTime;
-    if (reply->hasRawHeader("Cache-Control"))
-    {
-        //We support the max-age directive only for now
-        const QByteArray cacheControl = reply->rawHeader("Cache-Control");
-        QRegExp maxAgeFinder("max-age=(\\d+)");
-        if (maxAgeFinder.indexIn(cacheControl) != -1)
-        {
-            bool ok = false;
-            const qint64 delta = maxAgeFinder.cap(1).toULongLong(&ok);
-
-            if (ok)
-                expireTime = QDateTime::currentDateTimeUtc().addSecs(delta);
-        }
-    }
+    QStringList toRet;
+    if (tileType == OSMTiles)
+        toRet << "a" << "b" << "c";
+    else
+        toRet << "otile1" << "otile2" << "otile3" << "otile4";
+    return toRet;
+}
 
-    //Notify client of tile retrieval
-    this->prepareNewlyReceivedTile(x,y,z, image, expireTime);
+//private static
+QString OSMTileSource::fileExtension(OSMTileType tileType)
+{
+    if (tileType == OSMTiles || tileType == MapQuestOSMTiles)
+        return "png";
+    else
+        return "jpg";
 }
@@ -0,0 +1,238 @@
+#include "UrlTemplateTileSource.h"
+
+#include "guts/WebMercator.h"
+
+#include "guts/MapGraphicsNetwork.h"
+
+#include <QtDebug>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QRegExp>
+
+UrlTemplateTileSource::UrlTemplateTileSource(const QString &name,
+                                             const QString &urlTemplate,
+                                             const QStringList &shards,
+                                             const QString &tileFileExtension) :
+    MapTileSource(),
+    _name(name),
+    _tileFileExtension(tileFileExtension),
+    _urlTemplate(urlTemplate, shards),
+    _minZoom(0),
+    _maxZoom(18),
+    _tileSize(256)
+{
+    if (!_urlTemplate.isValid())
+        qWarning() << "Invalid tile URL template" << urlTemplate << "with shards" << shards;
+
+    //Shards of the host are interchangeable, so the network service picks the shard of each request rather
+    //than the template. That way requests are spread over them and retries and hedges go to another one.
+    _mirrors = _urlTemplate.shardHosts();
+
+    this->setCacheMode(MapTileSource::DiskAndMemCaching);
+}
+
+UrlTemplateTileSource::~UrlTemplateTileSource()
+{
+    qDebug() << this << this->name() << "Destructing";
+
+    //Don't let responses find us after we're gone
+    MapGraphicsNetwork::getInstance()->cancelAll(this);
+
+    //...and tiles that are being decoded
+    this->cancelProducedTiles();
+}
+
+QPointF UrlTemplateTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
+{
+    return WebMercator::ll2px(ll, zoomLevel, this->tileSize());
+}
+
+QPointF UrlTemplateTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
+{
+    return WebMercator::px2ll(qgs, zoomLevel, this->tileSize());
+}
+
+void UrlTemplateTileSource::ll2qgsPoints(const QPointF *ll, QPointF *qgs, int count, quint8 zoomLevel) const
+{
+    WebMercator::ll2px(ll, qgs, count, zoomLevel, this->tileSize());
+}
+
+void UrlTemplateTileSource::qgs2llPoints(const QPointF *qgs, QPointF *ll, int count, quint8 zoomLevel) const
+{
+    WebMercator::px2ll(qgs, ll, count, zoomLevel, this->tileSize());
+}
+
+quint64 UrlTemplateTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
+{
+    return WebMercator::tilesOnZoomLevel(zoomLevel);
+}
+
+quint16 UrlTemplateTileSource::tileSize() const
+{
+    return _tileSize;
+}
+
+quint8 UrlTemplateTileSource::minZoomLevel(QPointF ll)
+{
+    Q_UNUSED(ll)
+    return _minZoom;
+}
+
+quint8 UrlTemplateTileSource::maxZoomLevel(QPointF ll)
+{
+    Q_UNUSED(ll)
+    return _maxZoom;
+}
+
+QString UrlTemplateTileSource::name() const
+{
+    return _name;
+}
+
+QString UrlTemplateTileSource::tileFileExtension() const
+{
+    return _tileFileExtension;
+}
+
+TileUrlTemplate UrlTemplateTileSource::urlTemplate() const
+{
+    return _urlTemplate;
+}
+
+bool UrlTemplateTileSource::isTms() const
+{
+    return _urlTemplate.flipY();
+}
+
+void UrlTemplateTileSource::setTms(bool tms)
+{
+    _urlTemplate.setFlipY(tms);
+}
+
+void UrlTemplateTileSource::setZoomRange(quint8 minZoom, quint8 maxZoom)
+{
+    //Deeper tiles have no keys
+    minZoom = qMin(minZoom, TileKey::MAX_ZOOM);
+    maxZoom = qMin(maxZoom, TileKey::MAX_ZOOM);
+
+    _minZoom = qMin(minZoom, maxZoom);
+    _maxZoom = qMax(minZoom, maxZoom);
+}
+
+void UrlTemplateTileSource::setTileSize(quint16 tileSize)
+{
+    if (tileSize == 0)
+        return;
+    _tileSize = tileSize;
+}
+
+//protected
+void UrlTemplateTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    this->sendTileRequest(x, y, z, QByteArray(), QByteArray());
+}
+
+//protected
+void UrlTemplateTileSource::revalidateTile(quint32 x, quint32 y, quint8 z, const QByteArray &etag, const QByteArray &lastModified)
+{
+    this->sendTileRequest(x, y, z, etag, lastModified);
+}
+
+//private
+void UrlTemplateTileSource::sendTileRequest(quint32 x, quint32 y, quint8 z, const QByteArray &etag, const QByteArray &lastModified)
+{
+    //The server doesn't have tiles outside of its zoom range, there's no need to ask
+    if (z < _minZoom || z > _maxZoom)
+    {
+        this->prepareMissingTile(x, y, z);
+        return;
+    }
+
+    //MapTileSource makes sure the same tile isn't requested twice at once
+    const TileKey key(x,y,z);
+
+    //Build the request
+    _urlTemplate.format(x, y, z, &_urlBuffer);
+    QNetworkRequest request(QUrl::fromEncoded(_urlBuffer));
+
+    //If we have the tile already, the server only has to send it if it changed
+    if (!etag.isEmpty())
+        request.setRawHeader("If-None-Match", etag);
+    if (!lastModified.isEmpty())
+        request.setRawHeader("If-Modified-Since", lastModified);
+
+    //Queue the request. The network service spreads it over the mirrors and calls us back when it's done.
+    const quint64 ticket = MapGraphicsNetwork::getInstance()->queueGet(request, this, "handleNetworkReply", _mirrors);
+    _pendingTickets.insert(ticket, key);
+    _ticketsByTile.insert(key, ticket);
+}
+
+//protected
+void UrlTemplateTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+
+    const quint64 ticket = _ticketsByTile.take(key);
+    if (ticket == 0)
+        return;
+    _pendingTickets.remove(ticket);
+
+    MapGraphicsNetwork::getInstance()->cancel(ticket);
+}
+
+//private slot
+void UrlTemplateTileSource::handleNetworkReply(quint64 ticket, NetworkResponse response)
+{
+    //Cancelled while the response was on its way to us
+    if (!_pendingTickets.contains(ticket))
+        return;
+
+    //get the key of the tile
+    const TileKey key = _pendingTickets.take(ticket);
+    if (_ticketsByTile.value(key) == ticket)
+        _ticketsByTile.remove(key);
+
+    //Figure out how long the tile (or its absence) should be cached
+    QDateTime expireTime;
+    const QByteArray cacheControl = response.header("Cache-Control");
+    if (!cacheControl.isEmpty())
+    {
+        //We support the max-age directive only for now
+        QRegExp maxAgeFinder("max-age=(\\d+)");
+        if (maxAgeFinder.indexIn(cacheControl) != -1)
+        {
+            bool ok = false;
+            const qint64 delta = maxAgeFinder.cap(1).toULongLong(&ok);
+
+            if (ok)
+                expireTime = QDateTime::currentDateTimeUtc().addSecs(delta);
+        }
+    }
+
+    //There is no such tile (e.g. over the ocean), which the negative cache remembers
+    if (response.httpStatus == 404 || response.httpStatus == 204)
+    {
+        this->prepareMissingTile(key.x(),key.y(),key.z(), expireTime);
+        return;
+    }
+
+    //If there was a network error, ignore the reply
+    if (response.error != QNetworkReply::NoError)
+    {
+        qDebug() << "Network Error:" << response.errorString;
+        this->prepareFailedTile(key.x(),key.y(),key.z());
+        return;
+    }
+
+    //Our cached copy is still current
+    if (response.httpStatus == 304)
+    {
+        this->prepareNotModifiedTile(key.x(),key.y(),key.z(), expireTime);
+        return;
+    }
+
+    //The tile is decoded on a worker, so we can go on with the next response
+    //The disk cache stores the bytes exactly as the server sent them
+    this->prepareEncodedTile(key.x(),key.y(),key.z(), response.body, expireTime,
+                             response.header("ETag"), response.header("Last-Modified"));
+}
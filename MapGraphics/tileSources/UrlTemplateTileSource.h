@@ -0,0 +1,109 @@
+#ifndef URLTEMPLATETILESOURCE_H
+#define URLTEMPLATETILESOURCE_H
+
+#include "MapTileSource.h"
+#include "MapGraphics_global.h"
+#include <QHash>
+#include <QStringList>
+
+#include "guts/TileUrlTemplate.h"
+
+//A plain value, so projects that import us as a library don't necessarily have to use QT += network
+#include "guts/NetworkResponse.h"
+
+/**
+ * @brief A tile source for any server that serves Web Mercator tiles under URLs that can be described by
+ * a TileUrlTemplate, e.g. "http://{s}.tile.openstreetmap.org/{z}/{x}/{y}.png" with the shards a, b and c.
+ * Servers that number y from the south (TMS) are supported by setTms(true) or by using {-y}, Bing-style
+ * servers by {quadkey}. If {s} is part of the host, the shards' hosts are MapGraphicsNetwork mirrors: requests
+ * go to them in turn and are retried or hedged on another one, so a tile isn't tied to one shard.
+ *
+ * Tiles are cached on disk and in memory. Responses are handled the same way for every server: 404 and
+ * 204 mean there is no tile, Cache-Control max-age sets when the tile expires and ETag/Last-Modified are
+ * used to revalidate it.
+ */
+class MAPGRAPHICSSHARED_EXPORT UrlTemplateTileSource : public MapTileSource
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief name must be unique among the sources in use, as it's also the name of the source's disk
+     * cache.
+     */
+    explicit UrlTemplateTileSource(const QString& name,
+                                   const QString& urlTemplate,
+                                   const QStringList& shards = QStringList(),
+                                   const QString& tileFileExtension = "png");
+    virtual ~UrlTemplateTileSource();
+
+    virtual QPointF ll2qgs(const QPointF& ll, quint8 zoomLevel) const;
+
+    virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
+
+    virtual void ll2qgsPoints(const QPointF * ll, QPointF * qgs, int count, quint8 zoomLevel) const;
+
+    virtual void qgs2llPoints(const QPointF * qgs, QPointF * ll, int count, quint8 zoomLevel) const;
+
+    virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
+
+    virtual quint16 tileSize() const;
+
+    virtual quint8 minZoomLevel(QPointF ll);
+
+    virtual quint8 maxZoomLevel(QPointF ll);
+
+    virtual QString name() const;
+
+    virtual QString tileFileExtension() const;
+
+    TileUrlTemplate urlTemplate() const;
+
+    //Whether the server numbers y from the south. Set up the source before it's used.
+    bool isTms() const;
+    void setTms(bool tms);
+
+    //Tiles outside of the zoom range are reported missing without asking the server. Capped at TileKey::MAX_ZOOM.
+    void setZoomRange(quint8 minZoom, quint8 maxZoom);
+
+    void setTileSize(quint16 tileSize);
+
+protected:
+    virtual void fetchTile(quint32 x,
+                           quint32 y,
+                           quint8 z);
+
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
+
+    virtual void revalidateTile(quint32 x,
+                                quint32 y,
+                                quint8 z,
+                                const QByteArray& etag,
+                                const QByteArray& lastModified);
+
+private:
+    //Requests the tile, conditionally if we're given validators
+    void sendTileRequest(quint32 x, quint32 y, quint8 z, const QByteArray& etag, const QByteArray& lastModified);
+
+    QString _name;
+    QString _tileFileExtension;
+    TileUrlTemplate _urlTemplate;
+    QStringList _mirrors;
+    quint8 _minZoom;
+    quint8 _maxZoom;
+    quint16 _tileSize;
+
+    //Reused for every URL we build, so formatting them doesn't allocate
+    QByteArray _urlBuffer;
+
+    //Hash used to keep track of what tile goes with what network ticket, and the other way around
+    QHash<quint64, TileKey> _pendingTickets;
+    QHash<TileKey, quint64> _ticketsByTile;
+
+private slots:
+    void handleNetworkReply(quint64 ticket, NetworkResponse response);
+
+};
+
+#endif // URLTEMPLATETILESOURCE_H
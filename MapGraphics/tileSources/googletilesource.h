@@ -1,14 +1,9 @@
 ﻿#pragma once
 
-#include "MapTileSource.h"
+#include "UrlTemplateTileSource.h"
 #include "MapGraphics_global.h"
-#include <QSet>
-#include <QHash>
 
-//Forward declaration so that projects that import us as a library don't necessarily have to use QT += network
-class QNetworkReply;
-
-class MAPGRAPHICSSHARED_EXPORT GoogleTileSource : public MapTileSource
+class MAPGRAPHICSSHARED_EXPORT GoogleTileSource : public UrlTemplateTileSource
 {
     Q_OBJECT
 public:
@@ -28,42 +23,13 @@ public:
     explicit GoogleTileSource(GoogleTileSource::GoogleTileType tileType = SKELETON_MAP_LIGHT);
     virtual ~GoogleTileSource();
 
-    virtual QPointF ll2qgs(const QPointF& ll, quint8 zoomLevel) const;
-
-    virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
-
-    virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
-
-    virtual quint16 tileSize() const;
-
-    virtual quint8 minZoomLevel(QPointF ll);
-
-    virtual quint8 maxZoomLevel(QPointF ll);
-
-    virtual QString name() const;
-
-    virtual QString tileFileExtension() const;
-
-protected:
-    virtual void fetchTile(quint32 x,
-                           quint32 y,
-                           quint8 z);
+    //The name and the URL template of the servers of a tile type, and the shards the template's {s} stands for
+    static QString typeName(GoogleTileSource::GoogleTileType tileType);
+    static QString urlTemplate(GoogleTileSource::GoogleTileType tileType);
+    static QStringList shards();
 
 private:
-    GoogleTileSource::GoogleTileType _tileType;
-
-    //Set used to ensure a tile with a certain cacheID isn't requested twice
-    QSet<QString> _pendingRequests;
-
-    //Hash used to keep track of what cacheID goes with what reply
-    QHash<QNetworkReply *, QString> _pendingReplies;
-    
-signals:
-    
-public slots:
-
-private slots:
-    void handleNetworkRequestFinished();
+    static QString fileExtension(GoogleTileSource::GoogleTileType tileType);
     
 };
 
@@ -14,6 +14,7 @@
 #include <QSettings>
 
 #include "guts/MapGraphicsNetwork.h"
+#include "tileSources/GoogleTileSource.h"
 
 #include "TileDownloader.h"
 
@@ -44,13 +45,14 @@ MainWindow::MainWindow(QWidget *parent)
     ui->spin_log_buffer_size->setRange(10, 1000000);
     ui->spin_log_buffer_size->setValue(1000);
 
-    addMapType("Google Map Tiles", "http://mt2.google.cn/vt/lyrs=m&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Skeleton Map Light Tiles", "http://mt2.google.cn/vt/lyrs=h&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Skeleton Map Dark Tiles", "http://mt0.google.cn/vt/lyrs=r&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Terrain Tiles", "http://mt2.google.cn/vt/lyrs=t&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Terrain Map Tiles", "http://mt2.google.cn/vt/lyrs=p&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Satellite Tiles", "http://mt3.google.cn/vt/lyrs=s&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
-    addMapType("Google Hybrid Satellite Map Tiles", "http://mt1.google.cn/vt/lyrs=y&hl=zh-CN&gl=cn&x=%1&y=%2&z=%3");
+    //The same servers the library's GoogleTileSource uses
+    for (int type = GoogleTileSource::MAP; type <= GoogleTileSource::HYBRID_SATELLITE_MAP; type++)
+    {
+        const GoogleTileSource::GoogleTileType tileType = (GoogleTileSource::GoogleTileType) type;
+        addMapType(GoogleTileSource::typeName(tileType),
+                   GoogleTileSource::urlTemplate(tileType),
+                   GoogleTileSource::shards());
+    }
 
     ui->combo_map_type->setCurrentIndex(6);
 
@@ -69,8 +71,8 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->btn_browse, SIGNAL(clicked(bool)),
             this, SLOT(onBrowseFolder()));
 
-    connect(this, SIGNAL(startDownload(QPointF,QPointF,int,QString,QString,bool)),
-            m_downloader, SLOT(download(QPointF,QPointF,int,QString,QString,bool)));
+    connect(this, SIGNAL(startDownload(QPointF,QPointF,int,QString,QStringList,QString,bool)),
+            m_downloader, SLOT(download(QPointF,QPointF,int,QString,QStringList,QString,bool)));
 
     connect(m_downloader, SIGNAL(dbg(QString)),
             this, SLOT(dbg(QString)));
@@ -139,9 +141,10 @@ QPointF MainWindow::getGeoStop(bool *ok)
     return QPointF(lon, lat);
 }
 
-void MainWindow::addMapType(const QString &name, const QString &url_pattern)
+void MainWindow::addMapType(const QString &name, const QString &url_pattern, const QStringList &shards)
 {
-    ui->combo_map_type->addItem(name, url_pattern);
+    //The pattern comes first, then the shards its {s} stands for
+    ui->combo_map_type->addItem(name, QStringList() << url_pattern << shards);
 }
 
 void MainWindow::dbg(const QString &message)
@@ -196,13 +199,14 @@ void MainWindow::on_btn_start_clicked()
     QPointF geo_stop = getGeoStop(&ok);
     if (!ok) return;
 
-    QString url_pattern = ui->combo_map_type->currentData().toString();
+    QStringList shards = ui->combo_map_type->currentData().toStringList();
+    QString url_pattern = shards.takeFirst();
 
     ui->btn_start->setEnabled(false);
     ui->text_browser_log->setFocus();
     ui->statusBar->clearMessage();
 
-    emit startDownload(geo_start, geo_stop, z, url_pattern,
+    emit startDownload(geo_start, geo_stop, z, url_pattern, shards,
                        ui->line_path_to_save->text(), !ui->check_skip->isChecked());
 }
 
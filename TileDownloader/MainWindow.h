@@ -4,6 +4,7 @@
 #include <QMainWindow>
 #include <QSet>
 #include <QHash>
+#include <QStringList>
 
 namespace Ui {
 class MainWindow;
@@ -36,13 +37,13 @@ private slots:
 
 signals:
     void startDownload(QPointF geo_start, QPointF geo_stop, int zoom_level,
-                       const QString &url_pattern, const QString &path_to_save,
-                       bool overwrite);
+                       const QString &url_pattern, const QStringList &shards,
+                       const QString &path_to_save, bool overwrite);
 
 private:
     QPointF getGeoStart(bool *ok);
     QPointF getGeoStop(bool *ok);
-    void addMapType(const QString &name, const QString &url_pattern);
+    void addMapType(const QString &name, const QString &url_pattern, const QStringList &shards);
 
 private:
     Ui::MainWindow *ui;
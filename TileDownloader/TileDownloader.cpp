@@ -1,6 +1,5 @@
 ﻿#include "TileDownloader.h"
 
-#include <cmath>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 #include <QStringBuilder>
@@ -11,13 +10,10 @@
 #include <QApplication>
 
 #include "guts/MapGraphicsNetwork.h"
+#include "guts/WebMercator.h"
 
 #include <QDebug>
 
-const qreal PI = 3.14159265358979323846;
-const qreal deg2rad = PI / 180.0;
-const qreal rad2deg = 180.0 / PI;
-
 TileDownloader::TileDownloader(QObject *parent)
     : QObject(parent)
     , m_tiles_count(0)
@@ -27,11 +23,10 @@ TileDownloader::TileDownloader(QObject *parent)
 
 QPoint TileDownloader::latlon2xy(qreal lon, qreal lat, int zoom)
 {
-    // reference: http://blog.csdn.net/youngkingyj/article/details/23365849
-    qreal x = pow(2.0, zoom-1) * (lon / 180 + 1);
-    qreal y = pow(2.0, zoom-1) * (1 - log(tan(lat*deg2rad) + 1/cos(lat*deg2rad)) / PI);
+    //With tiles one pixel wide, pixels are tiles
+    const QPointF tile = WebMercator::ll2px(QPointF(lon, lat), zoom, 1);
 
-    return QPoint(int(x), int(y));
+    return QPoint(int(tile.x()), int(tile.y()));
 }
 
 QString TileDownloader::createCacheID(quint32 x, quint32 y, quint8 z)
@@ -105,31 +100,27 @@ void TileDownloader::downloadRow(int row)
         m_pending_requests.insert(cacheID);
 
         //Build the request
-        const QString fetchURL = m_url_pattern.arg(QString::number(x),
-                                         QString::number(y),
-                                         QString::number(z));
-        QNetworkRequest request(QUrl(fetchURL + ""));
-
-        //Send the request and setupd a signal to ensure we're notified when it finishes
-        QNetworkReply * reply = network->get(request);
-        m_pending_replies.insert(reply, cacheID);
-
-        connect(reply, SIGNAL(finished()),
-                this, SLOT(handleNetworkRequestFinished()));
+        m_url_template.format(x, y, z, &m_url_buffer);
+        QNetworkRequest request(QUrl::fromEncoded(m_url_buffer));
 
+        //Queue the request. We're called back with the response when it's done.
+        const quint64 ticket = network->queueGet(request, this, "handleNetworkReply", m_mirrors);
+        m_pending_replies.insert(ticket, cacheID);
     }
 
     checkProgress();
 }
 
 void TileDownloader::download(QPointF geo_start, QPointF geo_stop, int zoom_level,
-                              const QString &url_pattern, const QString &path_to_save, bool overwrite)
+                              const QString &url_pattern, const QStringList &shards,
+                              const QString &path_to_save, bool overwrite)
 {
     m_tiles_count = 0;
     m_downloaded_count = 0;
     m_overwrite = overwrite;
     m_zoom_level = zoom_level;
-    m_url_pattern = url_pattern;
+    m_url_template = TileUrlTemplate(url_pattern, shards);
+    m_mirrors = m_url_template.shardHosts();
     m_path_to_save = path_to_save;
     m_start = latlon2xy(geo_start.x(), geo_start.y(), m_zoom_level);
     m_stop = latlon2xy(geo_stop.x(), geo_stop.y(), m_zoom_level);
@@ -165,31 +156,16 @@ void TileDownloader::download(QPointF geo_start, QPointF geo_stop, int zoom_leve
     downloadRow(m_current_row);
 }
 
-void TileDownloader::handleNetworkRequestFinished()
+void TileDownloader::handleNetworkReply(quint64 ticket, NetworkResponse response)
 {
-    QObject * sender = QObject::sender();
-    QNetworkReply * reply = qobject_cast<QNetworkReply *>(sender);
-
-    if (reply == 0)
-    {
-        qWarning() << "QNetworkReply cast failure";
-        return;
-    }
-
-    /*
-      We can do this here and use reply later in the function because the reply
-      won't be deleted until execution returns to the event loop.
-    */
-    reply->deleteLater();
-
-    if (!m_pending_replies.contains(reply))
+    if (!m_pending_replies.contains(ticket))
     {
-        qWarning() << "Unknown QNetworkReply";
+        qWarning() << "Unknown network ticket" << ticket;
         return;
     }
 
     //get the cacheID
-    const QString cacheID = m_pending_replies.take(reply);
+    const QString cacheID = m_pending_replies.take(ticket);
     m_pending_requests.remove(cacheID);
 
     ++m_downloaded_count;
@@ -199,9 +175,9 @@ void TileDownloader::handleNetworkRequestFinished()
                      .arg(m_tiles_count));
 
     //If there was a network error, ignore the reply
-    if (reply->error() != QNetworkReply::NoError)
+    if (response.error != QNetworkReply::NoError)
     {
-        qDebug() << "Network Error:" << reply->errorString();
+        qDebug() << "Network Error:" << response.errorString;
         return;
     }
 
@@ -213,10 +189,9 @@ void TileDownloader::handleNetworkRequestFinished()
         return;
     }
 
-    QByteArray bytes = reply->readAll();
     QImage * image = new QImage();
 
-    if (!image->loadFromData(bytes))
+    if (!image->loadFromData(response.body))
     {
         delete image;
         qWarning() << "Failed to make QImage from network bytes";
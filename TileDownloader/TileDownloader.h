@@ -4,8 +4,10 @@
 #include <QPointF>
 #include <QSet>
 #include <QHash>
+#include <QStringList>
 
-class QNetworkReply;
+#include "guts/NetworkResponse.h"
+#include "guts/TileUrlTemplate.h"
 
 class TileDownloader : public QObject
 {
@@ -20,11 +22,11 @@ signals:
 
 public slots:
     void download(QPointF geo_start, QPointF geo_stop, int zoom_level,
-                  const QString &url_pattern, const QString &path_to_save,
-                  bool overwrite);
+                  const QString &url_pattern, const QStringList &shards,
+                  const QString &path_to_save, bool overwrite);
 
 private slots:
-    void handleNetworkRequestFinished();
+    void handleNetworkReply(quint64 ticket, NetworkResponse response);
 
 private:
     QPoint latlon2xy(qreal lon, qreal lat, int zoom);
@@ -60,8 +62,8 @@ private:
     //Set used to ensure a tile with a certain cacheID isn't requested twice
     QSet<QString> m_pending_requests;
 
-    //Hash used to keep track of what cacheID goes with what reply
-    QHash<QNetworkReply *, QString> m_pending_replies;
+    //Hash used to keep track of what cacheID goes with what network ticket
+    QHash<quint64, QString> m_pending_replies;
 
     QString m_path_to_save;
     int m_tiles_count;
@@ -71,5 +73,7 @@ private:
     int m_zoom_level;
     int m_current_row;
     bool m_overwrite;
-    QString m_url_pattern;
+    TileUrlTemplate m_url_template;
+    QStringList m_mirrors;
+    QByteArray m_url_buffer;
 };